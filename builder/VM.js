@@ -7,7 +7,7 @@ let quitOnError;
 
 class CompileJob extends EventEmitter
 {
-    constructor(commandLine, argv0, id, vm) {
+    constructor(commandLine, argv0, id, vm, pump, headerCache) {
         super();
         this.vm = vm;
         this.commandLine = commandLine;
@@ -15,9 +15,15 @@ class CompileJob extends EventEmitter
         this.id = id;
         this.dir = path.join(vm.root, 'compiles', "" + this.id);
         this.vmDir = path.join('/', 'compiles', "" + this.id);
+        this.pump = pump;
+        this.headerCache = headerCache;
         fs.mkdirpSync(this.dir);
-        this.fd = fs.openSync(path.join(this.dir, 'sourcefile'), "w");
-        this.cppSize = 0;
+        if (pump) {
+            this.cppSize = pump.files.reduce((total, file) => total + (file.size || 0), 0);
+        } else {
+            this.fd = fs.openSync(path.join(this.dir, 'sourcefile'), "w");
+            this.cppSize = 0;
+        }
         this.startCompile = undefined;
     }
 
@@ -29,16 +35,42 @@ class CompileJob extends EventEmitter
     }
 
     feed(data, last) {
+        if (this.pump) {
+            // the client's files are all in the header cache by now
+            if (last) {
+                this.materialize().then(() => {
+                    this.send({ root: path.join(this.vmDir, 'root'), cwd: this.pump.cwd, systemDirs: this.pump.systemDirs });
+                }).catch(err => {
+                    this.vm.compileFinished({type: 'compileFinished', success: false, id: this.id, files: [], exitCode: -1, error: `Failed to set up pumped files ${err.toString()}` });
+                });
+            }
+            return;
+        }
         fs.writeSync(this.fd, data);
         this.cppSize += data.length;
         if (last) {
             this.startCompile = Date.now();
             fs.close(this.fd);
             this.fd = undefined;
-            this.vm.child.send({ type: "compile", commandLine: this.commandLine, argv0: this.argv0, id: this.id, dir: this.vmDir}, this.sendCallback.bind(this));
+            this.send();
         }
     }
 
+    send(pump) {
+        this.startCompile = Date.now();
+        this.vm.child.send({ type: "compile", commandLine: this.commandLine, argv0: this.argv0, id: this.id, dir: this.vmDir, pump: pump }, this.sendCallback.bind(this));
+    }
+
+    // Links the client's files into <dir>/root where they were on the client
+    materialize() {
+        const root = path.join(this.dir, 'root');
+        const dirs = new Set(this.pump.dirs);
+        this.pump.files.forEach(file => dirs.add(path.dirname(file.path)));
+        return Promise.all(Array.from(dirs).map(dir => fs.mkdirp(path.join(root, dir))))
+            .then(() => fs.mkdirp(path.join(this.dir, 'out')))
+            .then(() => Promise.all(this.pump.files.map(file => this.headerCache.link(file.hash, path.join(root, file.path)))));
+    }
+
     cancel() {
         this.vm.child.send({ type: "cancel", id: this.id}, this.sendCallback.bind(this));
     }
@@ -143,8 +175,8 @@ class VM extends EventEmitter
         });
     }
 
-    startCompile(commandLine, argv0, id) {
-        let compile = new CompileJob(commandLine, argv0, id, this);
+    startCompile(commandLine, argv0, id, pump, headerCache) {
+        let compile = new CompileJob(commandLine, argv0, id, this, pump, headerCache);
         this.compiles[compile.id] = compile;
         // console.log("startCompile " + compile.id);
         return compile;
@@ -147,7 +147,7 @@ process.on('message', msg => {
             if (argv.debug) {
                 console.log("Creating new compile", msg.commandLine, msg.argv0, msg.dir);
             }
-            let compile = new Compile(msg.commandLine, msg.argv0, msg.dir, argv.debug);
+            let compile = new Compile(msg.commandLine, msg.argv0, msg.dir, argv.debug, msg.pump);
             // console.log("running thing", msg.commandLine);
             compile.on('stdout', data => send({ type: 'compileStdOut', id: msg.id, data: data }));
             compile.on('stderr', data => send({ type: 'compileStdErr', id: msg.id, data: data }));
@@ -0,0 +1,38 @@
+// Chunks of preprocessed output, see client/Chunker.h, kept in memory and
+// keyed by the md5 of their contents. Most of a TU is the same headers as
+// the last one so most of its chunks are already here.
+class ChunkStore
+{
+    constructor(maxSize)
+    {
+        this.maxSize = maxSize;
+        this.size = 0;
+        this.chunks = new Map(); // hash -> Buffer, least recently used first
+    }
+
+    get(hash)
+    {
+        const chunk = this.chunks.get(hash);
+        if (chunk) {
+            this.chunks.delete(hash);
+            this.chunks.set(hash, chunk);
+        }
+        return chunk;
+    }
+
+    add(hash, chunk)
+    {
+        if (this.chunks.has(hash))
+            return;
+        this.chunks.set(hash, chunk);
+        this.size += chunk.length;
+        for (let [key, value] of this.chunks) {
+            if (this.size <= this.maxSize)
+                break;
+            this.chunks.delete(key);
+            this.size -= value.length;
+        }
+    }
+}
+
+module.exports = ChunkStore;
@@ -5,7 +5,10 @@ const path = require('path');
 const EventEmitter = require('events');
 
 class Compile extends EventEmitter {
-    constructor(args, argv0, dir, debug) {
+    // With pump (see client/Pump.h) the client's files are under pump.root
+    // where they were on the client and we preprocess here. Paths into them
+    // are remapped, outputs go in <dir>/out.
+    constructor(args, argv0, dir, debug, pump) {
         super();
 
         if (!args || !args.length || !dir || !argv0) {
@@ -21,6 +24,8 @@ class Compile extends EventEmitter {
         let hasDashO = false;
         let hasDashX = false;
         let sourceFile;
+        const outDir = pump ? path.join(dir, 'out') : dir;
+        const remap = file => pump && path.isAbsolute(file) ? path.join(pump.root, file) : file;
         for (let i=0; i<args.length; ++i) {
             // console.log(i, args[i]);
             switch (args[i]) {
@@ -28,29 +33,58 @@ class Compile extends EventEmitter {
                 hasDashO = true;
                 output = args[++i];
                 outputFileName = path.basename(output);
-                args[i] = outputFileName;
+                args[i] = pump ? path.join(outDir, outputFileName) : outputFileName;
            break; }
             case '-MF': {
+                if (pump) {
+                    depfile = args[++i];
+                    args[i] = path.join(outDir, path.basename(depfile));
+                    break;
+                }
                 args.splice(i--, 2);
                 break; }
             case '-MMD':
             case '-MD':
+                if (pump)
+                    break;
+                args.splice(i--, 1);
+                continue;
             case '-MM':
             case '-M':
                 args.splice(i--, 1);
                 continue;
             case '-MT':
+            case '-MQ':
+                if (pump) {
+                    ++i;
+                    break;
+                }
                 args.splice(i--, 2);
                 continue;
             case '-cxx-isystem':
-            case '-isysroot':
             case '-isystem':
+            case '-iquote':
+            case '-idirafter':
             case '-I':
+                if (pump) {
+                    ++i;
+                    args[i] = remap(args[i]);
+                    break;
+                }
                 args.splice(i--, 2);
                 break;
+            case '-isysroot':
+                args.splice(i--, 2);
+                break;
+            case '-imacros':
+            case '-include':
+                ++i;
+                if (pump)
+                    args[i] = remap(args[i]);
+                break;
             case '-x':
                 hasDashX = true;
-                if (!isClang) {
+                if (!isClang && !pump) {
                     switch (args[++i]) {
                     case 'c':
                         args[i] = 'cpp-output';
@@ -83,9 +117,7 @@ class Compile extends EventEmitter {
             case '-arch':
             case '-b':
             case '-gcc-toolchain':
-            case '-imacros':
             case '-imultilib':
-            case '-include':
             case '-iprefix':
             case '-ivfsoverlay':
             case '-iwithprefix':
@@ -99,13 +131,21 @@ class Compile extends EventEmitter {
                     break;
                 }
 
+                if (pump) {
+                    const joined = /^(-I|-isystem|-iquote|-idirafter)(\/.*)$/.exec(args[i]);
+                    if (joined) {
+                        args[i] = joined[1] + remap(joined[2]);
+                        break;
+                    }
+                }
+
                 if (args[i][0] != '-') {
                     if (sourceFile) {
                         console.log("Multiple source files", sourceFile, args[i]);
                         throw new Error("More than one source file");
                     }
                     sourceFile = args[i];
-                    args[i] = path.join(dir, 'sourcefile');
+                    args[i] = pump ? remap(sourceFile) : path.join(dir, 'sourcefile');
                 }
                 break;
             }
@@ -114,7 +154,13 @@ class Compile extends EventEmitter {
             throw new Error("No sourcefile");
         }
 
-        if (!hasDashX) {
+        if (pump) {
+            // the compiler's own directories are in the client's tree too,
+            // the paths in debug info and __FILE__ are the client's
+            args.push('-nostdinc');
+            pump.systemDirs.forEach(dir => args.push('-isystem', remap(dir)));
+            args.push(`-ffile-prefix-map=${pump.root}=`);
+        } else if (!hasDashX) {
             if (compiler.indexOf('g++') != -1 || compiler.indexOf('c++') != -1) {
                 args.unshift(isClang ? 'c++' : 'c++-cpp-output');
             } else {
@@ -168,12 +214,17 @@ class Compile extends EventEmitter {
             args.unshift('-x');
         }
         if (!isClang) {
-            args.push('-fpreprocessed', '-fdirectives-only'); // this is not good for clang
+            if (!pump)
+                args.push('-fpreprocessed', '-fdirectives-only'); // this is not good for clang
         } else {
             args.push('-Wno-stdlibcxx-not-found');
         }
 
-        if (!hasDashO) {
+        if (!hasDashO && pump) {
+            // where the compiler would have put it on the client
+            outputFileName = output = path.basename(sourceFile, path.extname(sourceFile)) + ".o";
+            args.push("-o", path.join(outDir, outputFileName));
+        } else if (!hasDashO) {
             let suffix = path.extname(sourceFile);
             outputFileName = output = sourceFile.substr(0, sourceFile.length - suffix) + ".o";
             args.push("-o", outputFileName);
@@ -186,7 +237,7 @@ class Compile extends EventEmitter {
             this.emit("stderr", "as doesn't exist");
         }
         const env = Object.assign({ TMPDIR: dir, TEMPDIR: dir, TEMP: dir }, process.env);
-        const proc = child_process.spawn(compiler, args, { /*env: env, */cwd: dir, maxBuffer: 1024 * 1024 * 16 });
+        const proc = child_process.spawn(compiler, args, { /*env: env, */cwd: pump ? path.join(pump.root, pump.cwd) : dir, maxBuffer: 1024 * 1024 * 16 });
         this.proc = proc;
         proc.stdout.setEncoding('utf8');
         proc.stderr.setEncoding('utf8');
@@ -237,8 +288,40 @@ class Compile extends EventEmitter {
                     return;
                 }
             }
-            if (exitCode === 0)
+            // everything the compiler wrote is next to the object on the
+            // client, the depfile is where -MF said
+            function addOutputs() {
+                try {
+                    fs.readdirSync(outDir).forEach(file => {
+                        const mapped = path.join(outDir, file);
+                        if (depfile && file == path.basename(depfile)) {
+                            files.push({ path: depfile, mapped: mapped });
+                        } else {
+                            files.push({ path: path.join(path.dirname(output), file), mapped: mapped });
+                        }
+                        if (path.extname(file) == ".d" || files[files.length - 1].path === depfile) {
+                            const deps = fs.readFileSync(mapped, "utf8");
+                            fs.writeFileSync(mapped, deps.split(path.join(outDir, outputFileName)).join(output).split(pump.root + '/').join('/'));
+                        }
+                        if (debug)
+                            console.log("Added file", file, files[files.length - 1]);
+                    });
+                } catch (err) {
+                    console.error("Got an error processing outputs for", sourceFile, err);
+                    files = [];
+                    return err;
+                }
+                return undefined;
+            }
+            if (exitCode === 0 && pump) {
+                const err = addOutputs();
+                if (err) {
+                    this.emit('exit', { exitCode: 110, files: [], error: err.toString(), sourceFile: sourceFile });
+                    return;
+                }
+            } else if (exitCode === 0) {
                 addDir(dir, dir);
+            }
             if (exitCode === null)
                 exitCode = 111;
             this.emit('exit', { exitCode: exitCode, files: files, sourceFile: sourceFile });
@@ -15,11 +15,14 @@ const bytes = require("bytes");
 const parse_duration = require("parse-duration");
 const fs = require("fs-extra");
 const path = require("path");
+const zlib = require("zlib");
 const os = require("os");
 const child_process = require("child_process");
 const VM = require("./VM");
 const load = require("./load");
 const ObjectCache = require("./objectcache");
+const HeaderCache = require("./headercache");
+const ChunkStore = require("./chunkstore");
 const quitOnError = require("./quit-on-error")(option);
 
 if (process.getuid() !== 0) {
@@ -43,6 +46,7 @@ process.on("uncaughtException", err => {
 });
 
 let debug = option("debug");
+const responseCompressionLevel = option.int("response-compression-level", 1);
 
 let restartOnInactivity = option("restart-on-inactivity");
 if (typeof restartOnInactivity === "string")
@@ -415,9 +419,15 @@ client.on("dropEnvironments", message => {
             environment.destroy();
             delete environments[env];
         }
+        server.dictionaries.delete(env);
     });
 });
 
+client.on("dictionary", message => {
+    console.log(`Got dictionary ${message.id} for ${message.environment}`);
+    server.dictionaries.set(message.environment, { id: message.id, data: Buffer.from(message.data, "base64") });
+});
+
 client.on("getEnvironments", message => {
     console.log(`Getting environments ${message.environments}`);
     let base = option("scheduler", "localhost:8097");
@@ -562,12 +572,26 @@ client.on("close", () => {
 
 
 const server = new Server(option, common.Version);
+// one in this many uploads, only if our node can decompress with the dictionaries
+const dictionarySampleRate = server.dictionarySupport ? option.int("dictionary-sample-rate", 50) : 0;
+const DictionarySampleSize = 128 * 1024; // zstd --train doesn't look further into a sample
+{
+    const headerCacheSize = bytes.parse(option("header-cache-size", "1gb"));
+    if (headerCacheSize)
+        server.headerCache = new HeaderCache(option("header-cache-dir") || path.join(common.cacheDir(), "headers"), headerCacheSize);
+    const chunkStoreSize = bytes.parse(option("chunk-store-size", "256mb"));
+    if (chunkStoreSize)
+        server.chunkStore = new ChunkStore(chunkStoreSize);
+}
 let jobQueue = [];
 
 server.on("headers", (headers, req) => {
     // console.log("request is", req.headers);
-    let wait = (jobQueue.length >= client.slots || (objectCache && objectCache.state(req.headers["x-fisk-md5"]) == "exists"));
+    const cached = objectCache && objectCache.state(req.headers["x-fisk-md5"]) == "exists";
+    let wait = (jobQueue.length >= client.slots || cached);
     headers.push(`x-fisk-wait: ${wait}`);
+    if (cached) // lets fiskcs that only want the object know that they'll get it
+        headers.push("x-fisk-cached: true");
 });
 
 server.on("listen", app => {
@@ -645,6 +669,11 @@ server.on("job", job => {
     }
     const jobStartTime = Date.now();
     let uploadDuration;
+    // the scheduler trains zstd dictionaries from some of the uploads
+    let sample;
+    if (dictionarySampleRate > 0 && !job.pump && !server.dictionaries.has(job.hash) && Math.random() * dictionarySampleRate < 1)
+        sample = [];
+    let sampleSize = 0;
 
     // console.log("sending to server");
     var j = {
@@ -715,7 +744,7 @@ server.on("job", job => {
             });
 
             console.log("Starting job", j.id, job.sourceFile, "for", job.ip, job.name, "wait", job.wait);
-            j.op = vm.startCompile(job.commandLine, job.argv0, job.id);
+            j.op = vm.startCompile(job.commandLine, job.argv0, job.id, job.pump, server.headerCache);
             j.buffers.forEach(data => j.op.feed(data.data, data.last));
             if (job.wait) {
                 job.send("resume", {});
@@ -750,19 +779,43 @@ server.on("job", job => {
                 };
                 if (event.error)
                     response.error = event.error;
+                // only for this fiskc, not the object cache
+                const extra = {};
+                const dictionary = job.fetchDictionary && server.dictionaries.get(job.hash);
+                if (dictionary)
+                    extra.dictionary = dictionary.data.toString("base64");
                 if (debug) {
                     console.log("Sending response", job.ip, job.hostname, response);
                 }
-                job.send(response);
-                if (event.success && objectCache && response.md5 && objectCache.state(response.md5) == "none") {
-                    response.sourceFile = job.sourceFile;
-                    response.commandLine = job.commandLine;
-                    response.environment = job.hash;
-                    objectCache.add(response, contents);
-                }
+                const reply = (index, encoded) => {
+                    job.send(Object.assign({}, response, index ? { index: index } : {}, extra));
+                    if (event.success && objectCache && response.md5 && objectCache.state(response.md5) == "none") {
+                        response.sourceFile = job.sourceFile;
+                        response.commandLine = job.commandLine;
+                        response.environment = job.hash;
+                        objectCache.add(response, contents);
+                    }
 
-                for (let i=0; i<contents.length; ++i) {
-                    job.send(contents[i].contents);
+                    for (let i=0; i<encoded.length; ++i) {
+                        job.send(encoded[i]);
+                    }
+                };
+                // the object cache keeps the raw files, only what goes on the wire is compressed
+                if (responseCompressionLevel > 0 && job.encodings.indexOf("deflate") != -1) {
+                    // compress on the threadpool so other jobs' sockets aren't stalled meanwhile
+                    Promise.all(contents.map(item => new Promise(resolve => {
+                        zlib.deflate(item.contents, { level: responseCompressionLevel }, (err, compressed) => {
+                            if (err || compressed.length >= item.contents.length) {
+                                resolve({ index: { path: item.path, bytes: item.contents.length }, data: item.contents });
+                            } else {
+                                resolve({ index: { path: item.path, bytes: compressed.length, encoding: "deflate", rawBytes: item.contents.length }, data: compressed });
+                            }
+                        });
+                    }))).then(items => {
+                        reply(items.map(item => item.index), items.map(item => item.data));
+                    });
+                } else {
+                    reply(undefined, contents.map(item => item.contents));
                 }
                 // job.close();
                 // console.log("GOT ID", j);
@@ -773,7 +826,12 @@ server.on("job", job => {
                         compileDuration: event.compileDuration,
                         compileSpeed: (event.cppSize / event.compileDuration),
                         uploadDuration: uploadDuration,
-                        uploadSpeed: (event.cppSize / uploadDuration)
+                        uploadSpeed: (event.cppSize / uploadDuration),
+                        encoding: job.encoding || "none",
+                        uploadBytes: job.uploadBytes,
+                        compressionRatio: (event.cppSize / job.uploadBytes),
+                        decompressDuration: job.decompressDuration,
+                        decompressSpeed: (event.cppSize / job.decompressDuration)
                     });
                 } else {
                     client.send("jobAborted", {
@@ -782,7 +840,12 @@ server.on("job", job => {
                         compileDuration: event.compileDuration,
                         compileSpeed: (event.cppSize / event.compileDuration),
                         uploadDuration: uploadDuration,
-                        uploadSpeed: (event.cppSize / uploadDuration)
+                        uploadSpeed: (event.cppSize / uploadDuration),
+                        encoding: job.encoding || "none",
+                        uploadBytes: job.uploadBytes,
+                        compressionRatio: (event.cppSize / job.uploadBytes),
+                        decompressDuration: job.decompressDuration,
+                        decompressSpeed: (event.cppSize / job.decompressDuration)
                     });
                 }
                 startPending();
@@ -826,6 +889,17 @@ server.on("job", job => {
 
     job.on("data", data => {
         // console.log("got data", this.id, data.last, typeof j.op);
+        if (sample) {
+            if (data.data.length) {
+                sample.push(data.data);
+                sampleSize += data.data.length;
+            }
+            if (data.last || sampleSize >= DictionarySampleSize) {
+                if (sampleSize)
+                    client.send("dictionarySample", { environment: job.hash, data: Buffer.concat(sample).subarray(0, DictionarySampleSize).toString("base64") });
+                sample = undefined;
+            }
+        }
         if (data.last)
             uploadDuration = Date.now() - jobStartTime;
         if (!j.op) {
@@ -0,0 +1,114 @@
+const fs = require("fs-extra");
+const path = require("path");
+const crypto = require("crypto");
+const cacheKey = require("../common/cachekey");
+
+const emptyHash = crypto.createHash("md5").digest("hex");
+
+// The sources and headers of pumped jobs, see client/Pump.h. Files are named
+// after the md5 of their contents so one client's copy of a header is as good
+// as anyone else's and only has to be uploaded once. Jobs get hard links to
+// them in their root. Least recently used files go when we're over size.
+class HeaderCache
+{
+    constructor(dir, maxSize)
+    {
+        this.dir = dir;
+        this.maxSize = maxSize;
+        this.size = 0;
+        this.files = new Map(); // hash -> size, least recently used first
+        fs.mkdirpSync(dir);
+        fs.readdirSync(dir).forEach(file => {
+            const absolute = path.join(dir, file);
+            try {
+                if (cacheKey.algorithm(file) !== "md5") {
+                    fs.unlinkSync(absolute);
+                    return;
+                }
+                const stat = fs.statSync(absolute);
+                this.files.set(file, stat.size);
+                this.size += stat.size;
+            } catch (err) {
+                console.error("Failed to load header", absolute, err.message);
+            }
+        });
+        this._purge();
+        console.log(`Header cache has ${this.files.size} files, ${this.size} bytes in ${dir}`);
+    }
+
+    static isValid(hash)
+    {
+        return cacheKey.algorithm(hash) === "md5";
+    }
+
+    // The hashes of the files we don't have, each once. Empty files aren't
+    // sent, the client has no frame to send them in.
+    missing(files)
+    {
+        const ret = [];
+        const seen = new Set();
+        files.forEach(file => {
+            const size = this.files.get(file.hash);
+            if (file.hash === emptyHash) {
+                const err = this.add(file.hash, Buffer.alloc(0));
+                if (err)
+                    console.error("Failed to add empty header", err);
+            } else if (size !== undefined) {
+                this.files.delete(file.hash);
+                this.files.set(file.hash, size);
+            } else if (!seen.has(file.hash)) {
+                seen.add(file.hash);
+                ret.push(file.hash);
+            }
+        });
+        return ret;
+    }
+
+    // Returns an error if the contents don't match the hash
+    add(hash, data)
+    {
+        if (crypto.createHash("md5").update(data).digest("hex") !== hash)
+            return `Contents don't match ${hash}`;
+        if (this.files.has(hash))
+            return undefined;
+        const file = path.join(this.dir, hash);
+        const tmp = `${file}.${process.pid}.tmp`;
+        try {
+            fs.writeFileSync(tmp, data, { mode: 0o644 });
+            fs.renameSync(tmp, file);
+        } catch (err) {
+            fs.remove(tmp);
+            return `Failed to write ${hash}: ${err.message}`;
+        }
+        this.files.set(hash, data.length);
+        this.size += data.length;
+        this._purge();
+        return undefined;
+    }
+
+    // Hard links the file to dest, copies it if they're on different file systems
+    link(hash, dest)
+    {
+        const file = path.join(this.dir, hash);
+        return fs.link(file, dest).catch(err => {
+            if (err.code !== "EXDEV")
+                throw err;
+            return fs.copy(file, dest);
+        });
+    }
+
+    _purge()
+    {
+        if (this.size <= this.maxSize)
+            return;
+        for (let [hash, size] of this.files) {
+            if (this.size <= this.maxSize)
+                break;
+            this.files.delete(hash);
+            this.size -= size;
+            fs.remove(path.join(this.dir, hash));
+        }
+    }
+}
+
+module.exports = HeaderCache;
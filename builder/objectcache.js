@@ -1,6 +1,7 @@
 const fs = require("fs-extra");
 const path = require("path");
 const EventEmitter = require("events");
+const cacheKey = require("../common/cachekey");
 
 function prettysize(bytes)
 {
@@ -86,7 +87,7 @@ class ObjectCache extends EventEmitter
         try {
             fs.readdirSync(this.dir).map(fileName => {
                 let ret = { path: path.join(this.dir, fileName) };
-                if (fileName.length == 32) {
+                if (cacheKey.isValid(fileName)) {
                     try {
                         let stat = fs.statSync(ret.path);
                         if (stat.isFile()) {
@@ -3,7 +3,60 @@ const EventEmitter = require("events");
 const WebSocket = require("ws");
 const Url = require("url");
 const http = require("http");
+const cacheKey = require("../common/cachekey");
 const express = require("express");
+const zlib = require("zlib");
+const path = require("path");
+const crypto = require("crypto");
+
+// node has zstd from 22.15 and 23.8 on, fiskc falls back to deflate without
+const zstd = typeof zlib.zstdDecompress === "function";
+// and takes a dictionary for it from 24.6 on. Older ones ignore the option
+// so this frame, made with the probe as a raw content dictionary, only
+// decompresses when it's used.
+const zstdDictionary = zstd && (() => {
+    const probe = Buffer.from("fisk dictionary probe, fisk dictionary probe\n");
+    try {
+        return zlib.zstdDecompressSync(Buffer.from("KLUv/SQtTQAAEGZpAQBAU2EBz7qU+w==", "base64"), { dictionary: probe }).equals(probe);
+    } catch (err) {
+        return false;
+    }
+})();
+
+function encodings(headers) {
+    const header = headers["x-fisk-compression"];
+    return header ? header.split(",").map(x => x.trim()) : [];
+}
+
+// Everything in a pumped job ends up under the job's root so paths have to
+// be absolute and normalized
+function pumpError(pump) {
+    const valid = file => typeof file === "string" && path.isAbsolute(file) && path.normalize(file) === file;
+    if (!pump || typeof pump !== "object" || !valid(pump.cwd)
+        || !Array.isArray(pump.files) || !Array.isArray(pump.dirs) || !Array.isArray(pump.systemDirs)) {
+        return "Bad pump job";
+    }
+    const file = pump.files.find(file => !file || !valid(file.path) || cacheKey.algorithm(file.hash) !== "md5");
+    if (file !== undefined)
+        return `Bad pumped file ${JSON.stringify(file)}`;
+    const dir = pump.dirs.concat(pump.systemDirs).find(dir => !valid(dir));
+    if (dir !== undefined)
+        return `Bad pumped dir ${JSON.stringify(dir)}`;
+    return undefined;
+}
+
+function chunksError(json) {
+    if (!Array.isArray(json.chunks) || !Array.isArray(json.chunkSizes) || json.chunks.length != json.chunkSizes.length)
+        return "Bad chunks";
+    if (json.chunks.some(hash => cacheKey.algorithm(hash) !== "md5"))
+        return "Bad chunk hash";
+    let total = 0;
+    if (json.chunkSizes.some(size => { total += size; return !Number.isInteger(size) || size <= 0; }))
+        return "Bad chunk size";
+    if (total !== json.bytes)
+        return `Chunks add up to ${total} bytes, not ${json.bytes}`;
+    return undefined;
+}
 
 class Job extends EventEmitter {
     constructor(data) {
@@ -13,7 +66,7 @@ class Job extends EventEmitter {
     }
 
     send(type, msg) {
-        if (this.ws.readyState !== WebSocket.OPEN)
+        if (this.readyState !== WebSocket.OPEN)
             return;
         try {
             if (msg === undefined) {
@@ -38,15 +91,23 @@ class Job extends EventEmitter {
     }
 
     get readyState() {
-        return this.ws.readyState;
+        return this.closed ? WebSocket.CLOSED : this.ws.readyState;
     }
 
     close() {
+        if (this.closed)
+            return;
         this.closed = true;
-        this.ws.close();
+        this.finish();
     }
 };
 
+// Control messages on /jobs connections, compared as strings so job traffic
+// doesn't have to be parsed twice
+const End = '{"type":"end"}';
+const Ended = '{"type":"ended"}';
+const JobClosed = '{"type":"jobClosed"}';
+
 class Server extends EventEmitter {
     constructor(option, configVersion) {
         super();
@@ -54,6 +115,10 @@ class Server extends EventEmitter {
         this.id = 0;
         this.configVersion = configVersion;
         this.app = undefined;
+        this.headerCache = undefined;
+        this.chunkStore = undefined;
+        this.dictionaries = new Map(); // environment -> { id, data } from the scheduler
+        this.dictionarySupport = zstdDictionary;
     }
 
     listen() {
@@ -73,26 +138,37 @@ class Server extends EventEmitter {
 
         console.log("listening on", this.port);
         this.ws.on("headers", (headers, request) => {
-            this.emit("headers", headers, request);
+            if (Url.parse(request.url).pathname == "/jobs") {
+                headers.push("x-fisk-jobs: true");
+            } else {
+                this._responseHeaders(headers, request);
+            }
         });
     }
 
+    _responseHeaders(headers, request) {
+        headers.push("x-fisk-stream: true");
+        if (request.headers["x-fisk-pump"] === "true" && this.headerCache)
+            headers.push("x-fisk-pump: true");
+        if (request.headers["x-fisk-chunks"] === "true" && this.chunkStore)
+            headers.push("x-fisk-chunks: true");
+        // fiskc's sendfile() frames have a zero mask key, ws unmasks those
+        // like any other
+        if (request.headers["x-fisk-raw-stream"] === "true")
+            headers.push("x-fisk-raw-stream: true");
+        // the first one fiskc asked for that we can decompress
+        const encoding = encodings(request.headers).find(encoding => encoding == "deflate" || (encoding == "zstd" && zstd));
+        if (encoding)
+            headers.push(`x-fisk-compression: ${encoding}`);
+        const dictionary = (encoding == "zstd" && zstdDictionary && request.headers["x-fisk-dictionary"]
+                            && this.dictionaries.get(request.headers["x-fisk-environments"]));
+        if (dictionary)
+            headers.push(`x-fisk-dictionary: ${dictionary.id}`);
+        this.emit("headers", headers, request);
+    }
+
     _handleConnection(ws, req) {
-        const connectTime = Date.now();
-        let client = undefined;
-        let bytes = undefined;
         let ip = req.connection.remoteAddress;
-        let clientEmitted = false;
-        const error = msg => {
-            ws.send(`{"error": "${msg}"}`);
-            ws.close();
-            if (client && clientEmitted) {
-                client.emit("error", msg);
-            } else {
-                this.emit("error", { ip: ip, message: msg });
-            }
-        };
-
         if (!ip) { // already closed
             // console.log(req.connection, ws.readyState);
             return;
@@ -103,38 +179,272 @@ class Server extends EventEmitter {
 
         const url = Url.parse(req.url);
         switch (url.pathname) {
-        case "/compile":
-            const hash = req.headers["x-fisk-environments"];
-            if (!hash) {
-                error("Bad ws request, no environments");
+        case "/compile": {
+            const job = this._createJob(ws, ip, req.headers, () => ws.close());
+            if (!job)
+                return;
+            ws.on("message", job.onMessage);
+            ws.on("close", () => {
+                job.onClose();
+                ws.removeAllListeners();
+            });
+            ws.on("error", job.onError);
+            break; }
+        case "/jobs":
+            this._handleJobs(ws, req, ip);
+            break;
+        default:
+            ws.send(`{"error": "Invalid pathname ${url.pathname}"}`);
+            ws.close();
+            this.emit("error", { ip: ip, message: `Invalid pathname ${url.pathname}` });
+            break;
+        }
+    }
+
+    // fisk-daemon keeps these connections open and runs one job after
+    // another on them. Each job starts with a begin message carrying the
+    // headers fiskc would have connected with, answered with begun and the
+    // headers we'd have sent in the handshake. A job always ends with the
+    // daemon sending end, which we ack with ended. If we're done with a job
+    // before fiskc is we send jobClosed and drop whatever the daemon had
+    // already sent for the job until its end arrives.
+    _handleJobs(ws, req, ip) {
+        const configVersion = req.headers["x-fisk-config-version"];
+        if (configVersion != this.configVersion) {
+            ws.send(`{"error": "Bad config version, expected ${this.configVersion}, got ${configVersion}"}`);
+            ws.close();
+            this.emit("error", { ip: ip, message: `Bad config version, expected ${this.configVersion}, got ${configVersion}` });
+            return;
+        }
+        let current;
+        let draining = false;
+        ws.on("message", msg => {
+            if (msg === End) {
+                if (current) {
+                    const job = current;
+                    current = undefined;
+                    job.onClose();
+                }
+                draining = false;
+                ws.send(Ended);
+                return;
+            }
+            if (current) {
+                current.onMessage(msg);
                 return;
             }
-            const name = req.headers["x-fisk-client-name"];
-            const configVersion = req.headers["x-fisk-config-version"];
-            if (configVersion != this.configVersion) {
-                error(`Bad config version, expected ${this.configVersion}, got ${configVersion}`);
+            if (draining)
                 return;
+            let json;
+            try {
+                json = JSON.parse(msg);
+            } catch (e) {
             }
+            if (!json || json.type !== "begin" || !json.headers || typeof json.headers !== "object") {
+                console.error("Expected a begin message on /jobs from", ip);
+                ws.close();
+                return;
+            }
+            const headers = json.headers;
+            let job;
+            job = this._createJob(ws, ip, headers, () => {
+                if (current === job) {
+                    current = undefined;
+                    draining = true;
+                    ws.send(JobClosed);
+                }
+            });
+            current = job;
+            if (job) {
+                const responseHeaders = [];
+                this._responseHeaders(responseHeaders, { url: "/compile", headers: headers });
+                const begun = { type: "begun", headers: {} };
+                responseHeaders.forEach(header => {
+                    const colon = header.indexOf(":");
+                    begun.headers[header.substr(0, colon)] = header.substr(colon + 1).trim();
+                });
+                ws.send(JSON.stringify(begun));
+            }
+        });
+        ws.on("close", () => {
+            if (current)
+                current.onClose();
+            current = undefined;
+            ws.removeAllListeners();
+        });
+        ws.on("error", err => {
+            if (current)
+                current.onError(err);
+        });
+    }
 
-            // console.log("GOT HEADERS", req.headers);
-            client = new Job({ ws: ws,
-                               ip: ip,
-                               hash: hash,
-                               name: name,
-                               hostname: req.headers["x-fisk-client-hostname"],
-                               user: req.headers["x-fisk-user"],
-                               sourceFile: req.headers["x-fisk-sourcefile"],
-                               md5: req.headers["x-fisk-md5"],
-                               id: parseInt(req.headers["x-fisk-job-id"]),
-                               builderIp: req.headers["x-fisk-builder-ip"] });
+    // Returns the handlers for the websocket events of a job or undefined if
+    // the headers were bad. finish ends the job from our side.
+    _createJob(ws, ip, headers, finish) {
+        const connectTime = Date.now();
+        let client = undefined;
+        let bytes = undefined;
+        let streaming = false;
+        let streamed = 0;
+        // Decompresses on the threadpool. Messages are handled one at a time
+        // through queue so the data still comes out in the order it was sent.
+        let queue = Promise.resolve();
+        let failed = false;
+        const decode = msg => {
+            client.uploadBytes += msg.length;
+            if (!client.encoding)
+                return Promise.resolve(msg);
+            const started = process.hrtime();
+            const decompress = client.encoding == "zstd" ? zlib.zstdDecompress : zlib.inflate;
+            const options = client.dictionary ? { dictionary: client.dictionary } : {};
+            return new Promise((resolve, reject) => {
+                decompress(msg, options, (err, ret) => {
+                    if (err) {
+                        reject(err);
+                        return;
+                    }
+                    const elapsed = process.hrtime(started);
+                    client.decompressDuration += (elapsed[0] * 1000) + (elapsed[1] / 1000000);
+                    resolve(ret);
+                });
+            });
+        };
+        const decodeError = msg => err => {
+            error(`Failed to decompress ${msg.length} bytes: ${err.message}`);
+        };
+        const emitData = (msg, last) => {
+            return decode(msg).then(data => {
+                client.emit("data", { data: data, last: last });
+            }, decodeError(msg));
+        };
+        // the files of a pumped job the client is sending, in order
+        let pumping = undefined;
+        const onHeader = msg => {
+            return decode(msg).then(data => {
+                const err = this.headerCache.add(pumping.shift(), data);
+                if (err) {
+                    error(err);
+                    return;
+                }
+                if (!pumping.length) {
+                    pumping = undefined;
+                    client.emit("data", { data: Buffer.alloc(0), last: true });
+                }
+            }, decodeError(msg));
+        };
+        // a chunked upload, the chunks we had and the ones the client is
+        // sending in order
+        let chunking = undefined;
+        const finishChunks = () => {
+            const data = Buffer.concat(chunking.hashes.map(hash => chunking.have.get(hash)));
+            const expected = chunking.bytes;
+            chunking = undefined;
+            if (data.length !== expected) {
+                error(`Got ${data.length} bytes of chunks, expected ${expected}`);
+                return;
+            }
+            client.emit("data", { data: data, last: true });
+        };
+        const addChunks = data => {
+            let buffer = chunking.buffer ? Buffer.concat([chunking.buffer, data]) : data;
+            while (chunking.missing.length) {
+                const hash = chunking.missing[0];
+                const size = chunking.sizes.get(hash);
+                if (buffer.length < size)
+                    break;
+                // copied so the store doesn't keep the whole message alive
+                const chunk = Buffer.from(buffer.subarray(0, size));
+                buffer = buffer.subarray(size);
+                if (crypto.createHash("md5").update(chunk).digest("hex") !== hash) {
+                    error(`Chunk contents don't match ${hash}`);
+                    return;
+                }
+                chunking.missing.shift();
+                chunking.have.set(hash, chunk);
+                this.chunkStore.add(hash, chunk);
+            }
+            chunking.buffer = buffer.length ? buffer : undefined;
+            if (!chunking.missing.length) {
+                if (chunking.buffer) {
+                    error(`Got ${chunking.buffer.length} bytes more than the chunks`);
+                    return;
+                }
+                finishChunks();
+            }
+        };
+        const onBinary = msg => {
+            if (pumping)
+                return onHeader(msg);
+            if (chunking)
+                return decode(msg).then(addChunks, decodeError(msg));
+            if (!msg.length) {
+                // no data?
+                console.error("No data in buffer");
+                return;
+            }
+            if (streaming) {
+                streamed += msg.length;
+                return emitData(msg, false);
+            }
+            if (!bytes) {
+                error("Got binary message without a preceeding json message describing the data");
+                return;
+            }
+            if (msg.length > bytes) {
+                // woops
+                error(`length ${msg.length} > ${bytes}`);
+                return;
+            }
+            bytes -= msg.length;
+            // console.log("Emitting", "data", { data: msg.length, last: !bytes });
+            return emitData(msg, !bytes);
+        };
+        let clientEmitted = false;
+        const error = msg => {
+            failed = true;
+            ws.send(`{"error": "${msg}"}`);
+            finish();
+            if (client && clientEmitted) {
+                client.emit("error", msg);
+            } else {
+                this.emit("error", { ip: ip, message: msg });
+            }
+        };
 
-            break;
-        default:
-            error(`Invalid pathname ${url.pathname}`);
-            return;
+        const hash = headers["x-fisk-environments"];
+        if (!hash) {
+            error("Bad ws request, no environments");
+            return undefined;
+        }
+        const name = headers["x-fisk-client-name"];
+        const configVersion = headers["x-fisk-config-version"];
+        if (configVersion != this.configVersion) {
+            error(`Bad config version, expected ${this.configVersion}, got ${configVersion}`);
+            return undefined;
+        }
+        const md5 = headers["x-fisk-md5"];
+        if (md5 && !cacheKey.isValid(md5)) {
+            error(`Bad cache key: ${md5}`);
+            return undefined;
         }
 
-        ws.on("message", msg => {
+        // console.log("GOT HEADERS", headers);
+        client = new Job({ ws: ws,
+                           finish: finish,
+                           ip: ip,
+                           hash: hash,
+                           name: name,
+                           hostname: headers["x-fisk-client-hostname"],
+                           user: headers["x-fisk-user"],
+                           sourceFile: headers["x-fisk-sourcefile"],
+                           md5: md5,
+                           id: parseInt(headers["x-fisk-job-id"]),
+                           builderIp: headers["x-fisk-builder-ip"],
+                           encodings: encodings(headers),
+                           uploadBytes: 0,
+                           decompressDuration: 0 });
+
+        const handleMessage = msg => {
             switch (typeof msg) {
             case "string":
                 // console.log("Got message", msg);
@@ -153,50 +463,124 @@ class Server extends EventEmitter {
                     error("Unable to parse string message as JSON");
                     return;
                 }
+                if (json.type === "uploadFinished") {
+                    if (!streaming) {
+                        error("Got uploadFinished without a streaming upload");
+                        return;
+                    }
+                    if (json.bytes !== streamed) {
+                        error(`Streamed ${streamed} bytes but client sent ${json.bytes}`);
+                        return;
+                    }
+                    streaming = false;
+                    client.emit("data", { data: Buffer.alloc(0), last: true });
+                    return;
+                }
+                // with stream the length isn't known until the client sends uploadFinished
+                streaming = json.stream === true;
                 bytes = json.bytes;
+                if (json.encoding && json.encoding != "deflate" && (json.encoding != "zstd" || !zstd)) {
+                    error(`Unsupported encoding ${json.encoding}`);
+                    return;
+                }
+                client.encoding = json.encoding;
+                if (json.dictionary !== undefined) {
+                    const dictionary = json.encoding == "zstd" && zstdDictionary && this.dictionaries.get(hash);
+                    if (!dictionary || dictionary.id !== json.dictionary) {
+                        error(`Unknown dictionary ${json.dictionary}`);
+                        return;
+                    }
+                    client.dictionary = dictionary.data;
+                }
+                client.fetchDictionary = json.fetchDictionary === true;
                 client.commandLine = json.commandLine;
                 client.argv0 = json.argv0;
                 client.connectTime = connectTime;
                 client.wait = json.wait;
-                this.emit("job", client);
-                clientEmitted = true;
-                break;
-            case "object":
-                if (msg instanceof Buffer) {
-                    // console.log("Got binary", msg.length, bytes);
-                    if (!msg.length) {
-                        // no data?
-                        console.error("No data in buffer");
+                if (json.pump !== undefined) {
+                    if (headers["x-fisk-pump"] !== "true" || !this.headerCache) {
+                        error("Got pump without negotiating it");
                         return;
                     }
-                    if (!bytes) {
-                        error("Got binary message without a preceeding json message describing the data");
+                    const err = pumpError(json.pump);
+                    if (err) {
+                        error(err);
                         return;
                     }
-                    if (msg.length > bytes) {
-                        // woops
-                        error(`length ${msg.length} > ${bytes}`);
+                    client.pump = json.pump;
+                    pumping = this.headerCache.missing(json.pump.files);
+                    ws.send(JSON.stringify({ type: "needHeaders", hashes: pumping }));
+                } else if (json.chunks !== undefined) {
+                    if (headers["x-fisk-chunks"] !== "true" || !this.chunkStore) {
+                        error("Got chunks without negotiating them");
                         return;
                     }
-                    bytes -= msg.length;
-                    // console.log("Emitting", "data", { data: msg.length, last: !bytes });
-                    client.emit("data", { data: msg, last: !bytes });
+                    const err = chunksError(json);
+                    if (err) {
+                        error(err);
+                        return;
+                    }
+                    // the ones we have are held on to here so they can't be
+                    // evicted before the rest arrive
+                    chunking = { hashes: json.chunks, bytes: json.bytes, have: new Map(), sizes: new Map(), missing: [], buffer: undefined };
+                    json.chunks.forEach((hash, idx) => {
+                        if (chunking.have.has(hash) || chunking.sizes.has(hash))
+                            return;
+                        const chunk = this.chunkStore.get(hash);
+                        if (chunk) {
+                            chunking.have.set(hash, chunk);
+                        } else {
+                            chunking.sizes.set(hash, json.chunkSizes[idx]);
+                            chunking.missing.push(hash);
+                        }
+                    });
+                    bytes = undefined;
+                    ws.send(JSON.stringify({ type: "needChunks", hashes: chunking.missing }));
+                }
+                this.emit("job", client);
+                clientEmitted = true;
+                if (pumping && !pumping.length) {
+                    pumping = undefined;
+                    client.emit("data", { data: Buffer.alloc(0), last: true });
+                } else if (chunking && !chunking.missing.length) {
+                    finishChunks();
+                }
+                break;
+            case "object":
+                if (msg instanceof Buffer) {
+                    // console.log("Got binary", msg.length, bytes);
+                    return onBinary(msg);
                 }
                 break;
             }
-        });
-        ws.on("close", () => {
-            if (client && clientEmitted) {
-                // console.error("GOT WS CLOSE", bytes, client.objectcache);
-                client.emit("close");
+            return undefined;
+        };
+        const onMessage = msg => {
+            queue = queue.then(() => {
+                if (!failed)
+                    return handleMessage(msg);
+                return undefined;
+            }).catch(err => {
+                console.error("Failed to handle message", err);
+                if (!failed)
+                    error(`Failed to handle message: ${err.message}`);
+            });
+        };
+        return {
+            onMessage: onMessage,
+            onClose: () => {
+                client.closed = true;
+                if (clientEmitted) {
+                    // console.error("GOT WS CLOSE", bytes, client.objectcache);
+                    client.emit("close");
+                }
+            },
+            onError: err => {
+                console.log("GOT WS ERROR", err);
+                if (clientEmitted)
+                    client.emit("error", err);
             }
-            ws.removeAllListeners();
-        });
-        ws.on("error", (error) => {
-            console.log("GOT WS ERROR", error);
-            if (client && clientEmitted)
-                client.emit("error", error);
-        });
+        };
     }
 }
 
@@ -0,0 +1,152 @@
+#include "Breaker.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Breaker::File *Breaker::file()
+{
+    static File *file = nullptr;
+    static bool opened = false;
+    if (opened)
+        return file;
+    opened = true;
+
+    const std::string dir = Config::cacheDir;
+    if (dir.empty() || !Client::recursiveMkdir(dir))
+        return nullptr;
+    const std::string path = dir + "breakers";
+    int fd;
+    EINTRWRAP(fd, ::open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR));
+    if (fd == -1) {
+        DEBUG("Failed to open %s %d %s", path.c_str(), errno, strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (static_cast<size_t>(st.st_size) < sizeof(File) && ftruncate(fd, sizeof(File)))) {
+        DEBUG("Failed to size %s %d %s", path.c_str(), errno, strerror(errno));
+        int ret;
+        EINTRWRAP(ret, ::close(fd));
+        return nullptr;
+    }
+    void *data = mmap(nullptr, sizeof(File), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret;
+    EINTRWRAP(ret, ::close(fd));
+    if (data == MAP_FAILED) {
+        DEBUG("Failed to mmap %s %d %s", path.c_str(), errno, strerror(errno));
+        return nullptr;
+    }
+    file = static_cast<File *>(data);
+    if (__atomic_load_n(&file->magic, __ATOMIC_ACQUIRE) != Magic || file->size != sizeof(File)) {
+        memset(file->entries, 0, sizeof(file->entries));
+        file->size = sizeof(File);
+        __atomic_store_n(&file->magic, Magic, __ATOMIC_RELEASE);
+    }
+    return file;
+}
+
+Breaker::Entry *Breaker::entry(Kind kind, const std::string &key, bool create)
+{
+    if (!Config::circuitBreaker)
+        return nullptr;
+    File *f = file();
+    if (!f)
+        return nullptr;
+    // fnv-1a, never 0 so that can mean unused
+    uint64_t hash = 14695981039346656037ull;
+    for (char ch : key) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+    hash ^= kind;
+    if (!hash)
+        hash = 1;
+    for (size_t i=0; i<Entries; ++i) {
+        Entry *e = &f->entries[(hash + i) % Entries];
+        uint64_t existing = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+        if (existing == hash)
+            return e;
+        if (existing)
+            continue;
+        if (!create)
+            return nullptr;
+        // we only get here the first time key fails so losing the race to
+        // another key just means trying the next entry
+        if (__atomic_compare_exchange_n(&e->hash, &existing, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            e->kind = kind;
+            snprintf(e->key, sizeof(e->key), "%s", key.c_str());
+            return e;
+        } else if (existing == hash) {
+            return e;
+        }
+    }
+    // full, it's only ever cleared with the file
+    return nullptr;
+}
+
+bool Breaker::allow(Entry *e)
+{
+    if (!e || __atomic_load_n(&e->failures, __ATOMIC_RELAXED) < Config::circuitBreakerFailures)
+        return true;
+    const unsigned long long now = Client::mono();
+    uint64_t openUntil = __atomic_load_n(&e->openUntil, __ATOMIC_RELAXED);
+    if (now < openUntil)
+        return false;
+    // half open, whoever moves the cool-down gets to try it
+    return __atomic_compare_exchange_n(&e->openUntil, &openUntil, now + Config::circuitBreakerCooldown,
+                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+bool Breaker::allow(Kind kind, const std::string &key)
+{
+    Entry *e = entry(kind, key, false);
+    if (allow(e))
+        return true;
+    DEBUG("%s is failing, not trying it until %llu", key.c_str(),
+          static_cast<unsigned long long>(__atomic_load_n(&e->openUntil, __ATOMIC_RELAXED)));
+    return false;
+}
+
+std::vector<std::string> Breaker::open(Kind kind)
+{
+    std::vector<std::string> ret;
+    File *f = Config::circuitBreaker ? file() : nullptr;
+    if (!f)
+        return ret;
+    // only looking, the try after the cool-down is claimed by whoever gets
+    // the builder from the scheduler
+    const unsigned long long now = Client::mono();
+    for (Entry &e : f->entries) {
+        if (__atomic_load_n(&e.hash, __ATOMIC_ACQUIRE)
+            && e.kind == static_cast<uint32_t>(kind)
+            && __atomic_load_n(&e.failures, __ATOMIC_RELAXED) >= Config::circuitBreakerFailures
+            && now < __atomic_load_n(&e.openUntil, __ATOMIC_RELAXED)) {
+            ret.push_back(std::string(e.key, strnlen(e.key, sizeof(e.key))));
+        }
+    }
+    return ret;
+}
+
+void Breaker::failure(Kind kind, const std::string &key)
+{
+    Entry *e = entry(kind, key, true);
+    if (!e)
+        return;
+    if (__atomic_add_fetch(&e->failures, 1, __ATOMIC_RELAXED) >= Config::circuitBreakerFailures) {
+        DEBUG("%s has failed %u times in a row", key.c_str(), __atomic_load_n(&e->failures, __ATOMIC_RELAXED));
+        __atomic_store_n(&e->openUntil, Client::mono() + Config::circuitBreakerCooldown, __ATOMIC_RELAXED);
+    }
+}
+
+void Breaker::success(Kind kind, const std::string &key)
+{
+    Entry *e = entry(kind, key, false);
+    if (!e)
+        return;
+    __atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->openUntil, 0, __ATOMIC_RELAXED);
+}
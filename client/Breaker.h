@@ -0,0 +1,59 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Consecutive failures talking to the scheduler and to each builder, shared
+// by every fiskc through a small mmap'd file under Config::cacheDir like
+// Timings. After circuit-breaker-failures in a row the scheduler isn't tried
+// and the builder is excluded until circuit-breaker-cooldown has passed, then
+// a single fiskc gets to try it again. If that works the count starts over,
+// if it doesn't it's another cool-down.
+class Breaker
+{
+public:
+    enum Kind {
+        Scheduler,
+        Builder
+    };
+
+    // Whether key should be tried, false while it's cooling down or another
+    // fiskc is trying it again. After the cool-down the first one to ask
+    // gets to try it
+    static bool allow(Kind kind, const std::string &key);
+    // The keys that are cooling down, the builders to exclude. Doesn't claim
+    // anything
+    static std::vector<std::string> open(Kind kind);
+
+    static void failure(Kind kind, const std::string &key);
+    static void success(Kind kind, const std::string &key);
+private:
+    enum {
+        Magic = 0x66626b31, // fbk1
+        Entries = 256,
+        KeySize = 64
+    };
+    struct Entry {
+        // 0 for an unused entry
+        uint64_t hash;
+        uint32_t failures;
+        uint32_t kind;
+        // Client::mono(), shared by all processes on the machine
+        uint64_t openUntil;
+        char key[KeySize];
+    };
+    struct File {
+        uint32_t magic;
+        uint32_t size;
+        Entry entries[Entries];
+    };
+
+    static File *file();
+    static Entry *entry(Kind kind, const std::string &key, bool create);
+    static bool allow(Entry *entry);
+};
+
+#endif /* BREAKER_H */
@@ -3,19 +3,31 @@
 
 #include "WebSocket.h"
 #include "Client.h"
+#include "Compression.h"
 #include "Watchdog.h"
+#include <functional>
 #include <string>
 
 extern "C" const char *npm_version;
 class BuilderWebSocket : public WebSocket
 {
 public:
+    struct File {
+        std::string path;
+        size_t remaining { 0 };
+        size_t rawBytes { 0 };
+        size_t written { 0 };
+        bool deflate { false };
+    };
+
     bool wait { false };
     virtual void onConnected() override;
     virtual void onMessage(MessageType messageType, const void *bytes, size_t len) override
     {
         Client::Data &data = Client::data();
         DEBUG("Got message %s %zu bytes", messageType == WebSocket::Text ? "text" : "binary", len);
+        if (cancelled)
+            return;
 
         if (messageType == WebSocket::Binary) {
             handleResponseBinary(bytes, len);
@@ -42,6 +54,22 @@ public:
             return;
         }
 
+        if (type == "needHeaders") {
+            for (const json11::Json &hash : msg["hashes"].array_items())
+                neededHeaders.push_back(hash.string_value());
+            DEBUG("Builder needs %zu headers", neededHeaders.size());
+            needHeaders = true;
+            return;
+        }
+
+        if (type == "needChunks") {
+            for (const json11::Json &hash : msg["hashes"].array_items())
+                neededChunks.push_back(hash.string_value());
+            DEBUG("Builder needs %zu chunks", neededChunks.size());
+            needChunks = true;
+            return;
+        }
+
         if (type == "heartbeat") {
             DEBUG("Got a heartbeat.");
             data.watchdog->heartbeat();
@@ -60,8 +88,8 @@ public:
 
             json11::Json::array index = msg["index"].array_items();
             data.exitCode = msg["exitCode"].int_value();
-            const std::string stdOut = msg["stdout"].string_value();
-            const std::string stdErr = msg["stderr"].string_value();
+            stdOut = msg["stdout"].string_value();
+            stdErr = msg["stderr"].string_value();
 
             if (data.exitCode) {
                 const std::string uncolored = Client::uncolor(stdErr);
@@ -85,6 +113,12 @@ public:
                         data.objectCache ? "true" : "false", npm_version);
             }
 
+            // before anything is printed, a local compile we're racing
+            // mustn't print too and we can't try another builder
+            responded = true;
+            if (responseCallback)
+                responseCallback();
+
             if (!stdOut.empty()) {
                 fprintf(stdout, "stdout: ");
                 fwrite(stdOut.c_str(), 1, stdOut.size(), stdout);
@@ -94,6 +128,9 @@ public:
                 fwrite(stdErr.c_str(), 1, stdErr.size(), stderr);
             }
 
+            // we asked for it with fetchDictionary
+            dictionary = Client::unbase64(msg["dictionary"].string_value());
+
             const auto objectCache = msg["objectCache"];
             if (objectCache.is_bool() && objectCache.bool_value()) {
                 data.objectCache = true;
@@ -104,8 +141,22 @@ public:
                 for (size_t i=0; i<index.size(); ++i) {
                     File &ff = files[i];
                     ff.path = index[i]["path"].string_value();
+                    outputs.push_back(ff.path);
                     ff.remaining = index[i]["bytes"].int_value();
-                    totalWritten += ff.remaining;
+                    const std::string encoding = index[i]["encoding"].string_value();
+                    if (encoding == "deflate") {
+                        ff.deflate = true;
+                        ff.rawBytes = index[i]["rawBytes"].int_value();
+                    } else if (!encoding.empty()) {
+                        ERROR("Unknown encoding %s for idx: %zu", encoding.c_str(), i);
+                        Client::data().watchdog->stop();
+                        error = "builder protocol error";
+                        done = true;
+                        return;
+                    } else {
+                        ff.rawBytes = ff.remaining;
+                    }
+                    totalWritten += ff.rawBytes;
                     if (ff.path.empty()) {
                         ERROR("No file for idx: %zu", i);
                         Client::data().watchdog->stop();
@@ -114,16 +165,13 @@ public:
                         return;
                     }
                 }
-                f = fopen(files[0].path.c_str(), "w");
-                DEBUG("Opened file [%s] -> [%s] -> %p", files[0].path.c_str(), Client::realpath(files[0].path).c_str(), f);
-                if (!f) {
+                if (!openFile()) {
                     ERROR("Can't open file: %s", files[0].path.c_str());
                     Client::data().watchdog->stop();
                     error = "builder file open error";
                     done = true;
                     return;
                 }
-                assert(f);
                 if (files[0].remaining)
                     fill(nullptr, 0);
             } else {
@@ -155,16 +203,36 @@ public:
         }
     }
 
+    bool openFile()
+    {
+        File &front = files.front();
+        f = fopen(front.path.c_str(), "w");
+        DEBUG("Opened file [%s] -> [%s] -> %p", front.path.c_str(), Client::realpath(front.path).c_str(), f);
+        if (!f)
+            return false;
+        return !front.deflate || inflater.reset();
+    }
+
+    bool writeFile(File &file, const unsigned char *data, size_t len)
+    {
+        if (!file.deflate)
+            return fwrite(data, 1, len, f) == len;
+        return inflater.inflate(data, len, [this, &file](const void *out, size_t outLen) {
+            file.written += outLen;
+            return file.written <= file.rawBytes && fwrite(out, 1, outLen, f) == outLen;
+        });
+    }
+
     void fill(const unsigned char *data, const size_t bytes)
     {
         assert(f);
         auto *front = &files.front();
         size_t offset = 0;
         do {
-            const size_t b = std::min(front->remaining, bytes);
+            const size_t b = std::min(front->remaining, bytes - offset);
             assert(f);
             if (b) {
-                if (fwrite(data + offset, 1, b, f) != b) {
+                if (!writeFile(*front, data + offset, b)) {
                     ERROR("Failed to write to file %s (%d %s)", front->path.c_str(), errno, strerror(errno));
                     Client::data().watchdog->stop();
                     error = "builder file write error";
@@ -175,6 +243,13 @@ public:
                 front->remaining -= b;
             }
             if (!front->remaining) {
+                if (front->deflate && (!inflater.finished() || front->written != front->rawBytes)) {
+                    ERROR("Truncated compressed data for %s, got %zu/%zu bytes", front->path.c_str(), front->written, front->rawBytes);
+                    Client::data().watchdog->stop();
+                    error = "builder decompress error";
+                    done = true;
+                    return;
+                }
                 int ret;
                 EINTRWRAP(ret, fclose(f));
                 f = nullptr;
@@ -187,9 +262,7 @@ public:
                     break;
                 }
                 front = &files.front();
-                f = fopen(front->path.c_str(), "w");
-                DEBUG("Opened file [%s] -> [%s] -> %p", front->path.c_str(), Client::realpath(front->path).c_str(), f);
-                if (!f) {
+                if (!openFile()) {
                     Client::data().watchdog->stop();
                     error = "builder file open error 2";
                     done = true;
@@ -208,15 +281,21 @@ public:
         }
     }
 
-    struct File {
-        std::string path;
-        size_t remaining;
-    };
-
     std::vector<File> files;
+    std::vector<std::string> outputs; // paths of files, they're removed from files as they're written
+    std::string stdOut, stdErr;
     size_t totalWritten { 0 };
     FILE *f { nullptr };
+    Inflater inflater;
     bool done { false };
+    bool responded { false };
+    bool cancelled { false }; // the other builder of a hedged job answered first
+    bool needHeaders { false };
+    std::vector<std::string> neededHeaders; // md5s of pumped files the builder doesn't have
+    bool needChunks { false };
+    std::vector<std::string> neededChunks; // md5s of chunks of the preprocessed output, ditto
+    std::string dictionary;
+    std::function<void()> responseCallback;
     std::string error;
 };
 
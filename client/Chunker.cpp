@@ -0,0 +1,81 @@
+#include "Chunker.h"
+#include "Hasher.h"
+#include "Preprocessed.h"
+#include <algorithm>
+#include <stdint.h>
+
+// Builders share chunks between clients so every fiskc has to find the same
+// boundaries, the table comes from a fixed seed
+static const uint64_t *gear()
+{
+    static uint64_t table[256];
+    static bool initialized = false;
+    if (!initialized) {
+        uint64_t state = 0x6669736b63646321ULL;
+        for (uint64_t &value : table) {
+            // splitmix64
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        initialized = true;
+    }
+    return table;
+}
+
+// Normalized chunking, harder to cut before AverageSize and easier after it
+static const uint64_t MaskS = 0x0003590703530000ULL; // 15 bits
+static const uint64_t MaskL = 0x0000d90003530000ULL; // 11 bits
+
+size_t Chunker::next(const unsigned char *data, size_t len)
+{
+    if (len <= MinSize)
+        return len;
+    if (len > MaxSize)
+        len = MaxSize;
+    const size_t normal = std::min<size_t>(len, AverageSize);
+    const uint64_t *table = gear();
+    uint64_t fp = 0;
+    size_t i = MinSize;
+    for (; i<normal; ++i) {
+        fp = (fp << 1) + table[data[i]];
+        if (!(fp & MaskS))
+            return i + 1;
+    }
+    for (; i<len; ++i) {
+        fp = (fp << 1) + table[data[i]];
+        if (!(fp & MaskL))
+            return i + 1;
+    }
+    return len;
+}
+
+bool Chunker::split(const Preprocessed &preprocessed, std::vector<Chunk> &chunks)
+{
+    const size_t size = preprocessed.available();
+    std::string buffer, block;
+    size_t bufferOffset = 0; // where buffer starts in the output
+    size_t pos = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        // keep at least MaxSize bytes ahead of us unless we're at the end
+        if (buffer.size() - pos < MaxSize && bufferOffset + buffer.size() < size) {
+            if (!preprocessed.read(bufferOffset + buffer.size(), Preprocessed::StreamChunkSize, block))
+                return false;
+            buffer.erase(0, pos);
+            bufferOffset += pos;
+            pos = 0;
+            buffer += block;
+            continue;
+        }
+        const size_t len = next(reinterpret_cast<const unsigned char *>(buffer.c_str()) + pos, buffer.size() - pos);
+        Hasher hasher;
+        hasher.init(Hasher::MD5);
+        hasher.update(buffer.c_str() + pos, len);
+        chunks.push_back({ offset, len, hasher.finalize() });
+        pos += len;
+        offset += len;
+    }
+    return true;
+}
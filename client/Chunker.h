@@ -0,0 +1,34 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <string>
+#include <vector>
+
+class Preprocessed;
+
+// FastCDC content defined chunking of preprocessed output. Boundaries depend
+// only on the bytes around them so the text of a header lands in the same
+// chunks in every TU that includes it and builders only need the chunks they
+// haven't seen. Chunks are named by the md5 of their contents, the builder
+// checks them.
+class Chunker
+{
+public:
+    enum {
+        MinSize = 2 * 1024,
+        AverageSize = 8 * 1024,
+        MaxSize = 64 * 1024
+    };
+
+    struct Chunk {
+        size_t offset;
+        size_t size;
+        std::string hash;
+    };
+
+    // The length of the chunk that starts at data
+    static size_t next(const unsigned char *data, size_t len);
+    static bool split(const Preprocessed &preprocessed, std::vector<Chunk> &chunks);
+};
+
+#endif /* CHUNKER_H */
@@ -5,12 +5,14 @@
 #include "DaemonSocket.h"
 #include "Preprocessed.h"
 #include "Select.h"
+#include "SharedSlots.h"
 #include "Config.h"
 #include <unistd.h>
 #include <climits>
 #include <cstdlib>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <algorithm>
 #ifdef __linux__
@@ -324,6 +326,17 @@ const char *Client::trimSourceRoot(const std::string &str, int *len)
 bool Client::setFlag(int fd, int flag)
 {
     int flags, r;
+    if (flag & O_CLOEXEC) {
+        // close-on-exec is a descriptor flag, F_SETFL silently ignores it
+        EINTRWRAP(r, fcntl(fd, F_SETFD, FD_CLOEXEC));
+        if (r == -1) {
+            ERROR("Failed to set FD_CLOEXEC on socket %d %d %s", fd, errno, strerror(errno));
+            return false;
+        }
+        flag &= ~O_CLOEXEC;
+        if (!flag)
+            return true;
+    }
     EINTRWRAP(flags, fcntl(fd, F_GETFL, 0));
     if (flags == -1) {
         ERROR("Failed to read flags from %d %d %s", fd, errno, strerror(errno));
@@ -338,6 +351,53 @@ bool Client::setFlag(int fd, int flag)
     return true;
 }
 
+Client::MappedFile::~MappedFile()
+{
+    if (mData)
+        munmap(const_cast<char *>(mData), mSize);
+    if (mFD != -1) {
+        int ret;
+        EINTRWRAP(ret, ::close(mFD));
+    }
+}
+
+bool Client::MappedFile::open(const std::string &fileName, std::string *error)
+{
+    assert(mFD == -1);
+    EINTRWRAP(mFD, ::open(fileName.c_str(), O_RDONLY|O_CLOEXEC));
+    if (mFD == -1) {
+        if (error)
+            *error = Client::format("Failed to open %s for reading (%d %s)", fileName.c_str(), errno, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(mFD, &st)) {
+        if (error)
+            *error = Client::format("Failed to stat %s (%d %s)", fileName.c_str(), errno, strerror(errno));
+        return false;
+    }
+    mSize = st.st_size;
+    if (!mSize)
+        return true;
+    void *data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFD, 0);
+    if (data == MAP_FAILED) {
+        if (error)
+            *error = Client::format("Failed to mmap %s (%d %s)", fileName.c_str(), errno, strerror(errno));
+        mSize = 0;
+        return false;
+    }
+    madvise(data, mSize, MADV_SEQUENTIAL);
+    mData = static_cast<const char *>(data);
+    return true;
+}
+
+int Client::MappedFile::release()
+{
+    const int fd = mFD;
+    mFD = -1;
+    return fd;
+}
+
 bool Client::recursiveMkdir(const std::string &dir, mode_t mode)
 {
     struct stat statBuf;
@@ -431,10 +491,18 @@ void Client::writeStatistics()
         stats["command_line"] = data.originalArgs;
     }
     stats["object_cache"] = data.objectCache;
+    stats["direct_cache"] = data.directCacheHit;
+    stats["shared_direct_cache"] = data.sharedDirectCacheHit;
     if (data.preprocessed) {
         stats["cpp_size"] = static_cast<int>(data.preprocessed->cppSize);
         stats["cpp_time"] = static_cast<int>(data.preprocessed->duration);
     }
+    if (data.uploadSize)
+        stats["upload_size"] = static_cast<int>(data.uploadSize);
+    if (!data.race.empty())
+        stats["race"] = data.race;
+    if (!data.hedge.empty())
+        stats["hedge"] = data.hedge;
     const std::string json = json11::Json(stats).dump();
 
     FILE *f = fopen(file.c_str(), "a+");
@@ -518,6 +586,8 @@ void Client::runLocal(const std::string &reason)
     } else { // parent
         int ret, status;
         EINTRWRAP(ret, waitpid(pid, &status, 0));
+        // _exit() doesn't get to ~DaemonSocket()
+        SharedSlots::releaseAll();
         writeStatistics();
         if (WIFEXITED(status))
             _exit(WEXITSTATUS(status));
@@ -710,6 +780,23 @@ std::string Client::base64(const std::string &src)
     return ret;
 }
 
+std::string Client::unbase64(const std::string &src)
+{
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    BIO *source = BIO_new_mem_buf(src.c_str(), static_cast<int>(src.size()));
+    BIO_push(b64, source);
+    std::string ret(src.size() * 3 / 4 + 3, ' ');
+    size_t len = 0;
+    int read;
+    while (len < ret.size() && (read = BIO_read(b64, &ret[len], static_cast<int>(ret.size() - len))) > 0)
+        len += read;
+    ret.resize(len);
+    BIO_free(b64);
+    BIO_free(source);
+    return ret;
+}
+
 std::string Client::uncolor(std::string str)
 {
     while (true) {
@@ -751,17 +838,17 @@ bool Client::uploadEnvironment(SchedulerWebSocket *schedulerWebSocket, const std
         schedulerWebSocket->send(WebSocket::Text, json.c_str(), json.size());
         Select select;
         select.add(schedulerWebSocket);
-        char buf[1024 * 256];
         size_t sent = 0;
         do {
-            const size_t chunkSize = std::min(static_cast<size_t>(st.st_size - sent), sizeof(buf));
-            if (fread(buf, 1, chunkSize, f) != chunkSize) {
+            std::string buf(std::min<size_t>(st.st_size - sent, 1024 * 256), '\0');
+            const size_t chunkSize = buf.size();
+            if (fread(&buf[0], 1, chunkSize, f) != chunkSize) {
                 ERROR("Failed to read from %s: %d %s", tarball.c_str(), errno, strerror(errno));
                 int ret;
                 EINTRWRAP(ret, fclose(f));
                 return false;
             }
-            schedulerWebSocket->send(WebSocket::Binary, buf, chunkSize);
+            schedulerWebSocket->send(WebSocket::Binary, std::move(buf));
             DEBUG("Sending %zu bytes %zu/%zu sent", chunkSize, sent, static_cast<size_t>(st.st_size));
             while (schedulerWebSocket->hasPendingSendData() && schedulerWebSocket->state() == SchedulerWebSocket::ConnectedWebSocket)
                 select.exec();
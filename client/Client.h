@@ -3,6 +3,7 @@
 
 #include "Config.h"
 #include "CompilerArgs.h"
+#include "Hasher.h"
 #include "Log.h"
 #include <assert.h>
 #include <condition_variable>
@@ -42,8 +43,13 @@ struct Data
     std::string builderIp, builderHostname;
     std::string hash;
     bool objectCache { false };
+    bool directCacheHit { false };
+    bool sharedDirectCacheHit { false };
     int exitCode { 0 };
     size_t totalWritten { 0 };
+    size_t uploadSize { 0 };
+    std::string race; // "local" or "remote", who won if we compiled both
+    std::string hedge; // "first" or "hedge", who answered if we hedged
 
     std::unique_ptr<Preprocessed> preprocessed;
     std::shared_ptr<CompilerArgs> compilerArgs;
@@ -52,11 +58,7 @@ struct Data
 
     std::string commandLineAsString() const;
 
-    MD5state_st md5 = []() {
-        MD5state_st ret;
-        MD5_Init(&ret);
-        return ret;
-    }();
+    Hasher hasher;
 };
 Data &data();
 
@@ -137,6 +139,7 @@ inline std::string sha1(const std::string &str)
 }
 
 std::string base64(const std::string &src);
+std::string unbase64(const std::string &src);
 std::string uncolor(std::string src);
 inline std::string toHex(const void *t, size_t s)
 {
@@ -271,6 +274,27 @@ inline bool readFile(const std::string &fileName, T &t, bool *opened = nullptr,
     return true;
 }
 
+// Read only mmap of a whole file. The fd stays open for the lifetime of the
+// object unless release() hands it over to the caller.
+class MappedFile
+{
+public:
+    MappedFile() {}
+    ~MappedFile();
+    bool open(const std::string &fileName, std::string *error = nullptr);
+    const char *data() const { return mData; }
+    size_t size() const { return mSize; }
+    int fd() const { return mFD; }
+    int release();
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    int mFD { -1 };
+    const char *mData { nullptr };
+    size_t mSize { 0 };
+};
+
 std::string environmentHash(const std::string &compiler);
 bool uploadEnvironment(SchedulerWebSocket *schedulerWebSocket, const std::string &tarball);
 std::string prepareEnvironmentForUpload(std::string *dir);
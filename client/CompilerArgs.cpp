@@ -171,8 +171,8 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(const std::vector<std::string
         if (objectCache) {
             for (size_t aa = i; aa < i + count; ++aa) {
                 const std::string &arg = args[aa];
-                VERBOSE("Md5'ing arg %zu [%s]", aa, arg.c_str());
-                MD5_Update(&Client::data().md5, arg.c_str(), arg.size());
+                VERBOSE("Hashing arg %zu [%s]", aa, arg.c_str());
+                Client::data().hasher.update(arg.c_str(), arg.size());
             }
         }
     };
@@ -278,6 +278,12 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(const std::vector<std::string
             continue;
         }
 
+        if (!strncmp(arg.c_str(), "-MF", 3)) {
+            ret->flags |= HasDashMF;
+            md5();
+            continue;
+        }
+
         if (arg == "-MD") {
             ret->flags |= HasDashMD;
             md5();
@@ -479,8 +485,8 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(const std::vector<std::string
 
             int len = 0;
             const char *fn = Client::trimSourceRoot(arg, &len);
-            MD5_Update(&Client::data().md5, fn, len);
-            VERBOSE("Md5'ing arg %zu [%.*s]", i, len, fn);
+            Client::data().hasher.update(fn, len);
+            VERBOSE("Hashing arg %zu [%.*s]", i, len, fn);
             continue;
         }
 
@@ -512,10 +518,10 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(const std::vector<std::string
         ret->commandLine.push_back("-o");
         std::string out = ret->output();
         if (objectCache) {
-            MD5_Update(&Client::data().md5, "-o", 2);
-            MD5_Update(&Client::data().md5, out.c_str(), out.size());
-            VERBOSE("Md5'ing arg [-o]");
-            VERBOSE("Md5'ing arg [%s]", out.c_str());
+            Client::data().hasher.update("-o", 2);
+            Client::data().hasher.update(out.c_str(), out.size());
+            VERBOSE("Hashing arg [-o]");
+            VERBOSE("Hashing arg [%s]", out.c_str());
         }
         ret->commandLine.push_back(std::move(out));
         ret->flags |= HasDashO;
@@ -526,22 +532,21 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(const std::vector<std::string
         Client::parsePath(ret->output(), nullptr, &dir);
         dir = Client::realpath(dir);
         if (objectCache) {
-            MD5_Update(&Client::data().md5, "-fprofile-dir=", 14);
-            MD5_Update(&Client::data().md5, dir.c_str(), dir.size());
-            VERBOSE("Md5'ing arg [-fprofile-dir=%s]", dir.c_str());
+            Client::data().hasher.update("-fprofile-dir=", 14);
+            Client::data().hasher.update(dir.c_str(), dir.size());
+            VERBOSE("Hashing arg [-fprofile-dir=%s]", dir.c_str());
         }
         ret->commandLine.push_back("-fprofile-dir=" + dir);
     }
 
     if (ret->flags & (HasDashMMD|HasDashMD) && !(ret->flags & HasDashMF)) {
-        const std::string out = ret->output();
+        std::string dfile = ret->dependencyFile();
         ret->commandLine.push_back("-MF");
-        std::string dfile = out.substr(0, out.find_last_of('.')) + ".d";
         if (objectCache) {
-            MD5_Update(&Client::data().md5, "-MF", 2);
-            MD5_Update(&Client::data().md5, dfile.c_str(), dfile.size());
-            VERBOSE("Md5'ing arg [-MF]");
-            VERBOSE("Md5'ing arg [%s]", dfile.c_str());
+            Client::data().hasher.update("-MF", 2);
+            Client::data().hasher.update(dfile.c_str(), dfile.size());
+            VERBOSE("Hashing arg [-MF]");
+            VERBOSE("Hashing arg [%s]", dfile.c_str());
         }
         ret->commandLine.push_back(std::move(dfile));
     }
@@ -612,3 +617,25 @@ std::string CompilerArgs::output() const
         return output;
     }
 }
+
+std::string CompilerArgs::dependencyFile() const
+{
+    std::string ret;
+    for (size_t i=1; i<commandLine.size(); ++i) {
+        const std::string &arg = commandLine[i];
+        if (arg == "-MF") {
+            if (i + 1 < commandLine.size())
+                ret = commandLine[++i];
+        } else if (!strncmp(arg.c_str(), "-MF", 3)) {
+            ret = arg.substr(3);
+        }
+    }
+    if (!ret.empty() || !(flags & (HasDashMMD|HasDashMD)))
+        return ret;
+
+    ret = output();
+    const size_t lastDot = ret.rfind('.');
+    if (lastDot != std::string::npos && (ret.find('/', lastDot) == std::string::npos))
+        ret.resize(lastDot);
+    return ret + ".d";
+}
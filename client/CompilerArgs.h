@@ -83,6 +83,9 @@ struct CompilerArgs
     }
 
     std::string output() const;
+    // Where -MD and -MMD write dependencies, -MF's argument or like gcc the
+    // output with its suffix replaced by .d. Empty if there aren't any
+    std::string dependencyFile() const;
 };
 
 inline CompilerArgs::Flag CompilerArgs::preprocessedFlag(Flag flag)
@@ -0,0 +1,151 @@
+#include "Compression.h"
+#include "Log.h"
+#include <string.h>
+
+std::unique_ptr<Compressor> Compressor::create(const std::string &encoding, int level)
+{
+    if (encoding == "zstd")
+        return std::unique_ptr<Compressor>(new ZstdCompressor(level));
+    if (encoding == "deflate")
+        return std::unique_ptr<Compressor>(new Deflater(level));
+    return std::unique_ptr<Compressor>();
+}
+
+Deflater::Deflater(int level)
+{
+    memset(&mStream, 0, sizeof(mStream));
+    const int ret = deflateInit(&mStream, level);
+    if (ret != Z_OK) {
+        ERROR("Failed to initialize zlib with level %d: %d", level, ret);
+    } else {
+        mInitialized = true;
+    }
+}
+
+Deflater::~Deflater()
+{
+    if (mInitialized)
+        deflateEnd(&mStream);
+}
+
+bool Deflater::compress(const void *data, size_t len, std::string &out)
+{
+    if (!mInitialized)
+        return false;
+    out.resize(deflateBound(&mStream, len));
+    mStream.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    mStream.avail_in = static_cast<uInt>(len);
+    mStream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    mStream.avail_out = static_cast<uInt>(out.size());
+    const int ret = deflate(&mStream, Z_FINISH);
+    const size_t written = mStream.total_out;
+    deflateReset(&mStream);
+    if (ret != Z_STREAM_END) {
+        ERROR("Failed to compress %zu bytes: %d", len, ret);
+        return false;
+    }
+    out.resize(written);
+    return true;
+}
+
+ZstdCompressor::ZstdCompressor(int level)
+    : mContext(ZSTD_createCCtx()), mLevel(level)
+{
+    if (!mContext)
+        ERROR("Failed to create zstd context");
+}
+
+ZstdCompressor::~ZstdCompressor()
+{
+    ZSTD_freeCDict(mDictionary);
+    ZSTD_freeCCtx(mContext);
+}
+
+bool ZstdCompressor::setDictionary(const std::string &dictionary)
+{
+    ZSTD_freeCDict(mDictionary);
+    // the dictionary gets digested for mLevel once instead of every frame
+    mDictionary = ZSTD_createCDict(dictionary.c_str(), dictionary.size(), mLevel);
+    if (!mDictionary) {
+        ERROR("Failed to load %zu byte compression dictionary", dictionary.size());
+        return false;
+    }
+    return true;
+}
+
+bool ZstdCompressor::compress(const void *data, size_t len, std::string &out)
+{
+    if (!mContext)
+        return false;
+    out.resize(ZSTD_compressBound(len));
+    const size_t written = (mDictionary
+                            ? ZSTD_compress_usingCDict(mContext, &out[0], out.size(), data, len, mDictionary)
+                            : ZSTD_compressCCtx(mContext, &out[0], out.size(), data, len, mLevel));
+    if (ZSTD_isError(written)) {
+        ERROR("Failed to compress %zu bytes: %s", len, ZSTD_getErrorName(written));
+        return false;
+    }
+    out.resize(written);
+    return true;
+}
+
+Inflater::Inflater()
+{
+    memset(&mStream, 0, sizeof(mStream));
+    const int ret = inflateInit(&mStream);
+    if (ret != Z_OK) {
+        ERROR("Failed to initialize zlib: %d", ret);
+    } else {
+        mInitialized = true;
+    }
+}
+
+Inflater::~Inflater()
+{
+    if (mInitialized)
+        inflateEnd(&mStream);
+}
+
+bool Inflater::reset()
+{
+    mFinished = false;
+    return mInitialized && inflateReset(&mStream) == Z_OK;
+}
+
+bool Inflater::inflate(const void *data, size_t len, const std::function<bool(const void *, size_t)> &func)
+{
+    if (!mInitialized)
+        return false;
+    if (mFinished)
+        return !len;
+    if (mBuffer.empty())
+        mBuffer.resize(64 * 1024);
+    mStream.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    mStream.avail_in = static_cast<uInt>(len);
+    while (true) {
+        mStream.next_out = reinterpret_cast<Bytef *>(&mBuffer[0]);
+        mStream.avail_out = static_cast<uInt>(mBuffer.size());
+        const int ret = ::inflate(&mStream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            ERROR("Failed to decompress: %d %s", ret, mStream.msg ? mStream.msg : "");
+            return false;
+        }
+        const size_t produced = mBuffer.size() - mStream.avail_out;
+        if (produced && !func(mBuffer.c_str(), produced))
+            return false;
+        if (ret == Z_STREAM_END) {
+            mFinished = true;
+            if (mStream.avail_in) {
+                ERROR("%u extraneous bytes after compressed data", mStream.avail_in);
+                return false;
+            }
+            return true;
+        }
+        if (!mStream.avail_in && mStream.avail_out)
+            return true;
+        if (ret == Z_BUF_ERROR && !produced) {
+            ERROR("Failed to decompress, no progress possible");
+            return false;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <zlib.h>
+#include <zstd.h>
+
+class Compressor
+{
+public:
+    virtual ~Compressor() {}
+
+    // encoding is what the builder picked in x-fisk-compression, null if
+    // it's nothing we can produce
+    static std::unique_ptr<Compressor> create(const std::string &encoding, int level);
+
+    virtual const char *encoding() const = 0;
+    // Every call produces a complete zlib stream or zstd frame so the
+    // builder can decompress each frame on its own
+    virtual bool compress(const void *data, size_t len, std::string &out) = 0;
+};
+
+class Deflater : public Compressor
+{
+public:
+    Deflater(int level);
+    virtual ~Deflater() override;
+
+    virtual const char *encoding() const override { return "deflate"; }
+    virtual bool compress(const void *data, size_t len, std::string &out) override;
+private:
+    z_stream mStream;
+    bool mInitialized { false };
+};
+
+class ZstdCompressor : public Compressor
+{
+public:
+    ZstdCompressor(int level);
+    virtual ~ZstdCompressor() override;
+
+    virtual const char *encoding() const override { return "zstd"; }
+    virtual bool compress(const void *data, size_t len, std::string &out) override;
+    // Compresses every following frame with a dictionary trained by
+    // zstd --train, the builder has to decompress with the same one
+    bool setDictionary(const std::string &dictionary);
+private:
+    ZSTD_CCtx *mContext;
+    ZSTD_CDict *mDictionary { nullptr };
+    const int mLevel;
+};
+
+class Inflater
+{
+public:
+    Inflater();
+    ~Inflater();
+
+    bool reset();
+    // Inflates as much as possible and passes the output to func in bounded
+    // chunks, func returning false aborts
+    bool inflate(const void *data, size_t len, const std::function<bool(const void *, size_t)> &func);
+    bool finished() const { return mFinished; }
+private:
+    z_stream mStream;
+    bool mInitialized { false };
+    bool mFinished { false };
+    std::string mBuffer;
+};
+
+#endif /* COMPRESSION_H */
@@ -82,23 +82,51 @@ Getter<bool> color("color", "Set to false to disable colorized output", true);
 Getter<bool> dumpSlots("dump-slots", "Dump slots info for fisk-daemon", false);
 Getter<bool> syncFileSystem("sync-file-system", "Call sync(2) after all writes", false);
 Getter<bool> disabled("disabled", "Set to true if you don't want to distribute this job", false);
-Getter<bool> noDesire("no-desire", "Set to true if you want to override desired-slots to for this job", false);
+Getter<bool> noDesire("no-desire", "Set to true if you don't want this job compiled locally because of desired-slots", false);
 Getter<bool> objectCache("object-cache", "Set to true if you want the scheduler to cache output from compiles. Also requires the scheduler to be configured with --object-cache and the builders to have --object-cache-size", true);
-Getter<std::string> objectCacheTag("object-cache-tag", "Additional tag that gets md5'ed into the cache key, default is username-hostname", defaultObjectCacheTag());
+Getter<std::string> objectCacheTag("object-cache-tag", "Additional tag that gets hashed into the cache key, default is username-hostname", defaultObjectCacheTag());
+Getter<std::string> cacheKeyHash("cache-key-hash", "Hash algorithm for object cache keys: \"xxh3\" or \"md5\"", "xxh3");
+Getter<bool> directCache("direct-cache", "Reuse outputs of earlier compiles of the same source and command line when none of its headers changed, without preprocessing. Requires object-cache", true);
+Getter<bool> sharedDirectCache("shared-direct-cache", "Look up and publish direct cache manifests through fisk-daemon's scheduler connection so objects compiled on other machines can be used without preprocessing", true);
+Getter<size_t> directCacheSize("direct-cache-size", "Max size of the local direct cache in MB", 1024);
 Getter<bool> watchdog("watchdog", "Whether watchdog is enabled", true);
 Getter<bool> verify("verify", "Only verify that the npm version is correct", false);
 Getter<unsigned long long> delay("delay", "Delay this many milliseconds before starting", 0);
 Getter<bool> discardComments("discard-comments", "Discard comments when preprocessing", true);
+Getter<std::string> compression("compression", "Compress uploads to builders that support it: \"zstd\" (falls back to deflate), \"deflate\" or \"none\"", "zstd");
+Getter<int> compressionLevel("compression-level", "zstd or zlib compression level for uploads", 1);
+Getter<bool> compressionDictionary("compression-dictionary", "Compress zstd uploads with the scheduler's dictionary for the compiler environment if the builder has it", true);
+Getter<bool> streamPreprocessed("stream-preprocessed", "Upload preprocessed output while the preprocessor is still running if the builder supports it", true);
+Getter<bool> rawStream("raw-stream", "Upload uncompressed preprocessed output straight from its file with sendfile() in websocket frames masked with a zero key, to builders that agree to it", false);
+Getter<bool> daemonScheduler("daemon-scheduler", "Ask fisk-daemon for a builder over its scheduler connection if it supports it", true);
+Getter<bool> builderPool("builder-pool", "Connect to builders through fisk-daemon's open connections if it supports it", true);
+Getter<bool> raceLocal("race-local", "Compile locally as well if fisk-daemon has a compile slot free right away and use whichever finishes first", false);
+Getter<bool> hedge("hedge", "Send a job to a second builder as well if the first one takes longer than hedge-percentile of earlier jobs of its size and use whichever answers first", false);
+Getter<int> hedgePercentile("hedge-percentile", "Percentile of earlier response times a job has to exceed to be hedged", 95);
+Getter<unsigned long long> hedgeMinimum("hedge-minimum", "Never hedge a job that has been waiting for less than this many milliseconds", 2000);
+Getter<bool> circuitBreaker("circuit-breaker", "Share scheduler and builder failures between fiskcs and stop trying ones that keep failing for a while", false);
+Getter<size_t> circuitBreakerFailures("circuit-breaker-failures", "Number of failures in a row before circuit-breaker stops trying the scheduler or a builder", 5, [](const size_t &value) { return std::max<size_t>(1, value); });
+Getter<unsigned long long> circuitBreakerCooldown("circuit-breaker-cooldown", "Milliseconds circuit-breaker waits before trying a failing scheduler or builder again", 30000);
+Getter<size_t> builderRetries("builder-retries", "Number of times to ask the scheduler for another builder when one fails before running locally", 2);
+Getter<bool> chunkUpload("chunk-upload", "Only upload the parts of the preprocessed output the builder doesn't already have if it supports it. Used instead of stream-preprocessed and raw-stream, waits for the whole file to be preprocessed", false);
+Getter<std::string> minimize("minimize", "Make preprocessed output smaller before uploading it: \"lines\" drops blank lines and line markers that aren't needed, \"whitespace\" also collapses whitespace (columns in diagnostics change, not used with -g) or \"none\"", "none");
+Getter<bool> minimizeVerify("minimize-verify", "Compile preprocessed output with and without --minimize locally and run locally if the objects differ", false);
+Getter<bool> pump("pump", "Send sources and the headers they include to builders that support it and preprocess there. Not used with object-cache", false);
 Getter<std::string> nodePath("node-path", "Path to nodejs executable", "node");
 static Separator s4;
 static Separator s5("Timeouts:");
 Getter<unsigned long long> daemonConnectTimeout("daemon-connect-timeout", "Set daemon connect timeout", 10000);
+Getter<unsigned long long> capabilitiesTimeout("daemon-capabilities-timeout", "Set how long to wait for fisk-daemon to report its capabilities", 100);
+Getter<unsigned long long> sharedDirectCacheTimeout("shared-direct-cache-timeout", "Set how long to wait for each step of fetching an object through the scheduler's manifests", 2000);
 Getter<unsigned long long> slotAcquisitionTimeout("slot-acquisition-timeout", "Set local compile slot acquisition timeout", 30000);
 Getter<unsigned long long> schedulerConnectTimeout("scheduler-connect-timeout", "Set scheduler connect watchdog timeout", 7500);
 Getter<unsigned long long> acquiredBuilderTimeout("acquire-builder-timeout", "Set acquired builder watchdog timeout", 7500);
 Getter<unsigned long long> builderConnectTimeout("builder-connect-timeout", "Set builder connect watchdog timeout", 7500);
 Getter<unsigned long long> preprocessTimeout("preprocess-timeout", "Set preprocess watchdog timeout", 10 * 60000);
 Getter<unsigned long long> uploadJobTimeout("upload-job-timeout", "Set upload job watchdog timeout", 15000);
+Getter<bool> adaptiveWatchdog("adaptive-watchdog", "Time out each stage after adaptive-watchdog-factor times what 99% of earlier jobs of the same size took, with the timeouts above as the most it waits", false);
+Getter<int> adaptiveWatchdogFactor("adaptive-watchdog-factor", "How many times the p99 of earlier jobs a stage gets with adaptive-watchdog", 3, [](const int &value) { return std::max(1, value); });
+Getter<unsigned long long> adaptiveWatchdogMinimum("adaptive-watchdog-minimum", "The least time in milliseconds a stage gets with adaptive-watchdog", 500);
 Getter<unsigned long long> responseTimeout("response-timeout", "Set response watchdog timeout (resets for every heartbeat (5s))", 10000); // restarts on each heartbeat which happen every 5 seconds
 Getter<std::string> compiler("compiler", "Set fiskc's resolved compiler");
 Getter<std::string> cacheDir("cache-dir", "Set fiskc's cache dir", getenv("HOME") ? std::string(getenv("HOME") + std::string("/.cache/fisk/client/")) : std::string(),
@@ -114,9 +142,10 @@ Getter<std::string> statisticsLog("statistics-log", "Dump statistics into this f
 static Separator s6;
 static Separator s7("CPU allowances:");
 Getter<size_t> compileSlots("slots", "Number of compile slots", std::thread::hardware_concurrency(), [](const size_t &value) { return std::max<size_t>(1, value); });
-Getter<size_t> desiredCompileSlots("desired-slots", "Number of desired compile slots", 0);
+Getter<size_t> desiredCompileSlots("desired-slots", "Number of jobs fisk-daemon starts out compiling locally before sending the rest to builders, adjusted by how long jobs take locally and remotely. 0 disables", 0);
 Getter<size_t> cppSlots("cpp-slots", "Number of preprocess slots", std::thread::hardware_concurrency() * 2, [](const size_t &value) { return std::max<size_t>(1, value); });
 Getter<std::string> releaseCppSlotMode("release-cpp-slot-mode", "Release cpp slot mode: cpp-finished or upload-finished", "cpp-finished");
+Getter<bool> sharedSlots("shared-slots", "Take cpp and compile slots straight from fisk-daemon's shared slots file instead of asking it over the socket when it runs with --shared-slots", true);
 
 static Separator s8;
 static Separator s9("Identity:");
@@ -195,6 +195,8 @@ extern Getter<std::string> scheduler;
 extern Getter<std::string> socket;
 extern Getter<bool> dumpSlots;
 extern Getter<unsigned long long> daemonConnectTimeout;
+extern Getter<unsigned long long> capabilitiesTimeout;
+extern Getter<unsigned long long> sharedDirectCacheTimeout;
 extern Getter<unsigned long long> slotAcquisitionTimeout;
 extern Getter<unsigned long long> schedulerConnectTimeout;
 extern Getter<unsigned long long> acquiredBuilderTimeout;
@@ -202,6 +204,9 @@ extern Getter<unsigned long long> builderConnectTimeout;
 extern Getter<unsigned long long> preprocessTimeout;
 extern Getter<unsigned long long> uploadJobTimeout;
 extern Getter<unsigned long long> responseTimeout;
+extern Getter<bool> adaptiveWatchdog;
+extern Getter<int> adaptiveWatchdogFactor;
+extern Getter<unsigned long long> adaptiveWatchdogMinimum;
 extern Getter<std::string> compiler;
 extern Getter<std::string> cacheDir;
 extern Getter<std::string> builder;
@@ -209,6 +214,10 @@ extern Getter<std::string> labels;
 extern Getter<bool> color;
 extern Getter<bool> objectCache;
 extern Getter<std::string> objectCacheTag;
+extern Getter<std::string> cacheKeyHash;
+extern Getter<bool> directCache;
+extern Getter<bool> sharedDirectCache;
+extern Getter<size_t> directCacheSize;
 extern Getter<bool> noDesire;
 extern Getter<bool> disabled;
 extern Getter<bool> help;
@@ -228,6 +237,7 @@ extern Getter<size_t> compileSlots;
 extern Getter<size_t> desiredCompileSlots;
 extern Getter<size_t> cppSlots;
 extern Getter<std::string> releaseCppSlotMode;
+extern Getter<bool> sharedSlots;
 extern Getter<bool> watchdog;
 extern Getter<bool> verify;
 extern Getter<std::string> nodePath;
@@ -241,6 +251,25 @@ extern Getter<bool> logTimePrefix;
 extern Getter<bool> verbose;
 extern Getter<bool> debug;
 extern Getter<bool> discardComments;
+extern Getter<bool> streamPreprocessed;
+extern Getter<bool> rawStream;
+extern Getter<bool> daemonScheduler;
+extern Getter<bool> builderPool;
+extern Getter<bool> raceLocal;
+extern Getter<bool> circuitBreaker;
+extern Getter<size_t> circuitBreakerFailures;
+extern Getter<unsigned long long> circuitBreakerCooldown;
+extern Getter<size_t> builderRetries;
+extern Getter<bool> hedge;
+extern Getter<int> hedgePercentile;
+extern Getter<unsigned long long> hedgeMinimum;
+extern Getter<bool> pump;
+extern Getter<bool> chunkUpload;
+extern Getter<std::string> minimize;
+extern Getter<bool> minimizeVerify;
+extern Getter<std::string> compression;
+extern Getter<int> compressionLevel;
+extern Getter<bool> compressionDictionary;
 extern Getter<unsigned long long> delay;
 }
 #endif /* CONFIG_H */
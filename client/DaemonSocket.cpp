@@ -1,6 +1,7 @@
 #include "DaemonSocket.h"
 #include "Config.h"
 #include "Client.h"
+#include "SharedSlots.h"
 #include "Watchdog.h"
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -8,13 +9,26 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <climits>
+
+// The first version of fisk-daemon's protocol that answers capabilities,
+// see Protocol in daemon/constants.js
+static const unsigned long sCapabilitiesProtocol = 1;
 
 DaemonSocket::DaemonSocket()
 {
 }
 
+DaemonSocket::~DaemonSocket()
+{
+    // the daemon would have released them when the connection closed
+    if (mShared)
+        SharedSlots::releaseAll();
+}
+
 bool DaemonSocket::connect()
 {
+    changed();
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
@@ -42,10 +56,18 @@ bool DaemonSocket::connect()
         return false;
     }
 
+    mShared = Config::sharedSlots && SharedSlots::open();
+
+    // older daemons don't have it
+    std::string protocol, err;
+    mAdvertisesCapabilities = (Client::readFile(path + ".protocol", protocol, nullptr, &err)
+                               && strtoul(protocol.c_str(), nullptr, 10) >= sCapabilitiesProtocol);
+
     const pid_t pid = getpid();
     static_assert(sizeof(pid) == 4, "pid_t must be 4 bytes");
     const uint32_t networkOrder = htonl(pid);
     mSendBuffer.append(reinterpret_cast<const char *>(&networkOrder), sizeof(networkOrder));
+    send("{ \"type\": \"capabilities\" }");
 
     int ret;
     EINTRWRAP(ret, ::connect(mFD, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
@@ -186,14 +208,48 @@ void DaemonSocket::write()
 
 void DaemonSocket::send(Command cmd)
 {
+    if (cmd == ReleaseCompileSlot)
+        mHasCompileSlot = false;
+    if (cmd == AcquireCppSlot || cmd == ReleaseCppSlot) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        // a job that starts over with another builder gets to where it
+        // releases it again
+        if (cmd == ReleaseCppSlot && !mCppSlotRequested)
+            return;
+        mCppSlotRequested = cmd == AcquireCppSlot;
+        if (cmd == ReleaseCppSlot)
+            mHasCppSlot = false;
+    }
+    if (mShared) {
+        // acquired in waitForCppSlot() and waitForCompileSlot()
+        switch (cmd) {
+        case AcquireCppSlot:
+        case AcquireCompileSlot:
+            return;
+        case ReleaseCppSlot:
+            SharedSlots::release(SharedSlots::Cpp);
+            return;
+        case ReleaseCompileSlot:
+            SharedSlots::release(SharedSlots::Compile);
+            return;
+        default:
+            break;
+        }
+    }
     const char ch = static_cast<char>(cmd);
     mSendBuffer.append(&ch, 1);
+    changed();
     DEBUG("Sending command %d", cmd);
 }
 
 void DaemonSocket::send(const std::string &json)
 {
-    send(JSON);
+    send(JSON, json);
+}
+
+void DaemonSocket::send(Command cmd, const std::string &json)
+{
+    send(cmd);
     union {
         uint32_t bytes;
         char buf[sizeof(uint32_t)];
@@ -204,6 +260,38 @@ void DaemonSocket::send(const std::string &json)
     DEBUG("DaemonSocket send message: %s", json.c_str());
 }
 
+void DaemonSocket::acquireBuilder(json11::Json::object &&request)
+{
+    assert(mCapabilities & AcquireBuilderCapability);
+    request["requestId"] = ++mBuilderRequestId;
+    mBuilderResponse = json11::Json();
+    send(AcquireBuilder, json11::Json(request).dump());
+}
+
+void DaemonSocket::lookupManifest(const std::string &key)
+{
+    assert(mCapabilities & ManifestCapability);
+    mManifestResponse = json11::Json();
+    send(json11::Json(json11::Json::object {
+                { "type", "lookupManifest" },
+                { "key", key }
+            }).dump());
+}
+
+void DaemonSocket::expectCppSize(size_t bytes)
+{
+    // daemons that don't know about it ignore it. Shared slots are taken
+    // against the same budget without asking the daemon
+    if (mShared) {
+        mExpectedCppSize = bytes;
+        return;
+    }
+    send(json11::Json(json11::Json::object {
+                { "type", "expectedCppSize" },
+                { "bytes", static_cast<double>(bytes) }
+            }).dump());
+}
+
 bool DaemonSocket::hasCppSlot() const
 {
     std::unique_lock<std::mutex> lock(mMutex);
@@ -213,6 +301,15 @@ bool DaemonSocket::hasCppSlot() const
 bool DaemonSocket::waitForCppSlot()
 {
     std::unique_lock<std::mutex> lock(mMutex);
+    if (mShared) {
+        if (!mHasCppSlot && mCppSlotRequested) {
+            lock.unlock();
+            const bool acquired = SharedSlots::acquire(SharedSlots::Cpp, ULLONG_MAX, mExpectedCppSize);
+            lock.lock();
+            mHasCppSlot = acquired;
+        }
+        return mHasCppSlot;
+    }
     while (!mHasCppSlot && mState == Connected) {
         mCond.wait(lock);
     }
@@ -221,6 +318,11 @@ bool DaemonSocket::waitForCppSlot()
 
 bool DaemonSocket::waitForCompileSlot(Select &select)
 {
+    if (mShared) {
+        if (!mHasCompileSlot)
+            mHasCompileSlot = SharedSlots::acquire(SharedSlots::Compile, Config::slotAcquisitionTimeout);
+        return mHasCompileSlot;
+    }
     const unsigned long long start = Client::mono();
     while (!mHasCompileSlot && mState == Connected && Client::mono() - start < Config::slotAcquisitionTimeout) {
         select.exec();
@@ -228,8 +330,59 @@ bool DaemonSocket::waitForCompileSlot(Select &select)
     return mHasCompileSlot;
 }
 
+bool DaemonSocket::tryAcquireCompileSlot(Select &select)
+{
+    assert(mCapabilities & TryAcquireCompileSlotCapability);
+    if (mShared) {
+        mHasCompileSlot = SharedSlots::tryAcquire(SharedSlots::Compile);
+        return mHasCompileSlot;
+    }
+    return tryAcquire(TryAcquireCompileSlot, select);
+}
+
+bool DaemonSocket::tryAcquireDesiredSlot(Select &select)
+{
+    assert(mCapabilities & DesiredSlotCapability);
+    return tryAcquire(TryAcquireDesiredSlot, select);
+}
+
+void DaemonSocket::reportRemoteFinished()
+{
+    assert(mCapabilities & DesiredSlotCapability);
+    send("{ \"type\": \"remoteFinished\" }");
+}
+
+bool DaemonSocket::tryAcquire(Command cmd, Select &select)
+{
+    mCompileSlotBusy = false;
+    send(cmd);
+    const unsigned long long start = Client::mono();
+    while (!mHasCompileSlot && !mCompileSlotBusy && mState == Connected && Client::mono() - start < Config::slotAcquisitionTimeout) {
+        select.exec();
+    }
+    return mHasCompileSlot;
+}
+
+bool DaemonSocket::waitForCapabilities(Select &select)
+{
+    if (!mAdvertisesCapabilities) {
+        DEBUG("Daemon doesn't advertise capabilities");
+        return false;
+    }
+    const unsigned long long start = Client::mono();
+    while (!mHasCapabilities && mState == Connected) {
+        const unsigned long long elapsed = Client::mono() - start;
+        if (elapsed >= Config::capabilitiesTimeout)
+            break;
+        select.exec(static_cast<int>(Config::capabilitiesTimeout - elapsed));
+    }
+    DEBUG("Daemon capabilities 0x%x%s", mCapabilities, mHasCapabilities ? "" : " (timed out)");
+    return mHasCapabilities;
+}
+
 void DaemonSocket::close(std::string &&err)
 {
+    changed();
     if (mFD != -1) {
         ::close(mFD);
         mFD = -1;
@@ -262,6 +415,11 @@ size_t DaemonSocket::processMessage(const char *const msg, const size_t len)
             mHasCompileSlot = true;
             used = 1;
             break;
+        case CompileSlotBusy:
+            DEBUG("CompileSlotBusy");
+            mCompileSlotBusy = true;
+            used = 1;
+            break;
         case JSONResponse:
             DEBUG("JSONResponse len %zu", len - ret);
             if (ret + 4 < len) {
@@ -290,6 +448,41 @@ size_t DaemonSocket::processMessage(const char *const msg, const size_t len)
 
 void DaemonSocket::processJSON(const std::string &json)
 {
+    std::string err;
+    json11::Json msg = json11::Json::parse(json, err, json11::JsonParse::COMMENTS);
+    if (!err.empty()) {
+        close(Client::format("Failed to parse json from daemon: %s", err.c_str()));
+        return;
+    }
+    if (msg["type"].string_value() == "capabilities") {
+        mHasCapabilities = true;
+        if (msg["acquireBuilder"].bool_value())
+            mCapabilities |= AcquireBuilderCapability;
+        if (msg["manifests"].bool_value())
+            mCapabilities |= ManifestCapability;
+        if (msg["tryAcquireCompileSlot"].bool_value())
+            mCapabilities |= TryAcquireCompileSlotCapability;
+        if (msg["desiredSlots"].bool_value())
+            mCapabilities |= DesiredSlotCapability;
+        mBuilderSocket = msg["builderSocket"].string_value();
+        if (!mBuilderSocket.empty())
+            mCapabilities |= BuilderPoolCapability;
+        return;
+    }
+    if (msg["type"].string_value() == "manifest") {
+        mManifestResponse = std::move(msg);
+        return;
+    }
+    if (msg["requestId"].is_number()) {
+        if (msg["requestId"].int_value() != mBuilderRequestId || !mBuilderResponse.is_null()) {
+            DEBUG("Dropping builder response for request %d, waiting for %d",
+                  msg["requestId"].int_value(), mBuilderRequestId);
+        } else {
+            mBuilderResponse = std::move(msg);
+        }
+        return;
+    }
+
     fwrite(json.c_str(), 1, json.size(), stdout);
     fflush(stdout);
     close();
@@ -2,6 +2,7 @@
 #define DAEMONSOCKET_H
 
 #include "Select.h"
+#include <json11.hpp>
 #include <string>
 #include <condition_variable>
 #include <mutex>
@@ -10,6 +11,7 @@ class DaemonSocket : public Socket
 {
 public:
     DaemonSocket();
+    ~DaemonSocket();
     bool connect();
 
     enum State {
@@ -26,17 +28,59 @@ public:
         AcquireCompileSlot = 2,
         ReleaseCppSlot = 3,
         ReleaseCompileSlot = 4,
-        JSON = 5
+        JSON = 5,
+        AcquireBuilder = 6,
+        TryAcquireCompileSlot = 7,
+        TryAcquireDesiredSlot = 8
     };
 
     void send(const std::string &json);
     void send(Command cmd);
+    void send(Command cmd, const std::string &json);
+    // How much preprocessed output the next AcquireCppSlot is likely to
+    // produce, fisk-daemon admits preprocessing against a memory budget
+    void expectCppSize(size_t bytes);
     bool hasCppSlot() const;
     bool waitForCppSlot();
 
     bool hasCompileSlot() const { return mHasCompileSlot; }
     bool waitForCompileSlot(Select &select);
+    // A compile slot if one is free right now, doesn't queue
+    bool tryAcquireCompileSlot(Select &select);
+    // A compile slot if the daemon wants this job compiled locally, see
+    // desired-slots. If not, reportRemoteFinished() when the builder is done
+    bool tryAcquireDesiredSlot(Select &select);
+    void reportRemoteFinished();
     std::string error() const { return mError; }
+
+    // Daemons that don't know about a command drop the connection so anything
+    // newer than JSON has to be checked for here first
+    enum Capability {
+        AcquireBuilderCapability = 0x1,
+        BuilderPoolCapability = 0x2,
+        ManifestCapability = 0x4,
+        TryAcquireCompileSlotCapability = 0x8,
+        DesiredSlotCapability = 0x10
+    };
+    bool waitForCapabilities(Select &select);
+    unsigned int capabilities() const { return mCapabilities; }
+    // Where fisk-daemon accepts builder websockets that it relays over
+    // connections it keeps open
+    const std::string &builderSocket() const { return mBuilderSocket; }
+
+    // Asks the daemon's scheduler connection for a builder. Each request
+    // gets an id the daemon echoes so an answer to an earlier one that
+    // arrives late isn't taken for this one's
+    void acquireBuilder(json11::Json::object &&request);
+    // The scheduler's answer to acquireBuilder(), relayed by the daemon
+    bool hasBuilderResponse() const { return !mBuilderResponse.is_null(); }
+    const json11::Json &builderResponse() const { return mBuilderResponse; }
+
+    // Asks the scheduler for the manifests it has for a direct cache key,
+    // the response is { "type": "manifest", "entries": [...] }
+    void lookupManifest(const std::string &key);
+    bool hasManifestResponse() const { return !mManifestResponse.is_null(); }
+    const json11::Json &manifestResponse() const { return mManifestResponse; }
     void processJSON(const std::string &json);
 protected:
     // Socket
@@ -48,11 +92,13 @@ protected:
     virtual void onTimeout() override {}
 private:
     void write();
+    bool tryAcquire(Command cmd, Select &select);
     void close(std::string &&err = std::string());
     enum Response {
         CppSlotAcquired = 10,
         CompileSlotAcquired = 11,
-        JSONResponse = 12
+        JSONResponse = 12,
+        CompileSlotBusy = 13
     };
     size_t processMessage(const char *msg, size_t len);
 
@@ -61,8 +107,22 @@ private:
     std::string mSendBuffer;
     size_t mSendBufferOffset { 0 };
     std::string mRecvBuffer;
+    // cpp and compile slots come from SharedSlots
+    bool mShared { false };
+    size_t mExpectedCppSize { 0 };
     bool mHasCppSlot { false };
+    bool mCppSlotRequested { false };
     bool mHasCompileSlot { false };
+    bool mCompileSlotBusy { false };
+    // fisk-daemons that answer capabilities say so in a file next to the
+    // socket, there's no point waiting for the others
+    bool mAdvertisesCapabilities { false };
+    bool mHasCapabilities { false };
+    unsigned int mCapabilities { 0 };
+    std::string mBuilderSocket;
+    int mBuilderRequestId { 0 };
+    json11::Json mBuilderResponse;
+    json11::Json mManifestResponse;
     std::string mError;
     mutable std::mutex mMutex;
     std::condition_variable mCond;
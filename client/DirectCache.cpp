@@ -0,0 +1,397 @@
+#include "DirectCache.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "Config.h"
+#include "Hasher.h"
+#include "Log.h"
+#include <json11.hpp>
+#include <algorithm>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Outputs that depend on when they were compiled can't be reused
+static bool hasTimeMacros(const char *data, size_t size)
+{
+    static const char *const macros[] = { "__DATE__", "__TIME__", "__TIMESTAMP__" };
+    for (const char *macro : macros) {
+        if (size && memmem(data, size, macro, strlen(macro)))
+            return true;
+    }
+    return false;
+}
+
+static std::string modificationTime(const struct stat &st)
+{
+#ifdef __APPLE__
+    return Client::format("%ld.%09ld", static_cast<long>(st.st_mtimespec.tv_sec), static_cast<long>(st.st_mtimespec.tv_nsec));
+#else
+    return Client::format("%ld.%09ld", static_cast<long>(st.st_mtim.tv_sec), static_cast<long>(st.st_mtim.tv_nsec));
+#endif
+}
+
+static std::string hash(const Client::MappedFile &file)
+{
+    Hasher hasher;
+    if (file.size())
+        hasher.update(file.data(), file.size());
+    return hasher.finalize();
+}
+
+static bool writeFile(const std::string &path, const std::string &contents)
+{
+    // readers either see the old file or the whole new one
+    const std::string tmp = Client::format("%s.%d", path.c_str(), getpid());
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        DEBUG("Failed to open %s for writing (%d %s)", tmp.c_str(), errno, strerror(errno));
+        return false;
+    }
+    const bool ok = fwrite(contents.c_str(), 1, contents.size(), f) == contents.size();
+    int ret;
+    EINTRWRAP(ret, fclose(f));
+    if (!ok || ret || rename(tmp.c_str(), path.c_str())) {
+        DEBUG("Failed to write %s (%d %s)", path.c_str(), errno, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+DirectCache::DirectCache()
+{
+    const Client::Data &data = Client::data();
+    std::string dir = Config::cacheDir;
+    if (dir.empty() || !data.compilerArgs)
+        return;
+
+    Client::MappedFile source;
+    std::string error;
+    if (!source.open(data.compilerArgs->sourceFile(), &error)) {
+        DEBUG("Direct cache disabled: %s", error.c_str());
+        return;
+    }
+
+    Hasher hasher;
+    // with the terminator so "ab" "c" and "a" "bc" hash differently
+    auto add = [&hasher](const std::string &str) {
+        hasher.update(str.c_str(), str.size() + 1);
+    };
+    add(std::to_string(Version));
+    add(data.hash);
+    // part of the object cache key so it has to be part of this one for
+    // the scheduler's manifests
+    add(Config::objectCacheTag);
+    add(data.resolvedCompiler);
+    add(Client::cwd());
+    // all of them, -I and -D matter here even though the object cache key
+    // only needs the ones that survive preprocessing
+    for (size_t i=1; i<data.compilerArgs->commandLine.size(); ++i)
+        add(data.compilerArgs->commandLine[i]);
+    for (const char *name : { "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH", "SOURCE_DATE_EPOCH" }) {
+        const char *value = getenv(name);
+        add(name);
+        add(value ? value : "");
+    }
+    add(hash(source));
+    mTimeMacros = hasTimeMacros(source.data(), source.size());
+
+    mDir = dir + "direct/";
+    mKey = hasher.finalize();
+    VERBOSE("Direct cache key %s", mKey.c_str());
+}
+
+bool DirectCache::replay()
+{
+    assert(isValid());
+    std::string contents;
+    std::string error;
+    if (!Client::readFile(mDir + "manifests/" + mKey, contents, nullptr, &error)) {
+        DEBUG("Direct cache miss %s", error.c_str());
+        return false;
+    }
+    const json11::Json manifest = json11::Json::parse(contents, error);
+    if (!error.empty() || manifest["version"].int_value() != Version) {
+        DEBUG("Bad direct cache manifest %s %s", mKey.c_str(), error.c_str());
+        return false;
+    }
+
+    Client::Data &data = Client::data();
+    for (const json11::Json &entry : manifest["entries"].array_items()) {
+        if (!matches(entry["files"]))
+            continue;
+
+        const std::string resultPath = mDir + "results/" + entry["result"].string_value();
+        Client::MappedFile result;
+        if (!result.open(resultPath, &error)) {
+            DEBUG("Direct cache result is gone %s", error.c_str());
+            continue;
+        }
+        const char *newline = static_cast<const char *>(memchr(result.data(), '\n', result.size()));
+        if (!newline) {
+            DEBUG("Bad direct cache result %s", resultPath.c_str());
+            continue;
+        }
+        const json11::Json header = json11::Json::parse(std::string(result.data(), newline), error);
+        size_t offset = newline + 1 - result.data();
+        size_t total = offset;
+        for (const json11::Json &file : header["files"].array_items())
+            total += static_cast<size_t>(file["bytes"].number_value());
+        if (!error.empty() || total != result.size()) {
+            DEBUG("Bad direct cache result %s %s", resultPath.c_str(), error.c_str());
+            continue;
+        }
+
+        for (const json11::Json &file : header["files"].array_items()) {
+            const std::string &path = file["path"].string_value();
+            const size_t bytes = static_cast<size_t>(file["bytes"].number_value());
+            FILE *f = fopen(path.c_str(), "w");
+            if (!f || fwrite(result.data() + offset, 1, bytes, f) != bytes) {
+                ERROR("Failed to write %s (%d %s)", path.c_str(), errno, strerror(errno));
+                if (f)
+                    fclose(f);
+                return false;
+            }
+            int ret;
+            EINTRWRAP(ret, fclose(f));
+            offset += bytes;
+            data.totalWritten += bytes;
+        }
+
+        // printed the way they were when we compiled
+        const std::string &stdOut = header["stdout"].string_value();
+        if (!stdOut.empty()) {
+            fprintf(stdout, "stdout: ");
+            fwrite(stdOut.c_str(), 1, stdOut.size(), stdout);
+        }
+        const std::string &stdErr = header["stderr"].string_value();
+        if (!stdErr.empty()) {
+            fprintf(stderr, "stderr: ");
+            fwrite(stdErr.c_str(), 1, stdErr.size(), stderr);
+        }
+        const std::string &cppStdErr = header["cppStderr"].string_value();
+        if (!cppStdErr.empty())
+            fwrite(cppStdErr.c_str(), 1, cppStdErr.size(), stderr);
+
+        // for prune()
+        utimes(resultPath.c_str(), nullptr);
+        utimes((mDir + "manifests/" + mKey).c_str(), nullptr);
+        if (Config::syncFileSystem)
+            sync();
+        DEBUG("Direct cache hit %s", mKey.c_str());
+        return true;
+    }
+    DEBUG("Direct cache miss %s", mKey.c_str());
+    return false;
+}
+
+json11::Json DirectCache::match(const json11::Json &entries)
+{
+    assert(isValid());
+    for (const json11::Json &entry : entries.array_items()) {
+        if (matches(entry["files"]))
+            return entry;
+    }
+    return json11::Json();
+}
+
+json11::Json DirectCache::manifest(const std::string &md5) const
+{
+    assert(!mFiles.empty());
+    return json11::Json::object {
+        { "type", "storeManifest" },
+        { "key", mKey },
+        { "files", mFiles },
+        { "md5", md5 }
+    };
+}
+
+bool DirectCache::matches(const json11::Json &files)
+{
+    for (const json11::Json &file : files.array_items()) {
+        const std::string &path = file["path"].string_value();
+        struct stat st;
+        if (::stat(path.c_str(), &st) || static_cast<double>(st.st_size) != file["size"].number_value())
+            return false;
+        const std::string &mtime = file["mtime"].string_value();
+        if (!mtime.empty() && mtime == modificationTime(st))
+            continue;
+        // files are shared between entries, only hash them once
+        auto it = mHashes.find(path);
+        if (it == mHashes.end()) {
+            Client::MappedFile mapped;
+            if (!mapped.open(path))
+                return false;
+            it = mHashes.insert(std::make_pair(path, hash(mapped))).first;
+        }
+        if (it->second != file["hash"].string_value())
+            return false;
+    }
+    return true;
+}
+
+void DirectCache::store(const std::vector<std::string> &includes,
+                        const std::vector<std::string> &outputs,
+                        const std::string &cppStdErr,
+                        const std::string &stdOut,
+                        const std::string &stdErr)
+{
+    assert(isValid());
+    if (mTimeMacros) {
+        DEBUG("Not storing in direct cache, source uses time macros");
+        return;
+    }
+    mFiles.clear();
+
+    const time_t now = time(nullptr);
+    Hasher resultHasher;
+    resultHasher.update(mKey);
+    json11::Json::array files;
+    files.reserve(includes.size());
+    for (const std::string &include : includes) {
+        Client::MappedFile file;
+        struct stat st;
+        if (!file.open(include) || fstat(file.fd(), &st)) {
+            DEBUG("Not storing in direct cache, can't read %s", include.c_str());
+            mFiles.clear();
+            return;
+        }
+        if (hasTimeMacros(file.data(), file.size())) {
+            DEBUG("Not storing in direct cache, %s uses time macros", include.c_str());
+            mFiles.clear();
+            return;
+        }
+        const std::string fileHash = hash(file);
+        resultHasher.update(fileHash);
+        // the scheduler's copy can't have mtimes, they're different on every
+        // machine
+        mFiles.push_back(json11::Json::object {
+                { "path", include },
+                { "size", static_cast<double>(st.st_size) },
+                { "hash", fileHash }
+            });
+        json11::Json::object object {
+            { "path", include },
+            { "size", static_cast<double>(st.st_size) },
+            { "hash", fileHash }
+        };
+        // a file modified in the same tick as we read it can change again
+        // without its mtime changing so only trust older ones
+        if (st.st_mtime < now - 1)
+            object["mtime"] = modificationTime(st);
+        files.push_back(std::move(object));
+    }
+    const std::string result = resultHasher.finalize();
+
+    // the dependency file is written when we preprocess, not by the builder
+    std::vector<std::string> paths = outputs;
+    const std::string dependencies = Client::data().compilerArgs->dependencyFile();
+    if (!dependencies.empty() && std::find(paths.begin(), paths.end(), dependencies) == paths.end())
+        paths.push_back(dependencies);
+
+    json11::Json::array index;
+    std::string body;
+    for (const std::string &path : paths) {
+        std::string contents;
+        std::string error;
+        if (!Client::readFile(path, contents, nullptr, &error)) {
+            DEBUG("Not storing in direct cache: %s", error.c_str());
+            return;
+        }
+        index.push_back(json11::Json::object { { "path", path }, { "bytes", static_cast<double>(contents.size()) } });
+        body += contents;
+    }
+
+    if (!Client::recursiveMkdir(mDir + "results") || !Client::recursiveMkdir(mDir + "manifests")) {
+        DEBUG("Failed to create %s", mDir.c_str());
+        return;
+    }
+
+    const json11::Json header = json11::Json::object {
+        { "files", index },
+        { "stdout", stdOut },
+        { "stderr", stdErr },
+        { "cppStderr", cppStdErr }
+    };
+    if (!writeFile(mDir + "results/" + result, header.dump() + '\n' + body))
+        return;
+
+    json11::Json::array entries;
+    entries.push_back(json11::Json::object { { "files", files }, { "result", result } });
+    const std::string manifestPath = mDir + "manifests/" + mKey;
+    std::string contents;
+    if (Client::readFile(manifestPath, contents, nullptr, &contents)) {
+        std::string error;
+        const json11::Json manifest = json11::Json::parse(contents, error);
+        if (error.empty() && manifest["version"].int_value() == Version) {
+            for (const json11::Json &entry : manifest["entries"].array_items()) {
+                if (entries.size() == MaxEntries)
+                    break;
+                if (entry["result"].string_value() != result)
+                    entries.push_back(entry);
+            }
+        }
+    }
+    const json11::Json manifest = json11::Json::object {
+        { "version", static_cast<int>(Version) },
+        { "entries", entries }
+    };
+    if (!writeFile(manifestPath, manifest.dump()))
+        return;
+    DEBUG("Stored %s in direct cache (%zu files, %zu bytes)", mKey.c_str(), includes.size(), body.size());
+
+    // cheap enough to do for one in 16 stores
+    if (result[result.size() - 1] == '0')
+        prune();
+}
+
+void DirectCache::prune()
+{
+    struct Entry {
+        time_t time;
+        size_t size;
+        std::string path;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    for (const char *sub : { "results/", "manifests/" }) {
+        const std::string dir = mDir + sub;
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+            continue;
+        while (dirent *e = readdir(d)) {
+            if (e->d_name[0] == '.')
+                continue;
+            Entry entry;
+            entry.path = dir + e->d_name;
+            struct stat st;
+            if (::stat(entry.path.c_str(), &st))
+                continue;
+            entry.time = st.st_mtime;
+            entry.size = st.st_size;
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+        closedir(d);
+    }
+
+    const size_t limit = Config::directCacheSize * 1024 * 1024;
+    if (total <= limit)
+        return;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.time < b.time;
+    });
+    for (const Entry &entry : entries) {
+        if (total <= limit / 10 * 9)
+            break;
+        if (!unlink(entry.path.c_str()))
+            total -= entry.size;
+    }
+    DEBUG("Pruned direct cache to %zu bytes", total);
+}
@@ -0,0 +1,60 @@
+#ifndef DIRECTCACHE_H
+#define DIRECTCACHE_H
+
+#include <json11.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+// ccache style direct mode. The manifest for a source file, command line and
+// compiler lists the files the preprocessor read the last times we compiled
+// it. If none of them changed the outputs of that compile are written again
+// without preprocessing or talking to anyone.
+//
+// Lives under Config::cacheDir:
+//   direct/manifests/<key>  json, up to MaxEntries sets of files and their hashes
+//   direct/results/<key>    json header line followed by the output files
+//
+// The same manifests, without mtimes, are shared through the scheduler so a
+// source compiled on one machine can be fetched from the object cache on
+// another without preprocessing it there.
+class DirectCache
+{
+public:
+    // Hashes the source file and command line from Client::data()
+    DirectCache();
+
+    bool isValid() const { return !mKey.empty(); }
+    const std::string &key() const { return mKey; }
+
+    // Writes the outputs and prints what the compile printed on a hit
+    bool replay();
+
+    void store(const std::vector<std::string> &includes,
+               const std::vector<std::string> &outputs,
+               const std::string &cppStdErr,
+               const std::string &stdOut,
+               const std::string &stdErr);
+
+    // The first of the scheduler's manifest entries whose files are the
+    // same here, null if there isn't one
+    json11::Json match(const json11::Json &entries);
+    // For the scheduler, with the files from the last successful store()
+    json11::Json manifest(const std::string &md5) const;
+    bool hasManifest() const { return !mFiles.empty(); }
+private:
+    enum {
+        MaxEntries = 8,
+        Version = 1
+    };
+    void prune();
+    bool matches(const json11::Json &files);
+
+    std::string mDir;
+    std::string mKey;
+    bool mTimeMacros { false };
+    std::map<std::string, std::string> mHashes;
+    json11::Json::array mFiles;
+};
+
+#endif /* DIRECTCACHE_H */
@@ -0,0 +1,79 @@
+#include "Hasher.h"
+#include "Client.h"
+#include <strings.h>
+
+Hasher::Hasher()
+{
+    init(XXH3);
+}
+
+Hasher::~Hasher()
+{
+    if (mXXH3)
+        XXH3_freeState(mXXH3);
+}
+
+bool Hasher::algorithmFromString(const std::string &name, Algorithm *algorithm)
+{
+    if (!strcasecmp(name.c_str(), "xxh3")) {
+        *algorithm = XXH3;
+    } else if (!strcasecmp(name.c_str(), "md5")) {
+        *algorithm = MD5;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *Hasher::algorithmToString(Algorithm algorithm)
+{
+    switch (algorithm) {
+    case MD5: return "md5";
+    case XXH3: return "xxh3";
+    }
+    return "";
+}
+
+void Hasher::init(Algorithm algorithm)
+{
+    mAlgorithm = algorithm;
+    switch (algorithm) {
+    case MD5:
+        MD5_Init(&mMd5);
+        break;
+    case XXH3:
+        if (!mXXH3)
+            mXXH3 = XXH3_createState();
+        XXH3_128bits_reset(mXXH3);
+        break;
+    }
+}
+
+void Hasher::update(const void *data, size_t len)
+{
+    switch (mAlgorithm) {
+    case MD5:
+        MD5_Update(&mMd5, data, len);
+        break;
+    case XXH3:
+        XXH3_128bits_update(mXXH3, data, len);
+        break;
+    }
+}
+
+std::string Hasher::finalize()
+{
+    switch (mAlgorithm) {
+    case MD5: {
+        unsigned char buf[MD5_DIGEST_LENGTH];
+        MD5_Final(buf, &mMd5);
+        return Client::toHex(buf, sizeof(buf));
+    }
+    case XXH3: {
+        XXH128_canonical_t canonical;
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(mXXH3));
+        return "xxh3-" + Client::toHex(canonical.digest, sizeof(canonical.digest));
+    }
+    }
+    return std::string();
+}
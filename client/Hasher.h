@@ -0,0 +1,41 @@
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <openssl/md5.h>
+#include <string>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+// Incremental hash for object cache keys. Keys are namespaced by algorithm
+// so keys from different algorithms can never collide, md5 keeps the legacy
+// unprefixed format so existing caches stay valid.
+class Hasher
+{
+public:
+    enum Algorithm {
+        MD5,
+        XXH3
+    };
+
+    Hasher();
+    ~Hasher();
+
+    static bool algorithmFromString(const std::string &name, Algorithm *algorithm);
+    static const char *algorithmToString(Algorithm algorithm);
+
+    void init(Algorithm algorithm);
+    Algorithm algorithm() const { return mAlgorithm; }
+
+    void update(const void *data, size_t len);
+    void update(const std::string &str) { update(str.c_str(), str.size()); }
+    std::string finalize();
+private:
+    Hasher(const Hasher &) = delete;
+    Hasher &operator=(const Hasher &) = delete;
+
+    Algorithm mAlgorithm { XXH3 };
+    MD5_CTX mMd5;
+    XXH3_state_t *mXXH3 { nullptr };
+};
+
+#endif /* HASHER_H */
@@ -0,0 +1,207 @@
+#include "Hedge.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "Compression.h"
+#include "Config.h"
+#include "Log.h"
+#include "Preprocessed.h"
+
+Hedge::Hedge(Select &select)
+    : mSelect(select)
+{
+}
+
+Hedge::~Hedge()
+{
+    if (mScheduler && mSelect.contains(mScheduler.get()))
+        mSelect.remove(mScheduler.get());
+    if (mBuilder && mSelect.contains(mBuilder.get()))
+        mSelect.remove(mBuilder.get());
+}
+
+bool Hedge::start(const std::string &url, std::map<std::string, std::string> headers)
+{
+    const Client::Data &data = Client::data();
+    std::string &excluded = headers["x-fisk-exclude-builders"];
+    if (!excluded.empty())
+        excluded += ' ';
+    excluded += Client::format("%s:%d", data.builderIp.c_str(), data.builderPort);
+    // we don't do any of these
+    for (const char *header : { "x-fisk-job-id", "x-fisk-builder-ip", "x-fisk-chunks", "x-fisk-pump", "x-fisk-raw-stream",
+                                "x-fisk-dictionary" }) {
+        headers.erase(header);
+    }
+    mHeaders = std::move(headers);
+    mBuilderIp = data.builderIp;
+    mBuilderHostname = data.builderHostname;
+    mBuilderPort = data.builderPort;
+
+    mScheduler.reset(new SchedulerWebSocket);
+    mScheduler->watchdog = false;
+    mSelect.add(mScheduler.get());
+    if (!mScheduler->connect(url + "/compile", mHeaders)) {
+        fail("scheduler connect error");
+        return false;
+    }
+    mState = AcquiringBuilder;
+    DEBUG("Hedging %s, asking for another builder", data.compilerArgs->sourceFile().c_str());
+    return true;
+}
+
+bool Hedge::process()
+{
+    switch (mState) {
+    case Failed:
+        break;
+    case AcquiringBuilder:
+        if (!mScheduler->done) {
+            if (mScheduler->state() < SchedulerWebSocket::None || !mScheduler->error.empty())
+                fail("scheduler error");
+            break;
+        }
+        if (!connectToBuilder())
+            fail("no builder");
+        break;
+    case ConnectingToBuilder:
+        if (mBuilder->state() == SchedulerWebSocket::ConnectedWebSocket) {
+            if (!sendJob())
+                fail("upload error");
+        } else if (mBuilder->state() <= WebSocket::None) {
+            fail("builder connect error");
+        }
+        break;
+    case Waiting:
+    case Uploading:
+    case Uploaded:
+        if (mBuilder->done) {
+            if (!mBuilder->error.empty())
+                fail(mBuilder->error.c_str());
+        } else if (mBuilder->state() != SchedulerWebSocket::ConnectedWebSocket) {
+            fail("builder network error");
+        } else if (mState == Waiting && !mBuilder->wait) {
+            mState = Uploading;
+        }
+        if (mState == Uploading && !mBuilder->hasPendingSendData() && !upload())
+            fail("upload error");
+        break;
+    }
+    return mState != Failed;
+}
+
+bool Hedge::connectToBuilder()
+{
+    // the assignment went into Client::data(), that stays the first
+    // builder's until the hedge answers
+    Client::Data &data = Client::data();
+    std::swap(mBuilderIp, data.builderIp);
+    std::swap(mBuilderHostname, data.builderHostname);
+    std::swap(mBuilderPort, data.builderPort);
+    if (mScheduler->needsEnvironment || (mBuilderHostname.empty() && mBuilderIp.empty()) || !mBuilderPort)
+        return false;
+
+    mHeaders["x-fisk-job-id"] = std::to_string(mScheduler->jobId);
+    mHeaders["x-fisk-builder-ip"] = mBuilderIp;
+    if (!mScheduler->environment.empty())
+        mHeaders["x-fisk-environments"] = mScheduler->environment;
+    const std::string url = Client::format("ws://%s:%d/compile",
+                                           mBuilderHostname.empty() ? mBuilderIp.c_str() : mBuilderHostname.c_str(),
+                                           mBuilderPort);
+    mBuilder.reset(new BuilderWebSocket);
+    mBuilder->responseCallback = [this]() {
+        Client::Data &d = Client::data();
+        d.builderIp = mBuilderIp;
+        d.builderHostname = mBuilderHostname;
+        d.builderPort = mBuilderPort;
+        if (responseCallback)
+            responseCallback();
+    };
+    mSelect.add(mBuilder.get());
+    if (!mBuilder->connect(std::string(url), mHeaders))
+        return false;
+    DEBUG("Hedging with %s", url.c_str());
+    mState = ConnectingToBuilder;
+    return true;
+}
+
+bool Hedge::sendJob()
+{
+    const Client::Data &data = Client::data();
+    // a builder that doesn't stream needs to know how many bytes are coming
+    // up front, we'd have to compress all of it first
+    mStream = Config::streamPreprocessed && mBuilder->handshakeResponseHeader("x-fisk-stream") == "true";
+    if (mStream)
+        mCompressor = Compressor::create(mBuilder->handshakeResponseHeader("x-fisk-compression"), Config::compressionLevel);
+
+    std::vector<std::string> args = data.compilerArgs->commandLine;
+    args[0] = data.builderCompiler;
+    args.insert(args.end(), mScheduler->extraArguments.begin(), mScheduler->extraArguments.end());
+    const bool wait = mBuilder->handshakeResponseHeader("x-fisk-wait") == "true";
+    json11::Json::object msg {
+        { "commandLine", args },
+        { "argv0", data.compiler },
+        { "wait", wait }
+    };
+    if (mStream) {
+        msg["stream"] = true;
+    } else {
+        msg["bytes"] = static_cast<int>(data.preprocessed->available());
+    }
+    if (mCompressor)
+        msg["encoding"] = mCompressor->encoding();
+    const std::string json = json11::Json(msg).dump();
+    mBuilder->wait = wait;
+    mBuilder->send(WebSocket::Text, json.c_str(), json.size());
+    // until the builder resumes us if it's busy
+    mState = wait ? Waiting : Uploading;
+    return true;
+}
+
+bool Hedge::upload()
+{
+    // a chunk at a time from the preprocessed output's file as the socket
+    // drains, like the first builder's upload
+    const Preprocessed &preprocessed = *Client::data().preprocessed;
+    if (mSent == preprocessed.available()) {
+        if (mStream) {
+            const std::string finished = json11::Json(json11::Json::object {
+                    { "type", "uploadFinished" },
+                    { "bytes", static_cast<int>(mUploaded) }
+                }).dump();
+            mBuilder->send(WebSocket::Text, finished.c_str(), finished.size());
+        }
+        mState = Uploaded;
+        return true;
+    }
+    std::string chunk, compressed;
+    if (!preprocessed.read(mSent, Preprocessed::StreamChunkSize, chunk))
+        return false;
+    mSent += chunk.size();
+    if (mCompressor) {
+        if (!mCompressor->compress(chunk.c_str(), chunk.size(), compressed))
+            return false;
+        mUploaded += compressed.size();
+        return mBuilder->send(WebSocket::Binary, std::move(compressed));
+    }
+    mUploaded += chunk.size();
+    return mBuilder->send(WebSocket::Binary, std::move(chunk));
+}
+
+void Hedge::cancel()
+{
+    if (mState == Failed)
+        return;
+    DEBUG("First builder answered, cancelling the hedge");
+    if (mBuilder) {
+        mBuilder->cancelled = true;
+        mBuilder->close("hedged");
+    }
+    mState = Failed;
+}
+
+void Hedge::fail(const char *reason)
+{
+    DEBUG("Hedge failed: %s", reason);
+    if (mBuilder && !mBuilder->done)
+        mBuilder->cancelled = true;
+    mState = Failed;
+}
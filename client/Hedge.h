@@ -0,0 +1,62 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include "BuilderWebSocket.h"
+#include "Compression.h"
+#include "SchedulerWebSocket.h"
+#include "Select.h"
+#include <map>
+#include <memory>
+#include <string>
+
+// The same job on a second builder for when the first one is taking much
+// longer than jobs of this size usually do, see hedge-percentile. It goes
+// through the scheduler itself and uploads the preprocessed output from its
+// file as the connection drains, streamed and compressed if the builder
+// supports that. Whichever builder answers first is
+// used, the other one's connection is closed which makes it cancel the job.
+class Hedge
+{
+public:
+    Hedge(Select &select);
+    ~Hedge();
+
+    // headers are what we sent the scheduler for the first builder, which
+    // gets excluded
+    bool start(const std::string &url, std::map<std::string, std::string> headers);
+    // Moves things along, false once the hedge has failed or been cancelled
+    bool process();
+    bool responded() const { return mBuilder && mBuilder->responded; }
+    BuilderWebSocket &builder() { return *mBuilder; }
+    // The first builder answered
+    void cancel();
+    // Called before the hedge's builder prints anything
+    std::function<void()> responseCallback;
+private:
+    void fail(const char *reason);
+    bool connectToBuilder();
+    bool sendJob();
+    bool upload();
+
+    enum State {
+        Failed,
+        AcquiringBuilder,
+        ConnectingToBuilder,
+        Waiting,
+        Uploading,
+        Uploaded
+    } mState { Failed };
+    Select &mSelect;
+    std::map<std::string, std::string> mHeaders;
+    std::unique_ptr<SchedulerWebSocket> mScheduler;
+    std::unique_ptr<BuilderWebSocket> mBuilder;
+    bool mStream { false };
+    std::unique_ptr<Compressor> mCompressor;
+    // of the preprocessed output and what went out for it
+    size_t mSent { 0 }, mUploaded { 0 };
+    // the first builder's until we have our own
+    std::string mBuilderIp, mBuilderHostname;
+    uint16_t mBuilderPort { 0 };
+};
+
+#endif /* HEDGE_H */
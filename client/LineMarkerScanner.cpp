@@ -0,0 +1,117 @@
+#include "LineMarkerScanner.h"
+#include <algorithm>
+#include <cctype>
+#include <string.h>
+
+LineMarkerScanner::LineMarkerScanner(std::function<void(const char *, size_t)> &&content,
+                                     std::function<void(const std::string &)> &&marker)
+    : mContent(std::move(content)), mMarker(std::move(marker))
+{
+}
+
+std::string LineMarkerScanner::fileName(const std::string &marker)
+{
+    // # 12 "foo.h" 1 3 with \\, \" and \ooo escaped
+    const size_t quote = marker.find('"');
+    if (quote == std::string::npos || quote + 1 >= marker.size() || marker[quote + 1] == '<')
+        return std::string();
+    std::string ret;
+    for (size_t i=quote + 1; i<marker.size(); ++i) {
+        char ch = marker[i];
+        if (ch == '"')
+            return ret;
+        if (ch == '\\' && i + 1 < marker.size()) {
+            ch = marker[++i];
+            if (ch >= '0' && ch <= '7') {
+                int value = 0;
+                for (int digits = 0; digits < 3 && i < marker.size() && marker[i] >= '0' && marker[i] <= '7'; ++digits)
+                    value = (value * 8) + (marker[i++] - '0');
+                --i;
+                ch = static_cast<char>(value);
+            }
+        }
+        ret += ch;
+    }
+    return std::string(); // unterminated
+}
+
+void LineMarkerScanner::feed(const char *data, size_t len)
+{
+    // a '#' too close to the end of the previous chunk to tell if it was a
+    // marker. Complete it and scan it on its own, this might leave a new
+    // (shorter) pending tail
+    while (!mPending.empty()) {
+        const size_t needed = std::min<size_t>(3 - mPending.size(), len);
+        mPending.append(data, needed);
+        data += needed;
+        len -= needed;
+        if (mPending.size() < 3)
+            return;
+        std::string pending;
+        std::swap(pending, mPending);
+        scan(pending.c_str(), pending.size());
+    }
+    scan(data, len);
+}
+
+void LineMarkerScanner::finish()
+{
+    if (!mPending.empty()) {
+        mContent(mPending.c_str(), mPending.size());
+        mPending.clear();
+    }
+    if (mInMarker && mMarker) {
+        mMarker(mMarkerText);
+        mMarkerText.clear();
+    }
+    mInMarker = false;
+}
+
+// Outside a marker only '#' matters and inside one only '\n', so this
+// memchr()s for one at a time rather than vectorizing a search for both,
+// glibc's memchr is SSE2/AVX2 already. See bench/LineMarkerScannerBench.cpp.
+void LineMarkerScanner::scan(const char *data, size_t len)
+{
+    const char *ch = data;
+    const char *const end = data + len;
+    const char *start = data;
+    while (ch < end) {
+        if (mInMarker) {
+            const char *nl = static_cast<const char *>(memchr(ch, '\n', end - ch));
+            if (mMarker)
+                mMarkerText.append(ch, (nl ? nl : end) - ch);
+            if (!nl)
+                return;
+            // the newline itself is hashed
+            mInMarker = false;
+            if (mMarker) {
+                mMarker(mMarkerText);
+                mMarkerText.clear();
+            }
+            start = ch = nl;
+            continue;
+        }
+
+        const char *hash = static_cast<const char *>(memchr(ch, '#', end - ch));
+        if (!hash)
+            break;
+        if (end - hash < 3) {
+            if (hash > start)
+                mContent(start, hash - start);
+            mPending.assign(hash, end - hash);
+            return;
+        }
+        if (hash[1] == ' ' && std::isdigit(static_cast<unsigned char>(hash[2]))) {
+            if (hash > start)
+                mContent(start, hash - start);
+            mInMarker = true;
+            if (mMarker)
+                mMarkerText.assign(hash, 3);
+            ch = hash + 3;
+        } else {
+            ch = hash + 1;
+        }
+    }
+    if (!mInMarker && end > start)
+        mContent(start, end - start);
+}
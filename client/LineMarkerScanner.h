@@ -0,0 +1,31 @@
+#ifndef LINEMARKERSCANNER_H
+#define LINEMARKERSCANNER_H
+
+#include <functional>
+#include <string>
+
+// Passes everything except "# <digit>" line markers on to a callback. The
+// input can be split at arbitrary points so it can run on the preprocessor's
+// output as it arrives. The markers themselves, without the newline, go to
+// the optional marker callback.
+class LineMarkerScanner
+{
+public:
+    LineMarkerScanner(std::function<void(const char *, size_t)> &&content,
+                      std::function<void(const std::string &)> &&marker = nullptr);
+    void feed(const char *data, size_t len);
+    void finish();
+
+    // The file name in a marker, empty for things like <built-in>
+    static std::string fileName(const std::string &marker);
+private:
+    void scan(const char *data, size_t len);
+
+    std::function<void(const char *, size_t)> mContent;
+    std::function<void(const std::string &)> mMarker;
+    std::string mPending;
+    std::string mMarkerText;
+    bool mInMarker { false };
+};
+
+#endif /* LINEMARKERSCANNER_H */
@@ -0,0 +1,236 @@
+#include "LocalCompile.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "DaemonSocket.h"
+#include "Log.h"
+#include "SharedSlots.h"
+#include "Watchdog.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+static int createTempFile()
+{
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = Client::format("%s/fisk-local-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    const int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        ERROR("Failed to create %s %d %s", path.c_str(), errno, strerror(errno));
+        return -1;
+    }
+    unlink(path.c_str());
+    Client::setFlag(fd, O_CLOEXEC);
+    return fd;
+}
+
+static void closeFD(int &fd)
+{
+    if (fd != -1) {
+        int ret;
+        EINTRWRAP(ret, ::close(fd));
+        fd = -1;
+    }
+}
+
+static void print(int fd, FILE *f)
+{
+    char buf[16384];
+    for (off_t offset = 0; ; ) {
+        ssize_t r;
+        EINTRWRAP(r, ::pread(fd, buf, sizeof(buf), offset));
+        if (r <= 0)
+            break;
+        fwrite(buf, 1, r, f);
+        offset += r;
+    }
+    fflush(f);
+}
+
+LocalCompile::LocalCompile(DaemonSocket &daemonSocket)
+    : mDaemonSocket(daemonSocket)
+{
+}
+
+LocalCompile::~LocalCompile()
+{
+    if (mPid != -1) {
+        kill(-mPid, SIGTERM);
+        int ret, status;
+        EINTRWRAP(ret, waitpid(mPid, &status, 0));
+        removeOutputs();
+    }
+    closeFD(mPipe);
+    closeFD(mStdOut);
+    closeFD(mStdErr);
+}
+
+bool LocalCompile::canRace()
+{
+    // these write files next to the object or named after it
+    static const char *const flags[] = {
+        "--coverage", "-ftest-coverage", "-fprofile-arcs", "-gsplit-dwarf", "-save-temps",
+        "-fdump-", "-ftime-trace", "-fstack-usage", "-fcallgraph-info", "-aux-info"
+    };
+    const std::vector<std::string> &commandLine = Client::data().compilerArgs->commandLine;
+    for (size_t i=1; i<commandLine.size(); ++i) {
+        for (const char *flag : flags) {
+            if (!commandLine[i].compare(0, strlen(flag), flag))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool LocalCompile::start()
+{
+    const Client::Data &data = Client::data();
+    const std::shared_ptr<CompilerArgs> &args = data.compilerArgs;
+    const std::string suffix = Client::format(".fisk-local.%d", getpid());
+    std::vector<std::string> arguments;
+    arguments.push_back(data.compiler);
+    bool hasTarget = args->flags & CompilerArgs::HasDashMT;
+    for (size_t i=1; i<args->commandLine.size(); ++i) {
+        const std::string &arg = args->commandLine[i];
+        arguments.push_back(arg);
+        if ((arg == "-o" || arg == "-MF") && i + 1 < args->commandLine.size()) {
+            const std::string &path = args->commandLine[++i];
+            mOutputs.emplace_back(path, path + suffix);
+            arguments.push_back(path + suffix);
+        } else if (arg == "-MQ") {
+            hasTarget = true;
+        }
+    }
+    // the target would be the temporary file otherwise
+    if (args->flags & (CompilerArgs::HasDashMD|CompilerArgs::HasDashMMD) && !hasTarget) {
+        arguments.push_back("-MQ");
+        arguments.push_back(args->output());
+    }
+
+    mStdOut = createTempFile();
+    mStdErr = createTempFile();
+    int fds[2];
+    if (mStdOut == -1 || mStdErr == -1 || ::pipe(fds)) {
+        ERROR("Failed to set up local compile %d %s", errno, strerror(errno));
+        closeFD(mStdOut);
+        closeFD(mStdErr);
+        return false;
+    }
+    mPipe = fds[0];
+    Client::setFlag(mPipe, O_NONBLOCK|O_CLOEXEC);
+    // only the compiler gets the write end
+    Client::setFlag(fds[1], O_CLOEXEC);
+
+    std::vector<char *> argv;
+    for (std::string &arg : arguments)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    mPid = fork();
+    if (mPid == 0) {
+        // its own group so cancel() gets cc1 and as too
+        setpgid(0, 0);
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        dup2(mStdOut, STDOUT_FILENO);
+        dup2(mStdErr, STDERR_FILENO);
+        fcntl(fds[1], F_SETFD, 0);
+        ::execv(data.compiler.c_str(), argv.data());
+        _exit(127);
+    }
+    closeFD(fds[1]);
+    if (mPid == -1) {
+        ERROR("Failed to fork: %d %s", errno, strerror(errno));
+        closeFD(mPipe);
+        return false;
+    }
+    setpgid(mPid, mPid);
+    DEBUG("Racing local compile %d: %s", mPid, Client::data().commandLineAsString().c_str());
+    return true;
+}
+
+void LocalCompile::onRead()
+{
+    char buf[64];
+    while (true) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(mPipe, buf, sizeof(buf)));
+        if (r > 0)
+            continue;
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        break;
+    }
+    closeFD(mPipe);
+    int ret, status;
+    EINTRWRAP(ret, waitpid(mPid, &status, 0));
+    mPid = -1;
+    if (ret == -1 || !WIFEXITED(status)) {
+        // killed by someone, let the builder have it
+        DEBUG("Local compile didn't exit normally");
+        removeOutputs();
+        mDaemonSocket.send(DaemonSocket::ReleaseCompileSlot);
+        return;
+    }
+    finish(WEXITSTATUS(status));
+}
+
+void LocalCompile::finish(int exitCode)
+{
+    Client::Data &data = Client::data();
+    DEBUG("Local compile won with exit code %d", exitCode);
+    data.watchdog->stop();
+    data.race = "local";
+    for (const auto &output : mOutputs) {
+        if (exitCode) {
+            // like the compiler would, outputs of a failed compile go
+            unlink(output.second.c_str());
+            unlink(output.first.c_str());
+        } else if (rename(output.second.c_str(), output.first.c_str()) && errno != ENOENT) {
+            ERROR("Failed to rename %s to %s %d %s", output.second.c_str(), output.first.c_str(), errno, strerror(errno));
+            exitCode = 1;
+        }
+    }
+    print(mStdOut, stdout);
+    print(mStdErr, stderr);
+    data.exitCode = exitCode;
+    Client::writeStatistics();
+    // _exit() doesn't get to ~DaemonSocket()
+    SharedSlots::releaseAll();
+    _exit(exitCode);
+}
+
+void LocalCompile::cancel()
+{
+    if (mPid == -1)
+        return;
+    DEBUG("Builder won, killing local compile %d", mPid);
+    kill(-mPid, SIGTERM);
+    int ret, status;
+    EINTRWRAP(ret, waitpid(mPid, &status, 0));
+    mPid = -1;
+    closeFD(mPipe);
+    changed();
+    removeOutputs();
+    mDaemonSocket.send(DaemonSocket::ReleaseCompileSlot);
+    Client::data().race = "remote";
+}
+
+void LocalCompile::wait(Select &select)
+{
+    DEBUG("Waiting for local compile %d", mPid);
+    while (mPid != -1)
+        select.exec();
+}
+
+void LocalCompile::removeOutputs()
+{
+    for (const auto &output : mOutputs)
+        unlink(output.second.c_str());
+}
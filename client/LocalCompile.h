@@ -0,0 +1,50 @@
+#ifndef LOCALCOMPILE_H
+#define LOCALCOMPILE_H
+
+#include "Select.h"
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+class DaemonSocket;
+
+// Compiles locally in the background while the job goes remote, for when the
+// daemon had a compile slot to spare. Outputs go to temporary files and are
+// renamed into place if we win, the remote side can't get clobbered by a
+// local compile it beat. If we finish first the output is printed and fiskc
+// exits from whatever Select::exec() it was in.
+class LocalCompile : public Socket
+{
+public:
+    LocalCompile(DaemonSocket &daemonSocket);
+    ~LocalCompile();
+
+    // Everything the compiler writes has to be renamable
+    static bool canRace();
+    bool start();
+    // The builder answered first
+    void cancel();
+    // The remote side failed, use ours. Only returns if the compiler was
+    // killed
+    void wait(Select &select);
+    bool running() const { return mPid != -1; }
+protected:
+    virtual int fd() const override { return mPipe; }
+    virtual unsigned int mode() const override { return mPipe == -1 ? None : Read; }
+    virtual void onWrite() override {}
+    virtual void onRead() override;
+    virtual void onTimeout() override {}
+    virtual int timeout() override { return -1; }
+private:
+    [[noreturn]] void finish(int exitCode);
+    void removeOutputs();
+
+    DaemonSocket &mDaemonSocket;
+    pid_t mPid { -1 };
+    int mPipe { -1 }; // only the compiler has the write end, EOF means it's done
+    int mStdOut { -1 }, mStdErr { -1 };
+    // final path, temporary path
+    std::vector<std::pair<std::string, std::string> > mOutputs;
+};
+
+#endif /* LOCALCOMPILE_H */
@@ -0,0 +1,343 @@
+#include "Minimizer.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "Log.h"
+#include <process.hpp>
+#include <cctype>
+#include <string.h>
+#include <unistd.h>
+
+static inline bool isSpace(char ch)
+{
+    return ch == ' ' || ch == '\t';
+}
+
+static inline bool isIdentifier(char ch)
+{
+    return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+}
+
+// The identifier or number that ends right before pos
+static std::string tokenBefore(const char *line, size_t pos)
+{
+    size_t start = pos;
+    while (start && isIdentifier(line[start - 1]))
+        --start;
+    return std::string(line + start, pos - start);
+}
+
+static bool isRawStringPrefix(const std::string &token)
+{
+    return token == "R" || token == "LR" || token == "uR" || token == "UR" || token == "u8R";
+}
+
+// 1'000'000, as opposed to u8'x'. Anything we're not sure about is a literal,
+// whitespace in those is left alone
+static bool isDigitSeparator(const char *line, size_t pos)
+{
+    const std::string token = tokenBefore(line, pos);
+    if (token.empty() || token == "L" || token == "u" || token == "U" || token == "u8")
+        return false;
+    return std::isdigit(static_cast<unsigned char>(token[0]));
+}
+
+Minimizer::Minimizer(Mode mode, std::function<void(const char *, size_t)> &&output)
+    : mMode(mode), mOutput(std::move(output))
+{
+}
+
+void Minimizer::feed(const char *data, size_t len)
+{
+    mInputBytes += len;
+    const char *const end = data + len;
+    while (data < end) {
+        const char *nl = static_cast<const char *>(memchr(data, '\n', end - data));
+        if (!nl) {
+            mPartial.append(data, end - data);
+            break;
+        }
+        if (mPartial.empty()) {
+            processLine(data, nl - data);
+        } else {
+            mPartial.append(data, nl - data);
+            processLine(mPartial.c_str(), mPartial.size());
+            mPartial.clear();
+        }
+        data = nl + 1;
+    }
+    if (!mBuffer.empty()) {
+        mOutput(mBuffer.c_str(), mBuffer.size());
+        mBuffer.clear();
+    }
+}
+
+void Minimizer::finish()
+{
+    if (!mPartial.empty()) {
+        processLine(mPartial.c_str(), mPartial.size());
+        mPartial.clear();
+    }
+    if (!mBuffer.empty()) {
+        mOutput(mBuffer.c_str(), mBuffer.size());
+        mBuffer.clear();
+    }
+}
+
+void Minimizer::emit(const char *data, size_t len)
+{
+    mBuffer.append(data, len);
+    mOutputBytes += len;
+}
+
+void Minimizer::processLine(const char *line, size_t len)
+{
+    // only whole lines outside of comments, literals and directives can go
+    const bool clean = !mContinued && !mBlockComment && !mLineComment && !mQuote && mRawTerminator.empty();
+    if (clean && len > 2 && line[0] == '#' && processMarker(line, len))
+        return;
+
+    if (clean && mKnown) {
+        size_t i = 0;
+        while (i < len && isSpace(line[i]))
+            ++i;
+        if (i == len) {
+            ++mPosition.line;
+            return;
+        }
+    }
+
+    const bool collapse = mMode == CollapseWhitespace;
+    mLine.clear();
+    size_t i = 0;
+    while (i < len) {
+        if (!mRawTerminator.empty()) {
+            // no escapes and no splices in raw strings
+            const char *found = static_cast<const char *>(memmem(line + i, len - i, mRawTerminator.c_str(), mRawTerminator.size()));
+            const size_t stop = found ? (found - line) + mRawTerminator.size() : len;
+            mLine.append(line + i, stop - i);
+            i = stop;
+            if (found)
+                mRawTerminator.clear();
+            continue;
+        }
+        if (mBlockComment) {
+            const char *found = static_cast<const char *>(memmem(line + i, len - i, "*/", 2));
+            const size_t stop = found ? (found - line) + 2 : len;
+            mLine.append(line + i, stop - i);
+            i = stop;
+            if (found)
+                mBlockComment = false;
+            continue;
+        }
+        if (mLineComment) {
+            mLine.append(line + i, len - i);
+            break;
+        }
+        if (mQuote) {
+            size_t stop = i;
+            while (stop < len && line[stop] != mQuote)
+                stop += line[stop] == '\\' ? 2 : 1;
+            if (stop >= len) {
+                mLine.append(line + i, len - i);
+                break;
+            }
+            mLine.append(line + i, stop + 1 - i);
+            i = stop + 1;
+            mQuote = 0;
+            continue;
+        }
+
+        const char ch = line[i];
+        if (isSpace(ch)) {
+            size_t stop = i;
+            while (stop < len && isSpace(line[stop]))
+                ++stop;
+            if (!collapse) {
+                mLine.append(line + i, stop - i);
+            } else if (stop < len && (i || mContinued)) {
+                // indentation is only whitespace if it follows a splice
+                mLine += ' ';
+            }
+            i = stop;
+            continue;
+        }
+        if (ch == '"') {
+            if (i && isRawStringPrefix(tokenBefore(line, i))) {
+                size_t open = i + 1;
+                while (open < len && open - i <= 17 && line[open] != '(' && line[open] != ')'
+                       && line[open] != '\\' && !isSpace(line[open])) {
+                    ++open;
+                }
+                if (open < len && line[open] == '(') {
+                    mRawTerminator = ')' + std::string(line + i + 1, open - i - 1) + '"';
+                    mLine.append(line + i, open + 1 - i);
+                    i = open + 1;
+                    continue;
+                }
+            }
+            mQuote = ch;
+        } else if (ch == '\'' && !isDigitSeparator(line, i)) {
+            mQuote = ch;
+        } else if (ch == '/' && i + 1 < len && line[i + 1] == '/') {
+            mLineComment = true;
+            continue;
+        } else if (ch == '/' && i + 1 < len && line[i + 1] == '*') {
+            mBlockComment = true;
+            mLine.append("/*", 2);
+            i += 2;
+            continue;
+        }
+        mLine += ch;
+        ++i;
+    }
+
+    size_t last = len;
+    while (last && isSpace(line[last - 1]))
+        --last;
+    mContinued = last && line[last - 1] == '\\' && mRawTerminator.empty();
+    if (!mContinued) {
+        mLineComment = false;
+        mQuote = 0;
+    }
+
+    if (mKnown)
+        sync();
+    mLine += '\n';
+    emit(mLine.c_str(), mLine.size());
+    ++mPosition.line;
+    ++mOutputPosition.line;
+}
+
+// # 12 "file.h" 1 3 4
+bool Minimizer::processMarker(const char *line, size_t len)
+{
+    if (len > 5 && !strncmp(line, "#line", 5) && isSpace(line[5])) {
+        // could be anything, we don't know where we are until the next marker
+        mKnown = false;
+        return false;
+    }
+    if (line[1] != ' ' || !std::isdigit(static_cast<unsigned char>(line[2])))
+        return false;
+
+    Position position;
+    size_t i = 2;
+    while (i < len && std::isdigit(static_cast<unsigned char>(line[i])))
+        position.line = (position.line * 10) + (line[i++] - '0');
+    if (i + 1 < len && line[i] == ' ' && line[i + 1] == '"') {
+        const size_t start = ++i;
+        ++i;
+        while (i < len && line[i] != '"')
+            i += line[i] == '\\' ? 2 : 1;
+        if (i >= len) {
+            mKnown = false;
+            return false;
+        }
+        position.file.assign(line + start, ++i - start);
+    } else {
+        position.file = mPosition.file;
+    }
+    bool enter = false, leave = false;
+    while (i + 1 < len && line[i] == ' ' && (i + 2 == len || line[i + 2] == ' ')) {
+        switch (line[i + 1]) {
+        case '1': enter = true; break;
+        case '2': leave = true; break;
+        case '3': position.flags += " 3"; break;
+        case '4': position.flags += " 4"; break;
+        default:
+            mKnown = false;
+            return false;
+        }
+        i += 2;
+    }
+    if (i != len) {
+        mKnown = false;
+        return false;
+    }
+
+    if (enter || leave || !mKnown) {
+        // these push and pop the include stack, the includer's line for an
+        // include is the line the marker is on
+        if (enter && mKnown)
+            sync();
+        emit(line, len);
+        emit("\n", 1);
+        mPosition = mOutputPosition = position;
+        mKnown = !position.file.empty();
+        return true;
+    }
+    // sync() puts one back if it's needed
+    mPosition = position;
+    return true;
+}
+
+void Minimizer::sync()
+{
+    Position &output = mOutputPosition;
+    if (output.line == mPosition.line && output.file == mPosition.file && output.flags == mPosition.flags)
+        return;
+    const std::string marker = Client::format("# %zu %s%s\n", mPosition.line, mPosition.file.c_str(), mPosition.flags.c_str());
+    if (output.file == mPosition.file && output.flags == mPosition.flags
+        && output.line < mPosition.line && mPosition.line - output.line <= marker.size()) {
+        const std::string newlines(mPosition.line - output.line, '\n');
+        emit(newlines.c_str(), newlines.size());
+    } else {
+        emit(marker.c_str(), marker.size());
+    }
+    output = mPosition;
+}
+
+bool Minimizer::verify(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args,
+                       const std::string &original, const std::string &minimized)
+{
+    // compiled like the builder does, see builder/compile.js
+    const bool clang = Client::data().builderCompiler.find("clang") != std::string::npos;
+    std::string commandLine = compiler;
+    const std::vector<std::string> &commandLineArgs = args->commandLine;
+    for (size_t i=1; i<commandLineArgs.size(); ++i) {
+        const std::string &arg = commandLineArgs[i];
+        if (i == args->sourceFileIndex || arg == "-c" || arg == "-MD" || arg == "-MMD"
+            || arg == "-M" || arg == "-MM" || arg == "-MP" || arg == "-MG") {
+            continue;
+        }
+        if (arg == "-o" || arg == "-x" || arg == "-MF" || arg == "-MT" || arg == "-MQ"
+            || arg == "-include" || arg == "-imacros") {
+            ++i;
+            continue;
+        }
+        commandLine += " '";
+        commandLine += arg;
+        commandLine += '\'';
+    }
+    commandLine += " '-x' '";
+    commandLine += CompilerArgs::languageName(static_cast<CompilerArgs::Flag>(args->flags & CompilerArgs::LanguageMask), !clang);
+    commandLine += clang ? "'" : "' '-fpreprocessed' '-fdirectives-only'";
+
+    auto compile = [&commandLine](const std::string &input, std::string &object) {
+        const std::string output = input + ".o";
+        const std::string command = commandLine + " '-c' '-o' '" + output + "' '" + input + '\'';
+        DEBUG("Verifying minimized output: %s", command.c_str());
+        std::string err;
+        TinyProcessLib::Process proc(command, std::string(),
+                                     [](const char *, size_t) {},
+                                     [&err](const char *bytes, size_t n) {
+                                         err.append(bytes, n);
+                                     });
+        const int status = proc.get_exit_status();
+        const bool ok = !status && Client::readFile(output, object);
+        unlink(output.c_str());
+        if (status)
+            ERROR("Failed to compile %s (%d):\n%s", input.c_str(), status, err.c_str());
+        return ok;
+    };
+
+    std::string originalObject, minimizedObject;
+    if (!compile(original, originalObject) || !compile(minimized, minimizedObject))
+        return false;
+    if (originalObject != minimizedObject) {
+        ERROR("Minimizing changed the object for %s, compare %s and %s",
+              args->sourceFile().c_str(), original.c_str(), minimized.c_str());
+        return false;
+    }
+    DEBUG("Minimized output compiles to the same %zu byte object", originalObject.size());
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef MINIMIZER_H
+#define MINIMIZER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+
+struct CompilerArgs;
+
+// Makes preprocessed output smaller without changing what it compiles to.
+// Runs of blank lines go and line markers that don't change anything are
+// dropped, where that would throw off line numbers a marker (or a few
+// newlines if that's shorter) puts them back. With CollapseWhitespace runs of
+// spaces and tabs outside literals become one space and indentation goes,
+// that moves columns so it's not for objects with debug info.
+//
+// Like LineMarkerScanner the input can be split anywhere.
+class Minimizer
+{
+public:
+    enum Mode {
+        Lines,
+        CollapseWhitespace
+    };
+    Minimizer(Mode mode, std::function<void(const char *, size_t)> &&output);
+    void feed(const char *data, size_t len);
+    void finish();
+
+    size_t inputBytes() const { return mInputBytes; }
+    size_t outputBytes() const { return mOutputBytes; }
+
+    // Compiles both versions with the local compiler and compares the objects
+    static bool verify(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args,
+                       const std::string &original, const std::string &minimized);
+private:
+    void processLine(const char *line, size_t len);
+    bool processMarker(const char *line, size_t len);
+    // Everything up to the next line we emit is where it should be
+    void sync();
+    void emit(const char *data, size_t len);
+
+    struct Position {
+        std::string file; // quoted and escaped, as in the marker
+        std::string flags; // " 3" and " 4", the other flags don't stick
+        size_t line { 0 };
+    };
+
+    const Mode mMode;
+    std::function<void(const char *, size_t)> mOutput;
+    std::string mPartial;
+    std::string mLine;
+    std::string mBuffer;
+    // mPosition is where the next input line is, mOutputPosition where the
+    // compiler would think it is
+    Position mPosition, mOutputPosition;
+    bool mKnown { false };
+    // state carried over from the previous line
+    bool mContinued { false };
+    bool mBlockComment { false };
+    bool mLineComment { false };
+    char mQuote { 0 };
+    std::string mRawTerminator;
+    size_t mInputBytes { 0 };
+    size_t mOutputBytes { 0 };
+};
+
+#endif /* MINIMIZER_H */
@@ -1,7 +1,61 @@
 #include "Preprocessed.h"
 #include "Client.h"
 #include "DaemonSocket.h"
+#include "Minimizer.h"
+#include "Timings.h"
 #include <process.hpp>
+#include <algorithm>
+#include <cctype>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_set>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+static int createOutputFile()
+{
+    int fd;
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = syscall(SYS_memfd_create, "fisk-preprocessed", 1u); // MFD_CLOEXEC
+    if (fd != -1)
+        return fd;
+    DEBUG("memfd_create failed %d %s", errno, strerror(errno));
+#endif
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = Client::format("%s/fisk-preprocessed-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        ERROR("Failed to create %s %d %s", path.c_str(), errno, strerror(errno));
+        return -1;
+    }
+    unlink(path.c_str());
+    Client::setFlag(fd, O_CLOEXEC);
+    return fd;
+}
+
+// A named file for Minimizer::verify()
+static FILE *createVerifyFile(const char *name, std::string &path)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    path = Client::format("%s/fisk-%s-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp", name);
+    const int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        ERROR("Failed to create %s %d %s", path.c_str(), errno, strerror(errno));
+        return nullptr;
+    }
+    return fdopen(fd, "w");
+}
+
+static bool hasDebugInfo(const std::shared_ptr<CompilerArgs> &args)
+{
+    for (size_t i=1; i<args->commandLine.size(); ++i) {
+        const std::string &arg = args->commandLine[i];
+        if (arg.size() > 1 && arg[0] == '-' && arg[1] == 'g' && arg != "-g0" && arg.compare(0, 14, "-gcc-toolchain"))
+            return true;
+    }
+    return false;
+}
 
 Preprocessed::Preprocessed()
 {
@@ -19,6 +73,10 @@ Preprocessed::~Preprocessed()
         mJoined = true;
     }
     mThread.join();
+    if (mFD != -1) {
+        int ret;
+        EINTRWRAP(ret, ::close(mFD));
+    }
 }
 
 bool Preprocessed::done() const
@@ -27,6 +85,44 @@ bool Preprocessed::done() const
     return mDone;
 }
 
+size_t Preprocessed::available() const
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mSize;
+}
+
+int Preprocessed::fd() const
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mFD;
+}
+
+size_t Preprocessed::read(size_t offset, size_t max, std::string &out) const
+{
+    int fd;
+    size_t len;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (offset >= mSize)
+            return 0;
+        fd = mFD;
+        len = std::min(max, mSize - offset);
+    }
+    out.resize(len);
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r;
+        EINTRWRAP(r, ::pread(fd, &out[got], len - got, offset + got));
+        if (r <= 0) {
+            ERROR("Failed to read preprocessed output at %zu (%d %s)", offset + got, errno, strerror(errno));
+            out.clear();
+            return 0;
+        }
+        got += r;
+    }
+    return len;
+}
+
 std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
                                                    const std::shared_ptr<CompilerArgs> &args,
                                                    Select &select,
@@ -35,9 +131,31 @@ std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
     const unsigned long long started = Client::mono();
     Preprocessed *ptr = new Preprocessed;
     std::unique_ptr<Preprocessed> ret(ptr);
-    ret->mThread = std::thread([ptr, args, compiler, started, &daemonSocket, &select] {
-        std::string out, err;
-        ptr->stdOut.reserve(1024 * 1024);
+    if (!(args->flags & (CompilerArgs::CPreprocessed
+                         |CompilerArgs::ObjectiveCPreprocessed
+                         |CompilerArgs::ObjectiveCPlusPlusPreprocessed
+                         |CompilerArgs::CPlusPlusPreprocessed))) {
+        ptr->mFD = createOutputFile();
+    }
+
+    bool minimize = false;
+    Minimizer::Mode minimizeMode = Minimizer::Lines;
+    {
+        const std::string mode = Config::minimize;
+        if (!strcasecmp("lines", mode.c_str())) {
+            minimize = true;
+        } else if (!strcasecmp("whitespace", mode.c_str())) {
+            minimize = true;
+            // debug info has columns
+            if (!hasDebugInfo(args))
+                minimizeMode = Minimizer::CollapseWhitespace;
+        } else if (strcasecmp("none", mode.c_str())) {
+            FATAL("Invalid --minimize mode %s", mode.c_str());
+        }
+        if (args->flags & CompilerArgs::AssemblerWithCpp)
+            minimize = false;
+    }
+    ret->mThread = std::thread([ptr, args, compiler, started, minimize, minimizeMode, &daemonSocket, &select] {
         std::string commandLine = compiler;
         const size_t count = args->commandLine.size();
         for (size_t i=1; i<count; ++i) {
@@ -61,6 +179,31 @@ std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
             commandLine += " '-C'";
         }
 
+        const bool preprocessed = args->flags & (CompilerArgs::CPreprocessed
+                                                 |CompilerArgs::ObjectiveCPreprocessed
+                                                 |CompilerArgs::ObjectiveCPlusPlusPreprocessed
+                                                 |CompilerArgs::CPlusPlusPreprocessed);
+        std::unique_ptr<LineMarkerScanner> scanner;
+        std::unordered_set<std::string> seen;
+        if (Config::objectCache) {
+            std::function<void(const std::string &)> marker;
+            // sources that are already preprocessed are cached on their own
+            // contents
+            if (Config::directCache && !preprocessed) {
+                marker = [ptr, &seen](const std::string &text) {
+                    std::string file = LineMarkerScanner::fileName(text);
+                    // most markers are line changes in the file we're in
+                    if (file.empty() || (!ptr->includes.empty() && ptr->includes.back() == file))
+                        return;
+                    if (seen.insert(file).second)
+                        ptr->includes.push_back(std::move(file));
+                };
+            }
+            scanner.reset(new LineMarkerScanner([](const char *data, size_t len) {
+                Client::data().hasher.update(data, len);
+            }, std::move(marker)));
+        }
+
         DEBUG("Acquiring preprocess slot: %s", commandLine.c_str());
 
         if (!daemonSocket.waitForCppSlot()) {
@@ -68,18 +211,84 @@ std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
         } else {
             ptr->slotDuration = Client::mono() - started;
             DEBUG("Running preprocess: %s", commandLine.c_str());
-            if (args->flags & (CompilerArgs::CPreprocessed
-                               |CompilerArgs::ObjectiveCPreprocessed
-                               |CompilerArgs::ObjectiveCPlusPlusPreprocessed
-                               |CompilerArgs::CPlusPlusPreprocessed)) {
+            if (preprocessed) {
                 DEBUG("Already preprocessed. No need to do it");
-                ptr->exitStatus = Client::readFile(args->sourceFile(), ptr->stdOut) ? 0 : 1;
+                // mapped rather than read so the file never ends up in our
+                // heap, the upload reads it from the fd again
+                Client::MappedFile input;
+                std::string error;
+                if (!input.open(args->sourceFile(), &error)) {
+                    ERROR("%s", error.c_str());
+                    ptr->exitStatus = 1;
+                } else {
+                    if (scanner) {
+                        scanner->feed(input.data(), input.size());
+                        scanner->finish();
+                    }
+                    ptr->exitStatus = 0;
+                    std::unique_lock<std::mutex> lock(ptr->mMutex);
+                    ptr->mSize = input.size();
+                    ptr->mFD = input.release();
+                }
+            } else if (ptr->mFD == -1) {
+                ptr->exitStatus = 1;
             } else {
+                auto write = [ptr, &select](const char *bytes, size_t n) {
+                    if (ptr->mWriteError)
+                        return;
+                    // only this thread writes, readers use pread() below mSize
+                    for (size_t written = 0; written < n; ) {
+                        ssize_t w;
+                        EINTRWRAP(w, ::write(ptr->mFD, bytes + written, n - written));
+                        if (w <= 0) {
+                            ERROR("Failed to write preprocessed output (%d %s)", errno, strerror(errno));
+                            ptr->mWriteError = true;
+                            return;
+                        }
+                        written += w;
+                    }
+                    bool wakeup;
+                    {
+                        std::unique_lock<std::mutex> lock(ptr->mMutex);
+                        ptr->mSize += n;
+                        wakeup = ptr->mSize - ptr->mNotified >= StreamChunkSize;
+                        if (wakeup)
+                            ptr->mNotified = ptr->mSize;
+                    }
+                    if (wakeup)
+                        select.wakeup();
+                };
+
+                // with --minimize-verify both versions are kept on disk
+                // until we've compiled them
+                std::unique_ptr<Minimizer> minimizer;
+                std::string originalPath, minimizedPath;
+                FILE *original = nullptr, *minimized = nullptr;
+                if (minimize) {
+                    if (Config::minimizeVerify) {
+                        original = createVerifyFile("original", originalPath);
+                        minimized = createVerifyFile("minimized", minimizedPath);
+                    }
+                    minimizer.reset(new Minimizer(minimizeMode, [&write, minimized](const char *bytes, size_t n) {
+                        if (minimized)
+                            fwrite(bytes, 1, n, minimized);
+                        write(bytes, n);
+                    }));
+                }
+
                 DEBUG("Executing:\n%s", commandLine.c_str());
                 TinyProcessLib::Process proc(commandLine, std::string(),
-                                             [ptr](const char *bytes, size_t n) {
+                                             [&write, &scanner, &minimizer, original](const char *bytes, size_t n) {
                                                  VERBOSE("Preprocess appending %zu bytes to stdout", n);
-                                                 ptr->stdOut.append(bytes, n);
+                                                 if (scanner)
+                                                     scanner->feed(bytes, n);
+                                                 if (original)
+                                                     fwrite(bytes, 1, n, original);
+                                                 if (minimizer) {
+                                                     minimizer->feed(bytes, n);
+                                                 } else {
+                                                     write(bytes, n);
+                                                 }
                                              }, [ptr](const char *bytes, size_t n) {
                                                  VERBOSE("Preprocess appending %zu bytes to stderr", n);
                                                  ptr->stdErr.append(bytes, n);
@@ -87,38 +296,36 @@ std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
                 VERBOSE("Preprocess calling get_status");
                 ptr->exitStatus = proc.get_exit_status();
                 DEBUG("Preprocess got status %d", ptr->exitStatus);
-                if (Config::objectCache) {
-                    // FILE *f = fopen("/tmp/preproc.i", "w");
-                    const char *ch = ptr->stdOut.c_str();
-                    const char *last = ch;
-                    while (*ch) {
-                        // VERBOSE("GETTING CHAR [%c]", *ch);
-                        if (*ch == '#' && ch[1] == ' ' && std::isdigit(ch[2])) {
-                            if (ch > last) {
-                                VERBOSE("Adding to Md5:\n%.*s\n", static_cast<int>(ch - last), last);
-                                MD5_Update(&Client::data().md5, last, ch - last);
-                                // fwrite(last, 1, ch - last, f);
-                            }
-                            while (*ch && *ch != '\n')
-                                ++ch;
-                            last = ch;
+                if (minimizer) {
+                    minimizer->finish();
+                    DEBUG("Minimized %zu bytes of preprocessed output to %zu", minimizer->inputBytes(), minimizer->outputBytes());
+                }
+                if (!ptr->exitStatus && ptr->mWriteError)
+                    ptr->exitStatus = 1;
+                if (scanner)
+                    scanner->finish();
+                if (minimize && Config::minimizeVerify) {
+                    // fclose() both either way
+                    bool verified = original && !fclose(original);
+                    verified = minimized && !fclose(minimized) && verified;
+                    if (!ptr->exitStatus) {
+                        if (!verified || !Minimizer::verify(compiler, args, originalPath, minimizedPath)) {
+                            ptr->exitStatus = 1;
                         } else {
-                            ++ch;
+                            unlink(originalPath.c_str());
+                            unlink(minimizedPath.c_str());
                         }
                     }
-                    if (last < ch) {
-                        VERBOSE("Adding to Md5:\n%.*s\n", static_cast<int>(ch - last), last);
-                        MD5_Update(&Client::data().md5, last, ch - last);
-                        // fwrite(last, 1, ch - last, f);
-                    }
-                    // fclose(f);
                 }
             }
         }
+        // what fisk-daemon is told to expect next time
+        if (!ptr->exitStatus)
+            Timings::recordCppSize(args->sourceFile(), ptr->mSize);
         {
             std::unique_lock<std::mutex> lock(ptr->mMutex);
             ptr->mDone = true;
-            ptr->cppSize = ptr->stdOut.size();
+            ptr->cppSize = ptr->mSize;
             ptr->duration = Client::mono() - started;
             ptr->mCond.notify_one();
         }
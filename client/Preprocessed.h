@@ -1,21 +1,36 @@
 #ifndef PREPROCESSED_H
 #define PREPROCESSED_H
 
+#include "LineMarkerScanner.h"
 #include "Select.h"
 #include <thread>
 #include <string>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <vector>
 
 struct CompilerArgs;
 class DaemonSocket;
+
 class Preprocessed
 {
 public:
     ~Preprocessed();
     bool done() const;
 
-    std::string stdOut, stdErr;
+    enum { StreamChunkSize = 256 * 1024 };
+    // The output goes to an anonymous file (a memfd on Linux) rather than
+    // into our heap. Already preprocessed sources are used as is. Reading
+    // works while the preprocessor is still running, fd() can be handed to
+    // sendfile() for anything below available().
+    size_t available() const;
+    size_t read(size_t offset, size_t max, std::string &out) const;
+    int fd() const;
+
+    std::string stdErr;
+    // Every file the preprocessor read, for the direct cache
+    std::vector<std::string> includes;
     size_t cppSize { 0 };
     int exitStatus { -1 };
     unsigned long long duration { 0 };
@@ -30,8 +45,12 @@ private:
     mutable std::mutex mMutex;
     std::condition_variable mCond;
     std::thread mThread;
+    int mFD { -1 };
+    size_t mSize { 0 };
+    bool mWriteError { false };
     bool mDone { false };
     bool mJoined { false };
+    size_t mNotified { 0 };
 };
 
 #endif /* PREPROCESSED_H */
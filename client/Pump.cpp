@@ -0,0 +1,355 @@
+#include "Pump.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "Hasher.h"
+#include "Log.h"
+#include <process.hpp>
+#include <algorithm>
+#include <string.h>
+#include <sys/stat.h>
+
+static inline bool isFile(const std::string &path)
+{
+    struct stat st;
+    return !stat(path.c_str(), &st) && S_ISREG(st.st_mode);
+}
+
+static inline const char *skipSpace(const char *ch, const char *end)
+{
+    while (ch < end && (*ch == ' ' || *ch == '\t'))
+        ++ch;
+    return ch;
+}
+
+// The flags that take a directory or file, joined or as the next argument
+static size_t pathArg(const std::string &arg, const char *flag, const std::vector<std::string> &args, size_t i, std::string *value)
+{
+    const size_t len = strlen(flag);
+    if (arg.compare(0, len, flag))
+        return 0;
+    if (arg.size() > len) {
+        *value = arg.substr(len);
+        return 1;
+    }
+    if (i + 1 >= args.size())
+        return 0;
+    *value = args[i + 1];
+    return 2;
+}
+
+Pump::Pump()
+    : mCwd(Client::cwd())
+{
+    if (!mCwd.empty() && mCwd.back() == '/')
+        mCwd.pop_back();
+}
+
+bool Pump::scan()
+{
+    const unsigned long long started = Client::mono();
+    std::shared_ptr<CompilerArgs> args = Client::data().compilerArgs;
+    if (args->flags & (CompilerArgs::CPreprocessed
+                       |CompilerArgs::CPlusPlusPreprocessed
+                       |CompilerArgs::ObjectiveCPreprocessed
+                       |CompilerArgs::ObjectiveCPlusPlusPreprocessed
+                       |CompilerArgs::Assembler)) {
+        DEBUG("Nothing to pump for %s", args->sourceFile().c_str());
+        return false;
+    }
+    if (!searchPath())
+        return false;
+
+    const std::vector<std::string> &commandLine = args->commandLine;
+    for (size_t i=1; i<commandLine.size(); ++i) {
+        if (!commandLine[i].compare(0, 12, "-include-pch")) {
+            DEBUG("Can't pump with a precompiled header");
+            return false;
+        }
+        std::string file;
+        size_t count = pathArg(commandLine[i], "-include", commandLine, i, &file);
+        if (!count)
+            count = pathArg(commandLine[i], "-imacros", commandLine, i, &file);
+        if (!count)
+            continue;
+        // looked for in the working directory first, then the rest of the
+        // quote chain
+        for (const std::string &path : resolve(file, true, true, mCwd)) {
+            if (!addFile(path))
+                return false;
+        }
+        i += count - 1;
+    }
+
+    if (!addFile(absolute(args->sourceFile())))
+        return false;
+
+    // addFile() scans each file for more as it goes
+    VERBOSE("Pump found %zu files, %zu bytes for %s in %llums",
+            mFiles.size(), mBytes, args->sourceFile().c_str(), Client::mono() - started);
+    return true;
+}
+
+// Asks the compiler where it looks for includes, gcc and clang print
+//
+// #include "..." search starts here:
+//  dir
+// #include <...> search starts here:
+//  dir
+// End of search list.
+bool Pump::searchPath()
+{
+    Client::Data &data = Client::data();
+    std::shared_ptr<CompilerArgs> args = data.compilerArgs;
+    std::vector<std::string> userDirs;
+    std::string commandLine = data.compiler;
+    const size_t count = args->commandLine.size();
+    for (size_t i=1; i<count; ++i) {
+        const std::string &arg = args->commandLine[i];
+        if (i == args->sourceFileIndex || arg == "-c" || arg == "-MD" || arg == "-MMD"
+            || arg == "-M" || arg == "-MM" || arg == "-MP" || arg == "-MG") {
+            continue;
+        }
+        if ((arg == "-o" || arg == "-x" || arg == "-MF" || arg == "-MT" || arg == "-MQ") && i + 1 < count) {
+            ++i;
+            continue;
+        }
+        std::string dir;
+        for (const char *flag : { "-isystem", "-iquote", "-idirafter", "-I" }) {
+            if (pathArg(arg, flag, args->commandLine, i, &dir)) {
+                userDirs.push_back(absolute(dir));
+                break;
+            }
+        }
+
+        commandLine += " '";
+        commandLine += arg;
+        commandLine += '\'';
+    }
+    commandLine += " '-E' '-v' '-x' '";
+    commandLine += CompilerArgs::languageName(static_cast<CompilerArgs::Flag>(args->flags & CompilerArgs::LanguageMask));
+    commandLine += "' '/dev/null'";
+
+    DEBUG("Getting include paths:\n%s", commandLine.c_str());
+    std::string out;
+    TinyProcessLib::Process proc(commandLine, std::string(),
+                                 [](const char *, size_t) {},
+                                 [&out](const char *bytes, size_t n) {
+                                     out.append(bytes, n);
+                                 });
+    if (proc.get_exit_status()) {
+        DEBUG("Failed to get include paths:\n%s", out.c_str());
+        return false;
+    }
+
+    std::vector<std::string> *chain = nullptr;
+    for (const std::string &line : Client::split(out, "\n")) {
+        if (line == "#include \"...\" search starts here:") {
+            chain = &mQuoteDirs;
+        } else if (line == "#include <...> search starts here:") {
+            chain = &mBracketDirs;
+        } else if (line == "End of search list.") {
+            break;
+        } else if (chain && !line.empty() && line[0] == ' ') {
+            static const char *framework = " (framework directory)";
+            if (line.size() > strlen(framework) && !line.compare(line.size() - strlen(framework), std::string::npos, framework)) {
+                DEBUG("Framework directories aren't supported: %s", line.c_str());
+                return false;
+            }
+            chain->push_back(absolute(line.substr(1)));
+        }
+    }
+    if (mBracketDirs.empty()) {
+        DEBUG("No include paths in:\n%s", out.c_str());
+        return false;
+    }
+    for (const std::string &dir : mBracketDirs) {
+        if (std::find(userDirs.begin(), userDirs.end(), dir) == userDirs.end())
+            mSystemDirs.push_back(dir);
+    }
+    return true;
+}
+
+bool Pump::addFile(const std::string &path)
+{
+    if (!mSeen.insert(path).second)
+        return true;
+
+    Client::MappedFile file;
+    std::string err;
+    if (!file.open(path, &err)) {
+        DEBUG("Can't pump %s: %s", path.c_str(), err.c_str());
+        return false;
+    }
+    Hasher hasher;
+    hasher.init(Hasher::MD5);
+    hasher.update(file.data(), file.size());
+    File f { path, hasher.finalize(), file.size() };
+    mHashes.emplace(f.hash, mFiles.size());
+    mBytes += f.size;
+    mFiles.push_back(std::move(f));
+    return scanFile(path, file.data(), file.size());
+}
+
+bool Pump::scanFile(const std::string &path, const char *data, size_t size)
+{
+    const std::string dir = path.substr(0, path.rfind('/'));
+    auto add = [this, &dir](const std::string &name, bool quoted, bool next) {
+        for (const std::string &file : resolve(name, quoted, next, dir)) {
+            if (!addFile(file))
+                return false;
+        }
+        return true;
+    };
+
+    const char *end = data + size;
+    for (const char *line = data; line < end; ) {
+        const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!eol)
+            eol = end;
+        const char *ch = skipSpace(line, eol);
+        line = eol + 1;
+        if (ch == eol || *ch != '#')
+            continue;
+        ch = skipSpace(ch + 1, eol);
+        bool next = false;
+        size_t len = 0;
+        for (const char *directive : { "include_next", "include", "import" }) {
+            len = strlen(directive);
+            if (static_cast<size_t>(eol - ch) > len && !strncmp(ch, directive, len)
+                && (ch[len] == ' ' || ch[len] == '\t' || ch[len] == '"' || ch[len] == '<')) {
+                next = !strcmp(directive, "include_next");
+                break;
+            }
+            len = 0;
+        }
+        if (!len)
+            continue;
+        ch = skipSpace(ch + len, eol);
+        const char close = *ch == '"' ? '"' : (*ch == '<' ? '>' : 0);
+        const char *nameEnd = close ? static_cast<const char *>(memchr(ch + 1, close, eol - ch - 1)) : nullptr;
+        if (!nameEnd) {
+            DEBUG("Can't follow %s in %s", std::string(ch, eol).c_str(), path.c_str());
+            return false;
+        }
+        if (!add(std::string(ch + 1, nameEnd), close == '"', next))
+            return false;
+    }
+
+    // __has_include is true on the builder if the file is there, so ship it
+    // if it is here
+    static const char *hasInclude = "__has_include";
+    const size_t hasIncludeLen = strlen(hasInclude);
+    for (const char *ch = data; ch < end; ) {
+        ch = static_cast<const char *>(memmem(ch, end - ch, hasInclude, hasIncludeLen));
+        if (!ch)
+            break;
+        ch += hasIncludeLen;
+        bool next = false;
+        if (end - ch > 5 && !strncmp(ch, "_next", 5)) {
+            next = true;
+            ch += 5;
+        }
+        ch = skipSpace(ch, end);
+        if (ch == end || *ch != '(')
+            continue;
+        ch = skipSpace(ch + 1, end);
+        const char close = ch < end && *ch == '"' ? '"' : (ch < end && *ch == '<' ? '>' : 0);
+        if (!close)
+            continue;
+        const char *nameEnd = static_cast<const char *>(memchr(ch + 1, close, end - ch - 1));
+        if (!nameEnd)
+            break;
+        if (!add(std::string(ch + 1, nameEnd), close == '"', next))
+            return false;
+        ch = nameEnd;
+    }
+    return true;
+}
+
+std::vector<std::string> Pump::resolve(const std::string &name, bool quoted, bool next, const std::string &includer) const
+{
+    std::vector<std::string> ret;
+    if (name.empty())
+        return ret;
+    if (name[0] == '/') {
+        if (isFile(name))
+            ret.push_back(absolute(name));
+        return ret;
+    }
+    auto search = [this, &ret, &name, next](const std::string &dir) {
+        const std::string path = dir + '/' + name;
+        if (isFile(path)) {
+            std::string file = absolute(path);
+            if (std::find(ret.begin(), ret.end(), file) == ret.end())
+                ret.push_back(std::move(file));
+        }
+        return next || ret.empty();
+    };
+    if (quoted) {
+        if (!search(includer))
+            return ret;
+        for (const std::string &dir : mQuoteDirs) {
+            if (!search(dir))
+                return ret;
+        }
+    }
+    for (const std::string &dir : mBracketDirs) {
+        if (!search(dir))
+            break;
+    }
+    return ret;
+}
+
+// Lexically, like the compiler would, symlinks are shipped as the files they
+// point to
+std::string Pump::absolute(const std::string &path) const
+{
+    std::vector<std::string> parts;
+    for (const std::string &part : Client::split(path[0] == '/' ? path : mCwd + '/' + path, "/")) {
+        if (part.empty() || part == ".")
+            continue;
+        if (part == "..") {
+            if (!parts.empty())
+                parts.pop_back();
+            continue;
+        }
+        parts.push_back(part);
+    }
+    std::string ret;
+    for (const std::string &part : parts) {
+        ret += '/';
+        ret += part;
+    }
+    return ret.empty() ? "/" : ret;
+}
+
+const std::string *Pump::path(const std::string &hash) const
+{
+    auto it = mHashes.find(hash);
+    return it == mHashes.end() ? nullptr : &mFiles[it->second].path;
+}
+
+json11::Json Pump::toJson() const
+{
+    json11::Json::array files;
+    files.reserve(mFiles.size());
+    for (const File &file : mFiles) {
+        files.push_back(json11::Json::object {
+                { "path", file.path },
+                { "hash", file.hash },
+                { "size", static_cast<double>(file.size) }
+            });
+    }
+    json11::Json::array dirs;
+    for (const std::vector<std::string> *chain : { &mQuoteDirs, &mBracketDirs }) {
+        for (const std::string &dir : *chain)
+            dirs.push_back(dir);
+    }
+    dirs.push_back(mCwd);
+    return json11::Json::object {
+        { "cwd", mCwd },
+        { "files", files },
+        { "dirs", dirs },
+        { "systemDirs", mSystemDirs }
+    };
+}
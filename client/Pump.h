@@ -0,0 +1,54 @@
+#ifndef PUMP_H
+#define PUMP_H
+
+#include <json11.hpp>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// distcc-pump style remote preprocessing. Instead of running the preprocessor
+// here we find the files it could read and the builder preprocesses in a copy
+// of our tree made from them. Files are addressed by the md5 of their
+// contents so the builder only needs the ones it hasn't seen before, from us
+// or anyone else.
+//
+// The closure is a superset, every #include in every file is followed whether
+// the #if around it is true or not. Anything we can't follow, like
+// #include MACRO, means the source is preprocessed locally as usual.
+class Pump
+{
+public:
+    // Uses Client::data()
+    Pump();
+
+    bool scan();
+
+    // For the job message
+    json11::Json toJson() const;
+    // The file with these contents, null if there isn't one
+    const std::string *path(const std::string &hash) const;
+    size_t bytes() const { return mBytes; }
+private:
+    bool searchPath();
+    bool addFile(const std::string &path);
+    bool scanFile(const std::string &path, const char *data, size_t size);
+    // The files an include could be, just the first one unless next is set
+    std::vector<std::string> resolve(const std::string &name, bool quoted, bool next, const std::string &includer) const;
+    std::string absolute(const std::string &path) const;
+
+    struct File {
+        std::string path;
+        std::string hash;
+        size_t size;
+    };
+
+    std::string mCwd;
+    std::vector<std::string> mQuoteDirs, mBracketDirs, mSystemDirs;
+    std::vector<File> mFiles;
+    std::unordered_set<std::string> mSeen;
+    std::unordered_map<std::string, size_t> mHashes;
+    size_t mBytes { 0 };
+};
+
+#endif /* PUMP_H */
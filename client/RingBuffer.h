@@ -0,0 +1,76 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <algorithm>
+#include <string.h>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+// Fixed capacity byte ring. Filled straight from a socket with readv() and
+// drained from the front without moving the remaining bytes.
+class RingBuffer
+{
+public:
+    RingBuffer(size_t capacity)
+        : mBuffer(capacity)
+    {}
+
+    size_t size() const { return mSize; }
+    size_t capacity() const { return mBuffer.size(); }
+    bool empty() const { return !mSize; }
+    bool full() const { return mSize == mBuffer.size(); }
+
+    // Same return values as read(2), 0 bytes are only reported for EOF
+    ssize_t readFrom(int fd)
+    {
+        iovec vecs[2];
+        int count = 0;
+        const size_t tail = (mOffset + mSize) % mBuffer.size();
+        size_t space = mBuffer.size() - mSize;
+        while (space) {
+            const size_t start = count ? 0 : tail;
+            const size_t len = std::min(space, mBuffer.size() - start);
+            vecs[count].iov_base = &mBuffer[start];
+            vecs[count].iov_len = len;
+            space -= len;
+            ++count;
+        }
+        const ssize_t ret = ::readv(fd, vecs, count);
+        if (ret > 0)
+            mSize += ret;
+        return ret;
+    }
+
+    size_t read(void *data, size_t len)
+    {
+        unsigned char *out = static_cast<unsigned char *>(data);
+        len = std::min(len, mSize);
+        const size_t first = std::min(len, mBuffer.size() - mOffset);
+        memcpy(out, &mBuffer[mOffset], first);
+        memcpy(out + first, &mBuffer[0], len - first);
+        consume(len);
+        return len;
+    }
+
+    std::string toString() const
+    {
+        std::string ret(mSize, '\0');
+        const size_t first = std::min(mSize, mBuffer.size() - mOffset);
+        memcpy(&ret[0], &mBuffer[mOffset], first);
+        memcpy(&ret[first], &mBuffer[0], mSize - first);
+        return ret;
+    }
+
+    void consume(size_t len)
+    {
+        mSize -= len;
+        mOffset = mSize ? (mOffset + len) % mBuffer.size() : 0;
+    }
+private:
+    std::vector<unsigned char> mBuffer;
+    size_t mOffset { 0 };
+    size_t mSize { 0 };
+};
+
+#endif /* RINGBUFFER_H */
@@ -2,5 +2,6 @@
 
 void SchedulerWebSocket::onConnected()
 {
-    Client::data().watchdog->transition(Watchdog::ConnectedToScheduler);
+    if (watchdog)
+        Client::data().watchdog->transition(Watchdog::ConnectedToScheduler);
 }
@@ -25,41 +25,51 @@ public:
                 done = true;
                 return;
             }
-            const std::string t = msg["type"].string_value();
-            if (t == "needsEnvironment") {
-                needsEnvironment = true;
-                done = true;
-            } else if (t == "builder") {
-                data.builderIp = msg["ip"].string_value();
-                Client::data().builderHostname = msg["hostname"].string_value();
-                environment = msg["environment"].string_value();
-                std::vector<json11::Json> extraArgs = msg["extraArgs"].array_items();
-                extraArguments.reserve(extraArgs.size());
-                for (const json11::Json &arg : extraArgs) {
-                    extraArguments.push_back(arg.string_value());
-                }
-                data.builderPort = static_cast<uint16_t>(msg["port"].int_value());
-                jobId = msg["id"].int_value();
-                DEBUG("type %d", msg["port"].type());
-                DEBUG("Got here %s:%d", data.builderIp.c_str(), data.builderPort);
-                done = true;
-            } else if (t == "version_mismatch") {
-                FATAL("*** Version mismatch detected, client version: %s minimum client version required: %s",
-                      npm_version, msg["minimum_version"].string_value().c_str());
-                _exit(108);
-            } else if (t == "version_verified") {
-                ERROR("Version verified, client version: %s minimum client version required: %s",
-                      npm_version, msg["minimum_version"].string_value().c_str());
-                done = true;
-            } else {
-                ERROR("Unexpected message type: %s", t.c_str());
-            }
+            processMessage(msg);
             // } else {
             //     printf("Got binary message: %zu bytes\n", len);
         }
     }
 
+    // Also used for builder assignments that fisk-daemon got from the
+    // scheduler on our behalf
+    void processMessage(const json11::Json &msg)
+    {
+        Client::Data &data = Client::data();
+        const std::string t = msg["type"].string_value();
+        if (t == "needsEnvironment") {
+            needsEnvironment = true;
+            done = true;
+        } else if (t == "builder") {
+            data.builderIp = msg["ip"].string_value();
+            Client::data().builderHostname = msg["hostname"].string_value();
+            environment = msg["environment"].string_value();
+            std::vector<json11::Json> extraArgs = msg["extraArgs"].array_items();
+            extraArguments.reserve(extraArgs.size());
+            for (const json11::Json &arg : extraArgs) {
+                extraArguments.push_back(arg.string_value());
+            }
+            data.builderPort = static_cast<uint16_t>(msg["port"].int_value());
+            jobId = msg["id"].int_value();
+            DEBUG("type %d", msg["port"].type());
+            DEBUG("Got here %s:%d", data.builderIp.c_str(), data.builderPort);
+            done = true;
+        } else if (t == "version_mismatch") {
+            FATAL("*** Version mismatch detected, client version: %s minimum client version required: %s",
+                  npm_version, msg["minimum_version"].string_value().c_str());
+            _exit(108);
+        } else if (t == "version_verified") {
+            ERROR("Version verified, client version: %s minimum client version required: %s",
+                  npm_version, msg["minimum_version"].string_value().c_str());
+            done = true;
+        } else {
+            ERROR("Unexpected message type: %s", t.c_str());
+        }
+    }
+
     bool done { false };
+    // false for a connection that's not part of the watchdog's stages
+    bool watchdog { true };
     std::string error;
     bool needsEnvironment { false };
     int jobId { 0 };
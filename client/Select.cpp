@@ -1,23 +1,112 @@
 #include "Select.h"
+#include <algorithm>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 Socket::~Socket()
 {
 }
 
-int Select::exec(int timeoutMs) const
+Select::Select()
 {
+    mPipe[0] = mPipe[1] = -1;
+#ifdef __linux__
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpoll != -1) {
+        mEventFD = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        mTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = &mEventFD;
+        bool ok = mEventFD != -1 && !epoll_ctl(mEpoll, EPOLL_CTL_ADD, mEventFD, &event);
+        event.data.ptr = &mTimerFD;
+        ok = ok && mTimerFD != -1 && !epoll_ctl(mEpoll, EPOLL_CTL_ADD, mTimerFD, &event);
+        if (ok)
+            return;
+        ERROR("Failed to set up epoll, falling back to select %d %s", errno, strerror(errno));
+        for (int *fd : { &mEpoll, &mEventFD, &mTimerFD }) {
+            if (*fd != -1) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+#endif
+    if (pipe(mPipe) == -1) {
+        mPipe[0] = mPipe[1] = -1;
+    }
+}
+
+Select::~Select()
+{
+    if (mPipe[0] != -1)
+        ::close(mPipe[0]);
+    if (mPipe[1] != -1)
+        ::close(mPipe[1]);
+#ifdef __linux__
+    if (mEpoll != -1)
+        ::close(mEpoll);
+    if (mEventFD != -1)
+        ::close(mEventFD);
+    if (mTimerFD != -1)
+        ::close(mTimerFD);
+#endif
+    for (Socket *socket : mSockets) {
+        assert(socket->mSelect == this);
+        socket->mSelect = nullptr;
+        socket->mChanged = false;
+    }
+}
+
+void Select::remove(Socket *socket)
+{
+    assert(socket->mSelect == this);
+    socket->mSelect = nullptr;
+    mSockets.erase(socket);
+    if (socket->mChanged) {
+        socket->mChanged = false;
+        mChanged.erase(std::find(mChanged.begin(), mChanged.end(), socket));
+    }
+#ifdef __linux__
+    auto it = mRegistrations.find(socket);
+    if (it != mRegistrations.end()) {
+        unregister(socket, it->second);
+        mRegistrations.erase(it);
+    }
+#endif
+}
+
+int Select::exec(int timeoutMs)
+{
+#ifdef __linux__
+    if (mEpoll != -1)
+        return execEpoll(timeoutMs);
+#endif
+    return execSelect(timeoutMs);
+}
+
+int Select::execSelect(int timeoutMs)
+{
+    // everyone's asked every time
+    for (Socket *socket : mChanged)
+        socket->mChanged = false;
+    mChanged.clear();
+
     fd_set r, w;
     FD_ZERO(&r);
     FD_ZERO(&w);
     int max = mPipe[0];
     FD_SET(mPipe[0], &r);
-    std::vector<int> timeouts;
+    mTimeouts.clear();
     const unsigned long long before = Client::mono();
     for (Socket *socket : mSockets) {
         const int to = socket->timeout();
         if (to != -1 && (timeoutMs == -1 || to < timeoutMs))
             timeoutMs = to;
-        timeouts.push_back(to);
+        mTimeouts.push_back(to);
         const int fd = socket->fd();
         if (fd == -1)
             continue;
@@ -41,7 +130,7 @@ int Select::exec(int timeoutMs) const
             timeout->tv_usec = (timeoutMs % 1000) * 1000;
         }
         ret = select(max + 1, &r, &w, nullptr, timeout);
-    } while (ret == EINTR);
+    } while (ret == -1 && errno == EINTR);
     if (ret == -1) {
         ERROR("Select failed %d %s", errno, strerror(errno));
         return -1;
@@ -62,8 +151,8 @@ int Select::exec(int timeoutMs) const
     }
     for (Socket *socket : mSockets) {
         if (!ret) {
-            if (timeouts[idx] >= 0) {
-                const unsigned long long socketTimeout = timeouts[idx] + before;
+            if (mTimeouts[idx] >= 0) {
+                const unsigned long long socketTimeout = mTimeouts[idx] + before;
                 if (after >= socketTimeout)
                     socket->onTimeout();
             }
@@ -82,8 +171,181 @@ int Select::exec(int timeoutMs) const
     return ret;
 }
 
+#ifdef __linux__
+static inline uint32_t epollEvents(unsigned int mode)
+{
+    uint32_t ret = EPOLLET;
+    if (mode & Socket::Read)
+        ret |= EPOLLIN|EPOLLRDHUP;
+    if (mode & Socket::Write)
+        ret |= EPOLLOUT;
+    return ret;
+}
+
+bool Select::update(Socket *socket, Registration &registration)
+{
+    const int fd = socket->fd();
+    const unsigned int mode = fd == -1 ? 0u : socket->mode();
+    if (fd == registration.fd && mode == registration.mode)
+        return true;
+
+    epoll_event event = {};
+    event.events = epollEvents(mode);
+    event.data.ptr = socket;
+    int op;
+    if (fd != registration.fd) {
+        unregister(socket, registration);
+        registration.fd = fd;
+        registration.mode = Socket::None;
+        if (!mode)
+            return true;
+        op = EPOLL_CTL_ADD;
+    } else if (!mode) {
+        op = EPOLL_CTL_DEL;
+    } else if (!registration.mode) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        // MOD also re-evaluates readiness so an edge that was consumed while
+        // the socket wasn't interested is reported again
+        op = EPOLL_CTL_MOD;
+    }
+
+    if (epoll_ctl(mEpoll, op, fd, &event) == -1) {
+        if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+            op = EPOLL_CTL_MOD;
+        } else if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            op = EPOLL_CTL_ADD;
+        } else if (op != EPOLL_CTL_DEL) {
+            ERROR("Failed to register fd %d with epoll %d %s", fd, errno, strerror(errno));
+            return false;
+        }
+        if (op != EPOLL_CTL_DEL && epoll_ctl(mEpoll, op, fd, &event) == -1) {
+            ERROR("Failed to register fd %d with epoll %d %s", fd, errno, strerror(errno));
+            return false;
+        }
+    }
+    VERBOSE("Re-armed fd %d with mode 0x%x (was 0x%x)", fd, mode, registration.mode);
+    registration.mode = mode;
+    return true;
+}
+
+void Select::unregister(Socket *socket, const Registration &registration)
+{
+    // If the socket closed the fd the kernel has already dropped it (and the
+    // number might belong to someone else by now) so only remove fds the
+    // socket still owns
+    if (registration.fd != -1 && registration.mode && socket->fd() == registration.fd)
+        epoll_ctl(mEpoll, EPOLL_CTL_DEL, registration.fd, nullptr);
+}
+
+void Select::armTimer(unsigned long long deadline)
+{
+    if (deadline == mTimerDeadline)
+        return;
+    mTimerDeadline = deadline;
+    itimerspec spec = {};
+    if (deadline) {
+        const unsigned long long now = Client::mono();
+        // a zeroed it_value disarms the timer so fire in 1ns if it's overdue
+        const unsigned long long ms = deadline > now ? deadline - now : 0;
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = ms ? (ms % 1000) * 1000000 : 1;
+    }
+    if (timerfd_settime(mTimerFD, 0, &spec, nullptr) == -1)
+        ERROR("Failed to arm timer %d %s", errno, strerror(errno));
+}
+
+int Select::execEpoll(int timeoutMs)
+{
+    const unsigned long long before = Client::mono();
+    bool ok = true;
+    for (Socket *socket : mChanged) {
+        socket->mChanged = false;
+        Registration &registration = mRegistrations[socket];
+        const int to = socket->timeout();
+        registration.deadline = to == -1 ? 0 : before + to;
+        if (ok && !update(socket, registration))
+            ok = false;
+    }
+    mChanged.clear();
+    if (!ok)
+        return -1;
+    unsigned long long deadline = timeoutMs == -1 ? 0 : before + timeoutMs;
+    for (const auto &it : mRegistrations) {
+        if (it.second.deadline && (!deadline || it.second.deadline < deadline))
+            deadline = it.second.deadline;
+    }
+    armTimer(deadline);
+
+    enum { MaxEvents = 16 };
+    epoll_event events[MaxEvents];
+    int count;
+    EINTRWRAP(count, epoll_wait(mEpoll, events, MaxEvents, -1));
+    if (count == -1) {
+        ERROR("epoll_wait failed %d %s", errno, strerror(errno));
+        return -1;
+    }
+
+    const unsigned long long after = Client::mono();
+    VERBOSE("Woke up from epoll timeout %lldms after %llums with %d events",
+            deadline ? static_cast<long long>(deadline - before) : -1ll, after - before, count);
+
+    int ret = 0;
+    bool timedOut = false;
+    for (int i=0; i<count; ++i) {
+        if (events[i].data.ptr == &mEventFD || events[i].data.ptr == &mTimerFD) {
+            const int fd = *static_cast<int *>(events[i].data.ptr);
+            uint64_t value;
+            ssize_t readRet;
+            EINTRWRAP(readRet, ::read(fd, &value, sizeof(value)));
+            if (fd == mTimerFD) {
+                mTimerDeadline = 0;
+                timedOut = true;
+            }
+            continue;
+        }
+        Socket *socket = static_cast<Socket *>(events[i].data.ptr);
+        // a callback for an earlier event might have removed it
+        auto it = mRegistrations.find(socket);
+        if (it == mRegistrations.end() || socket->fd() != it->second.fd)
+            continue;
+        ++ret;
+        const uint32_t fired = events[i].events;
+        const unsigned int mode = it->second.mode;
+        // whatever it does in there can change its mode
+        socket->changed();
+        if (mode & Socket::Read && fired & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+            socket->onRead();
+        if (mode & Socket::Write && fired & (EPOLLOUT|EPOLLHUP|EPOLLERR) && mRegistrations.count(socket))
+            socket->onWrite();
+    }
+
+    if (timedOut || (!ret && deadline && after >= deadline)) {
+        const std::vector<Socket *> sockets(mSockets.begin(), mSockets.end());
+        for (Socket *socket : sockets) {
+            auto it = mRegistrations.find(socket);
+            if (it != mRegistrations.end() && it->second.deadline && after >= it->second.deadline) {
+                socket->changed();
+                socket->onTimeout();
+            }
+        }
+    }
+
+    return ret;
+}
+#endif
+
 void Select::wakeup()
 {
+#ifdef __linux__
+    if (mEventFD != -1) {
+        DEBUG("Waking up with eventfd");
+        const uint64_t value = 1;
+        ssize_t err;
+        EINTRWRAP(err, ::write(mEventFD, &value, sizeof(value)));
+        return;
+    }
+#endif
     if (mPipe[1] != -1) {
         DEBUG("Waking up with pipe");
         ssize_t err;
@@ -92,4 +354,3 @@ void Select::wakeup()
         DEBUG("Pipe not there");
     }
 }
-
@@ -8,6 +8,7 @@
 #include <functional>
 #include <sys/select.h>
 #include <unistd.h>
+#include <vector>
 #include "Log.h"
 #include "Client.h"
 
@@ -27,39 +28,62 @@ struct Socket
     virtual void onTimeout() = 0;
     virtual int timeout() = 0;
     void wakeup();
+    // Has to be called when fd(), mode() or timeout() might return something
+    // else. Select only asks sockets that did or that just had a callback.
+    // Not thread safe, other threads wakeup() the one that owns the socket
+    void changed();
 private:
     Select *mSelect { nullptr };
+    bool mChanged { false };
     friend class Select;
 };
 
+// On Linux sockets are registered edge-triggered with epoll and only
+// re-armed when their fd or mode changes, wakeup() uses an eventfd and the
+// earliest Socket::timeout() arms a timerfd. Only sockets that are
+// Socket::changed() are asked for those again. Elsewhere, or if epoll can't be
+// set up, it falls back to select(2) with a self-pipe.
 class Select
 {
 public:
-    Select()
+    Select();
+    ~Select();
+    void add(Socket *socket)
     {
-        if (pipe(mPipe) == -1) {
-            mPipe[0] = mPipe[1] = -1;
-        }
+        assert(!socket->mSelect);
+        socket->mSelect = this;
+        mSockets.insert(socket);
+        socket->changed();
     }
-    ~Select()
-    {
-        if (mPipe[0] != -1)
-            ::close(mPipe[0]);
-        if (mPipe[1] != -1)
-            ::close(mPipe[1]);
-        for (Socket *socket : mSockets) {
-            assert(socket->mSelect == this);
-            socket->mSelect = nullptr;
-        }
-    }
-    void add(Socket *socket) { assert(!socket->mSelect); socket->mSelect = this; mSockets.insert(socket); }
-    void remove(Socket *socket) { assert(socket->mSelect == this); socket->mSelect = nullptr; mSockets.erase(socket); }
+    void remove(Socket *socket);
+    bool contains(const Socket *socket) const { return socket->mSelect == this; }
 
-    int exec(int timeoutMs = -1) const;
+    int exec(int timeoutMs = -1);
     void wakeup();
 private:
+    friend struct Socket;
+    int execSelect(int timeoutMs);
     std::set<Socket *> mSockets;
+    std::vector<Socket *> mChanged;
+    std::vector<int> mTimeouts;
     int mPipe[2];
+#ifdef __linux__
+    struct Registration {
+        int fd { -1 };
+        unsigned int mode { Socket::None };
+        unsigned long long deadline { 0 };
+    };
+    int execEpoll(int timeoutMs);
+    bool update(Socket *socket, Registration &registration);
+    void unregister(Socket *socket, const Registration &registration);
+    void armTimer(unsigned long long deadline);
+
+    std::map<Socket *, Registration> mRegistrations;
+    int mEpoll { -1 };
+    int mEventFD { -1 };
+    int mTimerFD { -1 };
+    unsigned long long mTimerDeadline { 0 };
+#endif
 };
 
 inline void Socket::wakeup()
@@ -68,4 +92,12 @@ inline void Socket::wakeup()
     mSelect->wakeup();
 }
 
+inline void Socket::changed()
+{
+    if (mSelect && !mChanged) {
+        mChanged = true;
+        mSelect->mChanged.push_back(this);
+    }
+}
+
 #endif /* SELECT_H */
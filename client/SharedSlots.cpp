@@ -0,0 +1,276 @@
+#include "SharedSlots.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <mutex>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+    Magic = 0x66737334, // fss4
+    PollInterval = 100,
+    // pid_max can't go above 2^22, the rest of an owner is its start time
+    PidBits = 22
+};
+struct Header {
+    uint32_t magic;
+    uint32_t daemonPid;
+    // the inode of the daemon's pid namespace, pids from another one mean
+    // nothing to us
+    uint64_t pidNamespace;
+    uint32_t counts[2];
+    uint32_t generations[2];
+    // how many of the last slots of each pool the daemon has given to
+    // fiskcs that asked over the socket, only it writes these
+    uint32_t reserved[2];
+    // set by the daemon while memory pressure is over its limit
+    uint32_t cppPressure;
+    uint32_t unused;
+    // the daemon's memory budget for preprocessing, 0 for none
+    uint64_t cppBudget;
+    // what the holders of cpp slots expect, ours and the daemon's clients'
+    // which only it writes
+    uint64_t cppBytes;
+    uint64_t daemonCppBytes;
+    // a uint64_t for each cpp slot and compile slot, then the bytes of each
+    // cpp slot
+    uint64_t owners[1];
+};
+
+static Header *sHeader = nullptr;
+static uint64_t *sOwners[2] = { nullptr, nullptr };
+static uint64_t *sCppBytes = nullptr;
+// index + 1 of the slot we hold in each pool, the cpp one is acquired on
+// the preprocessing thread
+static std::mutex sMutex;
+static uint32_t sHeld[2] = { 0, 0 };
+
+// When pid started in clock ticks since boot, 0 if we can't tell
+static uint64_t startTime(uint32_t pid)
+{
+#ifdef __linux__
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char buf[1024];
+    const size_t read = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[read] = '\0';
+    // the command can have spaces and parentheses in it, starttime is the
+    // 20th field after it
+    const char *ch = strrchr(buf, ')');
+    for (int field=0; ch && field<20; ++field)
+        ch = strchr(ch + 1, ' ');
+    return ch ? strtoull(ch + 1, nullptr, 10) : 0;
+#else
+    (void)pid;
+    return 0;
+#endif
+}
+
+static uint64_t pidNamespace()
+{
+#ifdef __linux__
+    char buf[64];
+    const ssize_t len = readlink("/proc/self/ns/pid", buf, sizeof(buf) - 1);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    // pid:[4026531836]
+    const char *ch = strchr(buf, '[');
+    return ch ? strtoull(ch + 1, nullptr, 10) : 0;
+#else
+    return 0;
+#endif
+}
+
+// what goes in the slots we hold
+static uint64_t self()
+{
+    static const uint64_t ret = (startTime(getpid()) << PidBits) | static_cast<uint64_t>(getpid());
+    return ret;
+}
+
+bool SharedSlots::alive(uint64_t owner)
+{
+    const uint32_t pid = static_cast<uint32_t>(owner & ((1 << PidBits) - 1));
+    if (::kill(static_cast<pid_t>(pid), 0) && errno != EPERM)
+        return false;
+    // a new process that got the pid of one that had the slot
+    const uint64_t start = owner >> PidBits;
+    return !start || startTime(pid) == start;
+}
+
+bool SharedSlots::open()
+{
+    static bool opened = false;
+    if (opened)
+        return sHeader;
+    opened = true;
+
+    const std::string path = Config::socket.get() + ".slots";
+    int fd;
+    EINTRWRAP(fd, ::open(path.c_str(), O_RDWR|O_CLOEXEC));
+    if (fd == -1) {
+        // it's only for the daemon's user
+        DEBUG("No shared slots %s %d %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (!fstat(fd, &st) && static_cast<size_t>(st.st_size) >= offsetof(Header, owners))
+        data = mmap(nullptr, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret;
+    EINTRWRAP(ret, ::close(fd));
+    if (data == MAP_FAILED) {
+        DEBUG("Failed to mmap %s %d %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    Header *header = static_cast<Header *>(data);
+    if (header->magic != Magic
+        || (offsetof(Header, owners)
+            + ((static_cast<size_t>(header->counts[Cpp]) * 2) + header->counts[Compile]) * sizeof(uint64_t)) > static_cast<size_t>(st.st_size)
+        || header->pidNamespace != pidNamespace()
+        || !alive(header->daemonPid)) {
+        DEBUG("Can't use shared slots %s", path.c_str());
+        munmap(data, st.st_size);
+        return false;
+    }
+    sHeader = header;
+    sOwners[Cpp] = header->owners;
+    sOwners[Compile] = header->owners + header->counts[Cpp];
+    sCppBytes = sOwners[Compile] + header->counts[Compile];
+    DEBUG("Using shared slots %s, %u cpp %u compile", path.c_str(), header->counts[Cpp], header->counts[Compile]);
+    return true;
+}
+bool SharedSlots::reserveBytes(uint32_t slot, uint64_t bytes)
+{
+    // still there if we took it over from a process that's gone
+    const uint64_t stale = __atomic_exchange_n(&sCppBytes[slot], 0, __ATOMIC_RELAXED);
+    if (stale)
+        __atomic_sub_fetch(&sHeader->cppBytes, stale, __ATOMIC_SEQ_CST);
+    // The daemon adds its own and then looks at ours, the other way around
+    // here, so we can't both go over
+    const uint64_t others = (__atomic_fetch_add(&sHeader->cppBytes, bytes, __ATOMIC_SEQ_CST)
+                             + __atomic_load_n(&sHeader->daemonCppBytes, __ATOMIC_SEQ_CST));
+    const uint64_t budget = __atomic_load_n(&sHeader->cppBudget, __ATOMIC_RELAXED);
+    // with nothing else going it'll have to run sometime anyway
+    if (others
+        && ((budget && others + bytes > budget) || __atomic_load_n(&sHeader->cppPressure, __ATOMIC_RELAXED))) {
+        __atomic_sub_fetch(&sHeader->cppBytes, bytes, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    __atomic_store_n(&sCppBytes[slot], bytes, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool SharedSlots::take(Pool pool, bool reclaim, uint64_t bytes)
+{
+    const uint64_t us = self();
+    const uint32_t count = sHeader->counts[pool];
+    for (uint32_t i=0; i<count; ++i) {
+        if (i + __atomic_load_n(&sHeader->reserved[pool], __ATOMIC_SEQ_CST) >= count)
+            break;
+        uint64_t owner = __atomic_load_n(&sOwners[pool][i], __ATOMIC_RELAXED);
+        // a fiskc that crashed, or was killed, with the slot
+        if (owner && (!reclaim || alive(owner)))
+            continue;
+        if (!__atomic_compare_exchange_n(&sOwners[pool][i], &owner, us, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            continue;
+        // The daemon reserves, then looks at the slot. We take it, then look
+        // at what's reserved. One of us sees the other, if it's us we back
+        // off.
+        if (i + __atomic_load_n(&sHeader->reserved[pool], __ATOMIC_SEQ_CST) >= count) {
+            __atomic_store_n(&sOwners[pool][i], 0, __ATOMIC_RELEASE);
+            break;
+        }
+        // anyone waiting would be just as over the budget, they look again
+        // when something's released
+        if (pool == Cpp && !reserveBytes(i, bytes)) {
+            __atomic_store_n(&sOwners[pool][i], 0, __ATOMIC_RELEASE);
+            break;
+        }
+        std::unique_lock<std::mutex> lock(sMutex);
+        sHeld[pool] = i + 1;
+        return true;
+    }
+    return false;
+}
+
+bool SharedSlots::tryAcquire(Pool pool)
+{
+    return sHeader && take(pool, false, 0);
+}
+
+bool SharedSlots::acquire(Pool pool, unsigned long long timeout, uint64_t bytes)
+{
+    if (!sHeader)
+        return false;
+    const unsigned long long start = Client::mono();
+    bool reclaim = false;
+    while (true) {
+        // read before looking so a release in between wakes us right away
+        const uint32_t generation = __atomic_load_n(&sHeader->generations[pool], __ATOMIC_ACQUIRE);
+        if (take(pool, reclaim, bytes))
+            return true;
+        const unsigned long long elapsed = Client::mono() - start;
+        if (elapsed >= timeout || (reclaim && !alive(sHeader->daemonPid)))
+            return false;
+        // Slots held by pids that are gone are never released, they're
+        // looked for when nobody released anything for PollInterval. The
+        // daemon can't wake us up when memory pressure goes away either
+        const unsigned long long wait = std::min<unsigned long long>(timeout - elapsed, PollInterval);
+#ifdef __linux__
+        timespec ts = { static_cast<time_t>(wait / 1000), static_cast<long>((wait % 1000) * 1000000) };
+        reclaim = (syscall(SYS_futex, &sHeader->generations[pool], FUTEX_WAIT, generation, &ts, nullptr, 0) == -1
+                   && errno == ETIMEDOUT);
+#else
+        (void)generation;
+        usleep(static_cast<useconds_t>(std::min<unsigned long long>(wait, 10) * 1000));
+        reclaim = true;
+#endif
+    }
+}
+
+void SharedSlots::release(Pool pool)
+{
+    uint32_t held;
+    {
+        std::unique_lock<std::mutex> lock(sMutex);
+        held = sHeld[pool];
+        sHeld[pool] = 0;
+    }
+    if (!sHeader || !held)
+        return;
+    uint64_t us = self();
+    if (pool == Cpp) {
+        const uint64_t bytes = __atomic_exchange_n(&sCppBytes[held - 1], 0, __ATOMIC_RELAXED);
+        if (bytes)
+            __atomic_sub_fetch(&sHeader->cppBytes, bytes, __ATOMIC_SEQ_CST);
+    }
+    // someone decided we were gone, shouldn't happen
+    if (!__atomic_compare_exchange_n(&sOwners[pool][held - 1], &us, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+    __atomic_add_fetch(&sHeader->generations[pool], 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &sHeader->generations[pool], FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+void SharedSlots::releaseAll()
+{
+    release(Cpp);
+    release(Compile);
+}
@@ -0,0 +1,47 @@
+#ifndef SHAREDSLOTS_H
+#define SHAREDSLOTS_H
+
+#include <stdint.h>
+
+// cpp and compile slots taken straight from a file fisk-daemon lays out next
+// to its socket when it runs with --shared-slots, see daemon/sharedslots.js.
+// Only the daemon's user can open it. Each slot holds the pid and start time
+// of the fiskc that has it so one that's held by a process that's gone is
+// taken over, fiskcs in another pid namespace don't use it. Waiters sleep on
+// a futex per pool that releasing bumps and only look for slots held by
+// processes that are gone when nothing was released for a while. The daemon
+// hands the last slots of each pool to fiskcs that ask it over the socket,
+// the ones it has reserved aren't taken here. Preprocessing is admitted
+// against the daemon's memory budget too: each cpp slot has the bytes its
+// holder expects to produce, their sum is kept next to what the daemon's
+// own clients expect and the daemon says when there's memory pressure.
+class SharedSlots
+{
+public:
+    enum Pool {
+        Cpp,
+        Compile
+    };
+
+    // Whether there's a file from a daemon that's still running
+    static bool open();
+
+    // Waits at most timeout ms, or until the daemon goes away. bytes is how
+    // much preprocessed output a cpp slot is expected to produce, 0 if we
+    // don't know
+    static bool acquire(Pool pool, unsigned long long timeout, uint64_t bytes = 0);
+    static bool tryAcquire(Pool pool);
+    static void release(Pool pool);
+    // Everything this process holds, for when it's about to exit
+    static void releaseAll();
+private:
+    // reclaim takes over slots of processes that are gone, that has to
+    // look at each of them in /proc
+    static bool take(Pool pool, bool reclaim, uint64_t bytes);
+    // false if bytes don't fit next to what everyone else is preprocessing
+    static bool reserveBytes(uint32_t slot, uint64_t bytes);
+    // owner is a pid and, where we can tell, when it started
+    static bool alive(uint64_t owner);
+};
+
+#endif /* SHAREDSLOTS_H */
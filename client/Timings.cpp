@@ -0,0 +1,164 @@
+#include "Timings.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Timings::File *Timings::file()
+{
+    // the preprocessing thread records sizes
+    static File *const file = open();
+    return file;
+}
+
+Timings::File *Timings::open()
+{
+    const std::string dir = Config::cacheDir;
+    if (dir.empty() || !Client::recursiveMkdir(dir))
+        return nullptr;
+    const std::string path = dir + "timings";
+    int fd;
+    EINTRWRAP(fd, ::open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR));
+    if (fd == -1) {
+        DEBUG("Failed to open %s %d %s", path.c_str(), errno, strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (static_cast<size_t>(st.st_size) < sizeof(File) && ftruncate(fd, sizeof(File)))) {
+        DEBUG("Failed to size %s %d %s", path.c_str(), errno, strerror(errno));
+        int ret;
+        EINTRWRAP(ret, ::close(fd));
+        return nullptr;
+    }
+    File *file;
+    void *data = mmap(nullptr, sizeof(File), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret;
+    EINTRWRAP(ret, ::close(fd));
+    if (data == MAP_FAILED) {
+        DEBUG("Failed to mmap %s %d %s", path.c_str(), errno, strerror(errno));
+        return nullptr;
+    }
+    file = static_cast<File *>(data);
+    if (__atomic_load_n(&file->magic, __ATOMIC_ACQUIRE) != Magic || file->size != sizeof(File)) {
+        // new, or from a fiskc that laid it out differently
+        memset(file->histograms, 0, sizeof(file->histograms));
+        memset(file->cppSizes, 0, sizeof(file->cppSizes));
+        file->size = sizeof(File);
+        __atomic_store_n(&file->magic, Magic, __ATOMIC_RELEASE);
+    }
+    return file;
+}
+
+Timings::Histogram &Timings::histogram(File *file, Watchdog::Stage stage, size_t cppSize)
+{
+    size_t size = 0;
+    if (stage == Watchdog::UploadedJob || stage == Watchdog::Finished) {
+        for (size_t limit = 64 * 1024; size + 1 < SizeBuckets && cppSize >= limit; limit *= 4)
+            ++size;
+    }
+    return file->histograms[stage][size];
+}
+
+size_t Timings::bucket(unsigned long long ms)
+{
+    if (ms <= 1)
+        return 0;
+    return std::min<size_t>(Buckets - 1, static_cast<size_t>(log2(static_cast<double>(ms)) * 2));
+}
+
+unsigned long long Timings::bucketLimit(size_t bucket)
+{
+    return static_cast<unsigned long long>(ceil(pow(2.0, (bucket + 1) / 2.0)));
+}
+
+void Timings::record(const Watchdog &watchdog, size_t cppSize)
+{
+    File *f = file();
+    if (!f)
+        return;
+    // timings are in the order of stages, which depends on the object cache
+    for (size_t i=1; i<watchdog.stages.size(); ++i) {
+        if (!watchdog.timings[i] || watchdog.timings[i] < watchdog.timings[i - 1])
+            continue;
+        Histogram &h = histogram(f, watchdog.stages[i], cppSize);
+        __atomic_fetch_add(&h.counts[bucket(watchdog.timings[i] - watchdog.timings[i - 1])], 1, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&h.samples, 1, __ATOMIC_RELAXED) >= MaxSamples) {
+            uint32_t samples = 0;
+            for (uint32_t &count : h.counts) {
+                const uint32_t halved = __atomic_load_n(&count, __ATOMIC_RELAXED) / 2;
+                __atomic_store_n(&count, halved, __ATOMIC_RELAXED);
+                samples += halved;
+            }
+            __atomic_store_n(&h.samples, samples, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+unsigned long long Timings::percentile(Watchdog::Stage stage, size_t cppSize, double fraction)
+{
+    File *f = file();
+    if (!f)
+        return 0;
+    const Histogram &h = histogram(f, stage, cppSize);
+    uint32_t counts[Buckets];
+    uint64_t total = 0;
+    for (size_t i=0; i<Buckets; ++i) {
+        counts[i] = __atomic_load_n(&h.counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (total < MinSamples)
+        return 0;
+    const double wanted = fraction * static_cast<double>(total);
+    uint64_t seen = 0;
+    for (size_t i=0; i<Buckets; ++i) {
+        seen += counts[i];
+        if (static_cast<double>(seen) >= wanted)
+            return bucketLimit(i);
+    }
+    return bucketLimit(Buckets - 1);
+}
+
+uint32_t Timings::hash(const std::string &sourceFile)
+{
+    std::string path;
+    if (sourceFile.empty() || sourceFile[0] != '/')
+        path = Client::cwd() + '/';
+    path += sourceFile;
+    // fnv-1a, never 0 so that can mean unused
+    uint32_t ret = 2166136261u;
+    for (char ch : path) {
+        ret ^= static_cast<unsigned char>(ch);
+        ret *= 16777619u;
+    }
+    return ret ? ret : 1;
+}
+
+void Timings::recordCppSize(const std::string &sourceFile, size_t cppSize)
+{
+    File *f = file();
+    if (!f)
+        return;
+    const uint32_t h = hash(sourceFile);
+    const uint32_t kilobytes = static_cast<uint32_t>(std::min<size_t>((cppSize + 1023) / 1024, UINT32_MAX));
+    // a racing reader might see one's hash with another's size, it's only
+    // a guess anyway
+    __atomic_store_n(&f->cppSizes[h % CppSizes].kilobytes, kilobytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->cppSizes[h % CppSizes].hash, h, __ATOMIC_RELAXED);
+}
+
+size_t Timings::cppSize(const std::string &sourceFile)
+{
+    File *f = file();
+    if (!f)
+        return 0;
+    const uint32_t h = hash(sourceFile);
+    if (__atomic_load_n(&f->cppSizes[h % CppSizes].hash, __ATOMIC_RELAXED) != h)
+        return 0;
+    return static_cast<size_t>(__atomic_load_n(&f->cppSizes[h % CppSizes].kilobytes, __ATOMIC_RELAXED)) * 1024;
+}
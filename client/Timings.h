@@ -0,0 +1,61 @@
+#ifndef TIMINGS_H
+#define TIMINGS_H
+
+#include "Watchdog.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// How long each Watchdog stage took for earlier jobs, shared by every fiskc
+// through a small mmap'd file under Config::cacheDir. Each stage has a
+// histogram of log scale buckets, the upload and response stages have one
+// per preprocessed size since those depend on it. Counts are only ever
+// incremented, halved when a histogram fills up so old jobs fade out, so a
+// racing update costs a sample, not the file. It also remembers how big the
+// preprocessed output of recently built sources was.
+class Timings
+{
+public:
+    // A job that got all the way through a builder
+    static void record(const Watchdog &watchdog, size_t cppSize);
+
+    // How long fraction of the earlier jobs took to get through stage, 0 if
+    // there aren't enough of them to tell
+    static unsigned long long percentile(Watchdog::Stage stage, size_t cppSize, double fraction);
+
+    static void recordCppSize(const std::string &sourceFile, size_t cppSize);
+    // The last one recorded for sourceFile, 0 if we don't know
+    static size_t cppSize(const std::string &sourceFile);
+private:
+    enum {
+        Magic = 0x66746d32, // ftm2
+        Buckets = 48, // half powers of two, 1ms to ~4.6 hours
+        SizeBuckets = 8, // powers of four from 64K
+        MaxSamples = 2048,
+        MinSamples = 20,
+        CppSizes = 4096
+    };
+    struct Histogram {
+        uint32_t samples;
+        uint32_t counts[Buckets];
+    };
+    struct File {
+        uint32_t magic;
+        uint32_t size;
+        Histogram histograms[Watchdog::Finished + 1][SizeBuckets];
+        // by hash of the source's path, a collision overwrites
+        struct {
+            uint32_t hash;
+            uint32_t kilobytes;
+        } cppSizes[CppSizes];
+    };
+
+    static File *file();
+    static File *open();
+    static uint32_t hash(const std::string &sourceFile);
+    static Histogram &histogram(File *file, Watchdog::Stage stage, size_t cppSize);
+    static size_t bucket(unsigned long long ms);
+    static unsigned long long bucketLimit(size_t bucket);
+};
+
+#endif /* TIMINGS_H */
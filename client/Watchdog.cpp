@@ -2,6 +2,10 @@
 #include "Config.h"
 #include "Client.h"
 #include "Log.h"
+#include "Preprocessed.h"
+#include "Timings.h"
+#include <algorithm>
+#include <climits>
 
 Watchdog::Watchdog()
     : mState(Config::watchdog ? Running : Stopped)
@@ -26,6 +30,52 @@ void Watchdog::transition(Stage stage)
     assert(stages[mStage + 1] == stage);
     ++mStage;
     mTransitionTime = Client::mono();
+    changed();
+}
+
+void Watchdog::rewind(Stage stage)
+{
+    std::unique_lock<std::mutex> lock(Client::mutex());
+    size_t idx = 1;
+    while (idx < stages.size() && stages[idx] != stage)
+        ++idx;
+    assert(idx < stages.size());
+    if (mStage >= idx)
+        mStage = idx - 1;
+    DEBUG("Watchdog rewound to waiting for %s", stageName(stage));
+    mTransitionTime = Client::mono();
+    mState = Config::watchdog ? Running : Stopped;
+    changed();
+}
+
+bool Watchdog::retry(Stage stage)
+{
+    if (!Config::watchdog)
+        return true;
+    std::unique_lock<std::mutex> lock(Client::mutex());
+    size_t idx = 1;
+    while (idx < stages.size() && stages[idx] != stage)
+        ++idx;
+    assert(idx < stages.size());
+    if (!mDeadline) {
+        // everything the first try was allowed from when it started waiting
+        // for stage. Preprocessing isn't done again
+        mDeadline = timings[idx - 1];
+        for (size_t i=idx; i<stages.size(); ++i) {
+            if (stages[i] != PreprocessFinished)
+                mDeadline += stageTimeout(stages[i]);
+        }
+    }
+    const unsigned long long now = Client::mono();
+    if (now >= mDeadline)
+        return false;
+    if (mStage >= idx)
+        mStage = idx - 1;
+    DEBUG("Watchdog rewound to waiting for %s, %llu ms left", stageName(stage), mDeadline - now);
+    mTransitionTime = now;
+    mState = Running;
+    changed();
+    return true;
 }
 
 Watchdog::Stage Watchdog::currentStage() const
@@ -38,6 +88,7 @@ void Watchdog::stop()
 {
     if (mState == Running)
         mState = Stopped;
+    changed();
 }
 
 int Watchdog::timeout()
@@ -45,42 +96,68 @@ int Watchdog::timeout()
     if (mState != Running || stages[mStage] == Finished)
         return -1;
     const unsigned long long now = Client::mono();
-    mTimeoutTime = mTransitionTime;
-    switch (stages[mStage + 1]) {
+    mTimeoutTime = mTransitionTime + stageTimeout(stages[mStage + 1]);
+    if (mDeadline)
+        mTimeoutTime = std::min(mTimeoutTime, mDeadline);
+    if (now >= mTimeoutTime) {
+        DEBUG("Already timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
+        return 0;
+    }
+    VERBOSE("Setting watchdog timeout to %llu (%llu/%llu) waiting for %s",
+            mTimeoutTime - now,
+            mTimeoutTime, now,
+            stageName(static_cast<Stage>(mStage + 1)));
+    return static_cast<int>(mTimeoutTime - now);
+}
+
+unsigned long long Watchdog::stageTimeout(Stage stage)
+{
+    unsigned long long timeout = 0;
+    switch (stage) {
     case Initial:
         assert(0);
         break;
     case ConnectedToDaemon:
-        mTimeoutTime += Config::daemonConnectTimeout;
+        timeout = Config::daemonConnectTimeout;
         break;
     case ConnectedToScheduler:
-        mTimeoutTime += Config::schedulerConnectTimeout;
+        timeout = Config::schedulerConnectTimeout;
         break;
     case PreprocessFinished:
-        mTimeoutTime += Config::preprocessTimeout;
+        timeout = Config::preprocessTimeout;
         break;
     case AcquiredBuilder:
-        mTimeoutTime += Config::acquiredBuilderTimeout;
+        timeout = Config::acquiredBuilderTimeout;
         break;
     case ConnectedToBuilder:
-        mTimeoutTime += Config::builderConnectTimeout;
+        timeout = Config::builderConnectTimeout;
         break;
     case UploadedJob:
-        mTimeoutTime += Config::uploadJobTimeout;
+        timeout = Config::uploadJobTimeout;
         break;
     case Finished:
-        mTimeoutTime += Config::responseTimeout;
+        timeout = Config::responseTimeout;
         break;
     }
-    if (now >= mTimeoutTime) {
-        DEBUG("Already timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
-        return 0;
+    if (!Config::adaptiveWatchdog)
+        return timeout;
+
+    // p99 of how long the stage took for earlier jobs, the configured
+    // timeouts are the most we wait. Looked up once per stage, the sizes
+    // are known by the time the upload and response stages are next
+    if (!mAdaptive[stage]) {
+        const std::unique_ptr<Preprocessed> &preprocessed = Client::data().preprocessed;
+        unsigned long long adaptive = Timings::percentile(stage, preprocessed ? preprocessed->cppSize : 0, 0.99);
+        if (adaptive) {
+            adaptive = std::max<unsigned long long>(adaptive * Config::adaptiveWatchdogFactor, Config::adaptiveWatchdogMinimum);
+            // it only has to last until the next heartbeat
+            if (stage == Finished)
+                adaptive = std::max<unsigned long long>(adaptive, HeartbeatInterval * 2);
+            DEBUG("Adaptive timeout for %s is %llu (configured %llu)", stageName(stage), adaptive, timeout);
+        }
+        mAdaptive[stage] = adaptive ? adaptive : ULLONG_MAX;
     }
-    VERBOSE("Setting watchdog timeout to %llu (%llu/%llu) waiting for %s",
-            mTimeoutTime - now,
-            mTimeoutTime, now,
-            stageName(static_cast<Stage>(mStage + 1)));
-    return static_cast<int>(mTimeoutTime - now);
+    return std::min(timeout, mAdaptive[stage]);
 }
 
 void Watchdog::onTimeout()
@@ -95,5 +172,6 @@ void Watchdog::onTimeout()
 void Watchdog::heartbeat()
 {
     mTransitionTime = Client::mono();
+    changed();
     wakeup();
 }
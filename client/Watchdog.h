@@ -42,6 +42,12 @@ public:
         return "";
     }
     void transition(Stage stage);
+    // Back to waiting for stage with its full timeout
+    void rewind(Stage stage);
+    // Back to waiting for stage to start over with another builder. All
+    // tries share the deadline the first one had from stage on, false if
+    // there's nothing left of it
+    bool retry(Stage stage);
     void heartbeat();
     void stop();
     bool timedOut() const { return mState == TimedOut; }
@@ -54,6 +60,9 @@ protected:
     virtual void onTimeout() override;
     virtual int timeout() override;
 private:
+    enum { HeartbeatInterval = 5000 }; // fisk-builder's
+    unsigned long long stageTimeout(Stage stage);
+
     size_t mStage { 0 };
     enum State {
         Running,
@@ -63,6 +72,11 @@ private:
     } mState { Running };
     unsigned long long mTransitionTime { Client::mono() };
     unsigned long long mTimeoutTime { 0 };
+    // set by the first retry()
+    unsigned long long mDeadline { 0 };
+    // from Timings with adaptive-watchdog, ULLONG_MAX if there's not enough
+    // history
+    unsigned long long mAdaptive[Finished + 1] { 0 };
 };
 
 #endif /* WATCHDOG_H */
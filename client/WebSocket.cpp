@@ -12,7 +12,18 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static inline std::string create_acceptkey(const std::string& clientkey)
 {
@@ -20,23 +31,74 @@ static inline std::string create_acceptkey(const std::string& clientkey)
     return Client::base64(Client::sha1(s));
 }
 
-static inline size_t random(void *data, size_t len)
+static inline bool random(void *data, size_t len)
 {
-    FILE *f = fopen("/dev/urandom", "r");
-    if (!f) {
-        ERROR("Can't open /dev/urandom for reading %d %s", errno, strerror(errno));
-        return 0;
+#ifdef __APPLE__
+    arc4random_buf(data, len);
+    return true;
+#else
+    unsigned char *out = static_cast<unsigned char *>(data);
+#ifdef SYS_getrandom
+    while (len) {
+        const long ret = syscall(SYS_getrandom, out, len, 0);
+        if (ret > 0) {
+            out += ret;
+            len -= ret;
+        } else if (errno == ENOSYS) {
+            break; // kernel older than 3.17
+        } else if (errno != EINTR) {
+            ERROR("getrandom failed %d %s", errno, strerror(errno));
+            return false;
+        }
+    }
+    if (!len)
+        return true;
+#endif
+    static int fd = -1;
+    if (fd == -1) {
+        EINTRWRAP(fd, open("/dev/urandom", O_RDONLY|O_CLOEXEC));
+        if (fd == -1) {
+            ERROR("Can't open /dev/urandom for reading %d %s", errno, strerror(errno));
+            return false;
+        }
     }
 
     ssize_t ret;
-    EINTRWRAP(ret, read(fileno(f), data, len));
-    if (ret != static_cast<int>(len)) {
+    EINTRWRAP(ret, read(fd, out, len));
+    if (ret != static_cast<ssize_t>(len)) {
         ERROR("Can't read from /dev/urandom %d %s", errno, strerror(errno));
-        return 0;
+        return false;
+    }
+    return true;
+#endif
+}
+
+// XOR the 4 byte masking key over data, data[0] gets key[0]
+static inline void mask(unsigned char *data, size_t len, const unsigned char *key)
+{
+    uint32_t key32;
+    memcpy(&key32, key, sizeof(key32));
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i key128 = _mm_set1_epi32(static_cast<int>(key32));
+    for (; i + 16 <= len; i += 16) {
+        __m128i *p = reinterpret_cast<__m128i *>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for (; i + 16 <= len; i += 16)
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), key128));
+#endif
+    const uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= key64;
+        memcpy(data + i, &word, sizeof(word));
     }
-    const size_t r = ret;
-    EINTRWRAP(ret, fclose(f));
-    return r;
+    for (; i < len; ++i)
+        data[i] ^= key[i & 3];
 }
 
 WebSocket::WebSocket()
@@ -50,42 +112,73 @@ WebSocket::WebSocket()
             wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
             return -1;
         }
-        const ssize_t ret = std::min<ssize_t>(ws->mRecvBuffer.size(), len);
-        memcpy(buf, &ws->mRecvBuffer[0], ret);
-        ws->mRecvBuffer.erase(ws->mRecvBuffer.begin(), ws->mRecvBuffer.begin() + ret);
-        return ret;
+        return ws->mRecvBuffer.read(buf, len);
     };
 
-    mCallbacks.send_callback = [](wslay_event_context */*ctx*/,
+    // frames go straight to the socket, wslay holds on to whatever the
+    // kernel doesn't take and retries when we're writable
+    mCallbacks.send_callback = [](wslay_event_context *ctx,
                                   const uint8_t *data, size_t len,
-                                  int /*flags*/, void *user_data) -> ssize_t {
+                                  int flags, void *user_data) -> ssize_t {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        ws->mSendBuffer.resize(ws->mSendBuffer.size() + len);
-        memcpy(&ws->mSendBuffer[ws->mSendBuffer.size() - len], data, len);
-        return len;
+        int sendFlags = 0;
+#ifdef MSG_MORE
+        if (flags & WSLAY_MSG_MORE)
+            sendFlags |= MSG_MORE;
+#else
+        (void)flags;
+#endif
+        ssize_t r;
+        EINTRWRAP(r, ::send(ws->mFD, data, len, sendFlags));
+        VERBOSE("Wrote %zd bytes", r);
+        if (r == -1) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+            } else {
+                ERROR("Got write error: %d %s for websocket %s at stage: %s",
+                      errno, strerror(errno), ws->mUrl.c_str(),
+                      Watchdog::stageName(Client::data().watchdog->currentStage()));
+                wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+            }
+        }
+        return r;
     };
     mCallbacks.genmask_callback = [](wslay_event_context *,
                                      uint8_t *buf, size_t len,
                                      void *) -> int {
-        return random(buf, len) == len ? 0 : -1;
+        return random(buf, len) ? 0 : -1;
     };
-    mCallbacks.on_msg_recv_callback = [](wslay_event_context *ctx,
-                                         const struct wslay_event_on_msg_recv_arg *arg,
-                                         void *user_data) -> void {
+    // wslay doesn't buffer data messages for us (no_buffering), binary
+    // payload is handed on as it's parsed and text is collected here
+    mCallbacks.on_frame_recv_start_callback = [](wslay_event_context *,
+                                                 const struct wslay_event_on_frame_recv_start_arg *arg,
+                                                 void *user_data) -> void {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        assert(ws);
-        switch (arg->opcode) {
-        case WSLAY_TEXT_FRAME:
-            ws->onMessage(Text, arg->msg, arg->msg_length);
-            break;
-        case WSLAY_BINARY_FRAME:
-            ws->onMessage(Binary, arg->msg, arg->msg_length);
-            break;
-        case WSLAY_PING:
-        case WSLAY_PONG:
-        case WSLAY_CONTINUATION_FRAME:
-            wslay_event_send(ctx);
-            break;
+        ws->mFrameOpcode = arg->opcode;
+        ws->mFrameFin = arg->fin;
+        if (!wslay_is_ctrl_frame(arg->opcode) && arg->opcode != WSLAY_CONTINUATION_FRAME) {
+            ws->mMessageOpcode = arg->opcode;
+            ws->mTextMessage.clear();
+        }
+    };
+    mCallbacks.on_frame_recv_chunk_callback = [](wslay_event_context *,
+                                                 const struct wslay_event_on_frame_recv_chunk_arg *arg,
+                                                 void *user_data) -> void {
+        WebSocket *ws = static_cast<WebSocket *>(user_data);
+        if (wslay_is_ctrl_frame(ws->mFrameOpcode))
+            return;
+        if (ws->mMessageOpcode == WSLAY_TEXT_FRAME) {
+            ws->mTextMessage.append(reinterpret_cast<const char *>(arg->data), arg->data_length);
+        } else if (ws->mMessageOpcode == WSLAY_BINARY_FRAME) {
+            ws->onMessage(Binary, arg->data, arg->data_length);
+        }
+    };
+    mCallbacks.on_frame_recv_end_callback = [](wslay_event_context *, void *user_data) -> void {
+        WebSocket *ws = static_cast<WebSocket *>(user_data);
+        if (!wslay_is_ctrl_frame(ws->mFrameOpcode) && ws->mFrameFin && ws->mMessageOpcode == WSLAY_TEXT_FRAME) {
+            std::string message;
+            std::swap(message, ws->mTextMessage);
+            ws->onMessage(Text, message.c_str(), message.size());
         }
     };
 }
@@ -100,8 +193,10 @@ WebSocket::~WebSocket()
     }
 }
 
-bool WebSocket::connect(std::string &&uniformResourceLocator, const std::map<std::string, std::string> &hdrs)
+bool WebSocket::connect(std::string &&uniformResourceLocator, const std::map<std::string, std::string> &hdrs,
+                        const std::string &unixSocket)
 {
+    changed();
     mUrl = std::move(uniformResourceLocator);
     mHeaders = std::move(hdrs);
     mParsedUrl = LUrlParser::clParseURL::ParseURL(mUrl);
@@ -124,6 +219,9 @@ bool WebSocket::connect(std::string &&uniformResourceLocator, const std::map<std
     if (!mPort)
         mPort = 80;
 
+    if (!unixSocket.empty())
+        return connectUnix(unixSocket);
+
     addrinfo *res = nullptr;
     addrinfo stackRes;
     in_addr literal;
@@ -213,11 +311,59 @@ bool WebSocket::connect(std::string &&uniformResourceLocator, const std::map<std
     return requestUpgrade();
 }
 
+bool WebSocket::connectUnix(const std::string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() + 1 > sizeof(addr.sun_path)) {
+        ERROR("Socket path is too long %zu > %zu", path.size(), sizeof(addr.sun_path) - 1);
+        mState = Error;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    mFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFD == -1) {
+        ERROR("Failed to create socket %d %s", errno, strerror(errno));
+        mState = Error;
+        return false;
+    }
+
+    int ret;
+    if (!Client::setFlag(mFD, O_NONBLOCK|O_CLOEXEC)) {
+        ERROR("Failed to make socket non blocking %d %s", errno, strerror(errno));
+        EINTRWRAP(ret, ::close(mFD));
+        mFD = -1;
+        mState = Error;
+        return false;
+    }
+
+    EINTRWRAP(ret, ::connect(mFD, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+    if (!ret) {
+        DEBUG("Connected to %s for %s:%d", path.c_str(), mHost.c_str(), mPort);
+        mState = ConnectedTCP;
+        return requestUpgrade();
+    } else if (errno != EINPROGRESS) {
+        ERROR("Failed to connect to %s for %s:%d %d %s", path.c_str(), mHost.c_str(), mPort, errno, strerror(errno));
+        int cret;
+        EINTRWRAP(cret, ::close(mFD));
+        mFD = -1;
+        mState = Error;
+        return false;
+    }
+    mState = ConnectingTCP;
+    return true;
+}
+
 bool WebSocket::requestUpgrade()
 {
     assert(mState == ConnectedTCP);
     std::string random(16, ' ');
-    ::random(&random[0], random.size());
+    if (!::random(&random[0], random.size())) {
+        mState = Error;
+        return false;
+    }
     mClientKey = Client::base64(random);
 
     {
@@ -242,27 +388,28 @@ bool WebSocket::requestUpgrade()
         DEBUG("Sending headers:\n%s", reqHeader);
 
         assert(mSendBuffer.empty());
-        mSendBuffer = std::vector<unsigned char>(reqHeader, reqHeader + reqHeaderSize);
+        mSendBuffer.assign(reqHeader, reqHeaderSize);
         mState = WaitingForUpgrade;
     }
-    send();
+    sendHandshake();
     return mState != Error;
 }
 
 void WebSocket::acceptUpgrade()
 {
     DEBUG("Accept upgrade %zu bytes", mRecvBuffer.size());
-    char *ch = reinterpret_cast<char *>(&mRecvBuffer[0]);
-    std::string headers;
-    for (size_t i=0; i<mRecvBuffer.size() - 3; ++i) {
-        if (!strncmp(ch, "\r\n\r\n", 4)) {
-            headers.assign(reinterpret_cast<char *>(&mRecvBuffer[0]), i + 4);
-            mRecvBuffer.erase(mRecvBuffer.begin(), mRecvBuffer.begin() + i + 4);
-            break;
+    std::string headers = mRecvBuffer.toString();
+    const size_t end = headers.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (mRecvBuffer.full()) {
+            ERROR("http_upgrade: response headers too large");
+            mState = Error;
         }
-        ++ch;
+        return;
     }
-    if (!headers.empty()) {
+    headers.resize(end + 4);
+    mRecvBuffer.consume(headers.size());
+    {
         mHandshakeResponseHeaders = Client::split(headers, "\r\n");
         // for (size_t i=0; i<mHandshakeResponseHeaders.size(); ++i) {
         //     printf("%zu/%zu: %s\n", i, mHandshakeResponseHeaders.size(), mHandshakeResponseHeaders[i].c_str());
@@ -293,6 +440,7 @@ void WebSocket::acceptUpgrade()
         return;
     }
     assert(mContext);
+    wslay_event_config_set_no_buffering(mContext, 1);
     mState = ConnectedWebSocket;
     onConnected();
 }
@@ -301,20 +449,200 @@ bool WebSocket::send(MessageType type, const void *msg, size_t len)
 {
     assert(msg);
     assert(len);
-    assert(this);
+    return send(type, std::string(reinterpret_cast<const char *>(msg), len));
+}
+
+// Writes the start of a masked frame header, the mask key goes at the
+// returned offset
+static size_t frameHeader(unsigned char *header, WebSocket::MessageType type, uint64_t len)
+{
+    header[0] = 0x80 | (type == WebSocket::Text ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME);
+    if (len < 126) {
+        header[1] = 0x80 | len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        header[1] = 0x80 | 126;
+        header[2] = len >> 8;
+        header[3] = len;
+        return 4;
+    }
+    header[1] = 0x80 | 127;
+    for (int i=0; i<8; ++i)
+        header[2 + i] = len >> (56 - (i * 8));
+    return 10;
+}
+
+bool WebSocket::send(MessageType type, std::string &&msg)
+{
+    assert(!msg.empty());
+    assert(mContext);
+    mPayloads.emplace_back();
+    Payload &payload = mPayloads.back();
+    payload.data = std::move(msg);
+
+    // Data frames are framed and masked here rather than by wslay which
+    // masks a byte at a time into its own buffer. wslay still does the
+    // control frames, flush() makes sure they don't end up inside ours.
+    const uint64_t len = payload.data.size();
+    const size_t headerLength = frameHeader(payload.header, type, len);
+    if (!random(payload.header + headerLength, 4)) {
+        mPayloads.pop_back();
+        return false;
+    }
+    mask(reinterpret_cast<unsigned char *>(&payload.data[0]), len, payload.header + headerLength);
+    payload.headerLength = headerLength + 4;
+    return flush();
+}
+
+bool WebSocket::send(int fd, off_t offset, size_t len)
+{
+    assert(len);
     assert(mContext);
-    wslay_event_msg wmsg = {
-        static_cast<uint8_t>(type == Text ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME),
-        reinterpret_cast<const uint8_t *>(msg),
-        len
-    };
-    return !wslay_event_queue_msg(mContext, &wmsg) && !wslay_event_send(mContext);
+#ifdef __linux__
+    // RFC 6455 wants an unpredictable mask key, to keep browser scripts
+    // from steering what intermediaries see. A zero key still unmasks fine
+    // so callers use this with peers that agreed to it, see raw-stream.
+    mPayloads.emplace_back();
+    Payload &payload = mPayloads.back();
+    payload.fd = fd;
+    payload.fileOffset = offset;
+    payload.fileLength = len;
+    const size_t headerLength = frameHeader(payload.header, Binary, len);
+    memset(payload.header + headerLength, 0, 4);
+    payload.headerLength = headerLength + 4;
+    return flush();
+#else
+    std::string data(len, '\0');
+    for (size_t got = 0; got < len; ) {
+        ssize_t r;
+        EINTRWRAP(r, ::pread(fd, &data[got], len - got, offset + got));
+        if (r <= 0) {
+            ERROR("Failed to read %zu bytes from %d (%d %s)", len, fd, errno, strerror(errno));
+            return false;
+        }
+        got += r;
+    }
+    return send(Binary, std::move(data));
+#endif
 }
 
 void WebSocket::close(const char *reason)
 {
-    wslay_event_queue_close(mContext, 1000, reinterpret_cast<const uint8_t *>(reason), reason ? strlen(reason) : 0);
-    wslay_event_send(mContext);
+    mCloseReason = reason ? reason : "";
+    mClosePending = true;
+    flush();
+}
+
+bool WebSocket::flush()
+{
+    changed();
+    if (mState != ConnectedWebSocket)
+        return false;
+    while (true) {
+        // wslay may only write between our frames
+        const bool midFrame = !mPayloads.empty() && mPayloads.front().offset;
+        if (!midFrame && wslay_event_want_write(mContext)) {
+            if (wslay_event_send(mContext)) {
+                ERROR("Got wslay_event_send error for websocket %s", mUrl.c_str());
+                mState = Error;
+                return false;
+            }
+            if (wslay_event_want_write(mContext))
+                return true;
+        }
+        if (mPayloads.empty()) {
+            if (!mClosePending)
+                return true;
+            mClosePending = false;
+            wslay_event_queue_close(mContext, 1000, reinterpret_cast<const uint8_t *>(mCloseReason.c_str()), mCloseReason.size());
+            continue;
+        }
+        if (!writePayloads())
+            return false;
+        if (!mPayloads.empty())
+            return true;
+    }
+}
+
+bool WebSocket::writePayloads()
+{
+    enum { MaxVecs = 64 };
+    while (!mPayloads.empty()) {
+        ssize_t r;
+#ifdef __linux__
+        Payload &front = mPayloads.front();
+        if (front.fd != -1 && front.offset >= front.headerLength) {
+            const size_t sent = front.offset - front.headerLength;
+            off_t offset = front.fileOffset + sent;
+            EINTRWRAP(r, ::sendfile(mFD, front.fd, &offset, front.fileLength - sent));
+            VERBOSE("Sent %zd bytes from file", r);
+            if (!r) {
+                ERROR("Unexpected end of file sending %zu bytes from %d", front.fileLength, front.fd);
+                mState = Error;
+                return false;
+            }
+        } else
+#endif
+        {
+            iovec vecs[MaxVecs];
+            int count = 0;
+            int flags = 0;
+            for (auto it = mPayloads.begin(); it != mPayloads.end() && count + 2 <= MaxVecs; ++it) {
+                size_t offset = it->offset;
+                if (offset < it->headerLength) {
+                    vecs[count].iov_base = it->header + offset;
+                    vecs[count++].iov_len = it->headerLength - offset;
+                    offset = 0;
+                } else {
+                    offset -= it->headerLength;
+                }
+                if (it->fd != -1) {
+                    // the body goes out with sendfile() next
+#ifdef MSG_MORE
+                    flags |= MSG_MORE;
+#endif
+                    break;
+                }
+                if (offset < it->data.size()) {
+                    vecs[count].iov_base = &it->data[offset];
+                    vecs[count++].iov_len = it->data.size() - offset;
+                }
+            }
+
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = vecs;
+            msg.msg_iovlen = count;
+            EINTRWRAP(r, ::sendmsg(mFD, &msg, flags));
+            VERBOSE("Wrote %zd bytes", r);
+        }
+        if (r == -1) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                return true;
+            ERROR("Got write error: %d %s for websocket %s at stage: %s",
+                  errno, strerror(errno), mUrl.c_str(),
+                  Watchdog::stageName(Client::data().watchdog->currentStage()));
+            mState = Error;
+            return false;
+        }
+        consumePayloads(r);
+    }
+    return true;
+}
+
+void WebSocket::consumePayloads(size_t bytes)
+{
+    while (bytes) {
+        Payload &front = mPayloads.front();
+        const size_t remaining = front.length() - front.offset;
+        if (bytes < remaining) {
+            front.offset += bytes;
+            break;
+        }
+        bytes -= remaining;
+        mPayloads.pop_front();
+    }
 }
 
 unsigned int WebSocket::mode() const
@@ -336,7 +664,7 @@ unsigned int WebSocket::mode() const
         break;
     case ConnectedWebSocket:
         ret |= Read;
-        if (wslay_event_want_write(mContext) || !mSendBuffer.empty())
+        if (!mPayloads.empty() || wslay_event_want_write(mContext))
             ret |= Write;
         break;
     }
@@ -370,63 +698,67 @@ void WebSocket::onWrite()
 
         DEBUG("Asynchronously connected to host %s:%d", mHost.c_str(), mPort);
         mState = ConnectedTCP;
-        if (!requestUpgrade())
-            return;
+        requestUpgrade();
+        return;
+    }
+    if (mState == ConnectedWebSocket) {
+        flush();
+    } else {
+        sendHandshake();
     }
-    send();
 }
 
 void WebSocket::onRead()
 {
-    const bool sendBufferWasEmpty = mSendBuffer.empty();
     while (true) {
-        char buf[BUFSIZ];
-        const ssize_t r = ::read(mFD, buf, sizeof(buf));
-        VERBOSE("Read %zd bytes", r);
-        if (!r) {
-            mState = Closed;
-            break;
-        } else if (r > 0) {
-            mRecvBuffer.insert(mRecvBuffer.end(), buf, buf + r);
-        } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            break;
-        } else if (errno != EINTR) {
-            ERROR("Got read error: %d %s for websocket %s at stage %s",
-                  errno, strerror(errno), mUrl.c_str(),
-                  Watchdog::stageName(Client::data().watchdog->currentStage()));
-
-            mState = Error;
-            break;
+        bool eof = false, wouldBlock = false;
+        if (!mRecvBuffer.full()) {
+            const ssize_t r = mRecvBuffer.readFrom(mFD);
+            VERBOSE("Read %zd bytes", r);
+            if (!r) {
+                eof = true;
+            } else if (r == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                    ERROR("Got read error: %d %s for websocket %s at stage %s",
+                          errno, strerror(errno), mUrl.c_str(),
+                          Watchdog::stageName(Client::data().watchdog->currentStage()));
+                    mState = Error;
+                    return;
+                }
+                wouldBlock = true;
+            }
         }
-    }
 
-    if (mState == WaitingForUpgrade) {
-        acceptUpgrade();
-    }
-    if (mState == ConnectedWebSocket) {
-        while (true) {
-            const size_t last = mRecvBuffer.size();
+        if (mState == WaitingForUpgrade)
+            acceptUpgrade();
+        if (mState == ConnectedWebSocket && !mRecvBuffer.empty()) {
             const int r = wslay_event_recv(mContext);
             if (r) {
                 ERROR("Got wslay_event_recv error: %d", r);
                 mState = Error;
                 return;
             }
-            if (mRecvBuffer.empty() || last == mRecvBuffer.size())
-                break;
         }
 
-        if (sendBufferWasEmpty && !mSendBuffer.empty())
-            send();
-        wslay_event_send(mContext);
+        if (eof) {
+            mState = Closed;
+            return;
+        }
+        if (wouldBlock || (mState != WaitingForUpgrade && mState != ConnectedWebSocket))
+            break;
     }
+
+    if (mState == ConnectedWebSocket)
+        flush();
 }
 
-void WebSocket::send()
+void WebSocket::sendHandshake()
 {
     size_t sendBufferOffset = 0;
     while (sendBufferOffset < mSendBuffer.size()) {
-        const ssize_t r = ::write(mFD, &mSendBuffer[sendBufferOffset], std::min<size_t>(BUFSIZ, mSendBuffer.size() - sendBufferOffset));
+        const ssize_t r = ::write(mFD, mSendBuffer.c_str() + sendBufferOffset, mSendBuffer.size() - sendBufferOffset);
         VERBOSE("Wrote %zd bytes\n", r);
         if (r > 0) {
             sendBufferOffset += r;
@@ -440,7 +772,5 @@ void WebSocket::send()
             break;
         }
     }
-    if (sendBufferOffset) {
-        mSendBuffer.erase(mSendBuffer.begin(), mSendBuffer.begin() + sendBufferOffset);
-    }
+    mSendBuffer.erase(0, sendBufferOffset);
 }
@@ -1,12 +1,14 @@
 #ifndef WEBSOCKET_H
 #define WEBSOCKET_H
 
+#include <deque>
 #include <functional>
 #include <string>
 #include <vector>
 #include <map>
 #include <wslay/wslay.h>
 #include "Select.h"
+#include "RingBuffer.h"
 #include <LUrlParser.h>
 
 class WebSocket : public Socket
@@ -19,10 +21,25 @@ public:
         Text,
         Binary
     };
-    bool connect(std::string &&url, const std::map<std::string, std::string> &headers);
+    // With unixSocket set the connection goes there instead of to the host
+    // in url, the handshake is the same
+    bool connect(std::string &&url, const std::map<std::string, std::string> &headers,
+                 const std::string &unixSocket = std::string());
     bool send(MessageType mode, const void *data, size_t len);
+    // takes ownership of data and masks it in place, no copy
+    bool send(MessageType mode, std::string &&data);
+
+    // A binary message of len bytes of fd starting at offset, sent with
+    // sendfile() where available. The frame is masked with an all-zero key
+    // so the data can go out untouched, fd has to stay open until it's
+    // written.
+    bool send(int fd, off_t offset, size_t len);
+
     void close(const char *reason);
-    bool hasPendingSendData() const { return !mSendBuffer.empty(); }
+    bool hasPendingSendData() const
+    {
+        return !mSendBuffer.empty() || !mPayloads.empty() || (mContext && wslay_event_want_write(mContext));
+    }
     enum State {
         Error = -2,
         Closed = -1,
@@ -51,6 +68,8 @@ public:
         return std::string();
     }
 protected:
+    // Text messages are delivered whole, binary messages are delivered in
+    // pieces as they arrive
     virtual void onMessage(MessageType mode, const void *data, size_t len) = 0;
     virtual void onConnected() = 0;
 
@@ -62,9 +81,25 @@ protected:
     virtual void onRead() override;
     virtual void onTimeout() override {}
 private:
+    enum { RecvBufferSize = 256 * 1024 };
+    struct Payload {
+        unsigned char header[14];
+        size_t headerLength { 0 };
+        std::string data;
+        int fd { -1 }; // data comes from fileOffset/fileLength of fd instead
+        off_t fileOffset { 0 };
+        size_t fileLength { 0 };
+        size_t offset { 0 }; // into header + data
+
+        size_t length() const { return headerLength + (fd == -1 ? data.size() : fileLength); }
+    };
+    bool connectUnix(const std::string &path);
     bool requestUpgrade();
     void acceptUpgrade();
-    void send();
+    void sendHandshake();
+    bool flush();
+    bool writePayloads();
+    void consumePayloads(size_t bytes);
     std::string mUrl, mHost, mClientKey;
     int mPort { -1 };
     LUrlParser::clParseURL mParsedUrl;
@@ -73,7 +108,14 @@ private:
     wslay_event_callbacks mCallbacks;
     wslay_event_context *mContext { nullptr };
 
-    std::vector<unsigned char> mRecvBuffer, mSendBuffer;
+    RingBuffer mRecvBuffer { RecvBufferSize };
+    std::string mSendBuffer; // only used for the http upgrade
+    std::deque<Payload> mPayloads;
+    std::string mCloseReason;
+    bool mClosePending { false };
+    std::string mTextMessage;
+    uint8_t mMessageOpcode { 0 }, mFrameOpcode { 0 };
+    bool mFrameFin { false };
     std::vector<std::string> mHandshakeResponseHeaders;
     State mState { None };
 };
@@ -0,0 +1,175 @@
+#include "../LineMarkerScanner.h"
+#include <openssl/md5.h>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Strips line markers from a preprocessed file fed in random 1-64KB chunks
+// like the preprocessor's pipe reads and checks that the digest matches the
+// byte at a time loop fiskc used before LineMarkerScanner.
+//
+// LineMarkerScanner has no vector loop of its own, it memchr()s for '#'
+// and then for the marker's '\n' and glibc's memchr is SSE2/AVX2 already.
+// The sse2 run is the alternative, one pass that stops at every '#' and
+// '\n' together. Newlines are everywhere in preprocessed output so it
+// stops far more often.
+
+// keeps the compiler from dropping results nobody looks at
+static volatile size_t sSink;
+
+static std::string reference(const std::string &contents)
+{
+    MD5_CTX md5;
+    MD5_Init(&md5);
+    const char *ch = contents.c_str();
+    const char *last = ch;
+    while (*ch) {
+        if (*ch == '#' && ch[1] == ' ' && std::isdigit(static_cast<unsigned char>(ch[2]))) {
+            if (ch > last)
+                MD5_Update(&md5, last, ch - last);
+            while (*ch && *ch != '\n')
+                ++ch;
+            last = ch;
+        } else {
+            ++ch;
+        }
+    }
+    if (last < ch)
+        MD5_Update(&md5, last, ch - last);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &md5);
+    return std::string(reinterpret_cast<const char *>(digest), sizeof(digest));
+}
+
+static std::string scan(const std::string &contents, const std::vector<size_t> &chunks, bool hash)
+{
+    MD5_CTX md5;
+    MD5_Init(&md5);
+    size_t bytes = 0;
+    LineMarkerScanner scanner([&md5, &bytes, hash](const char *data, size_t len) {
+            if (hash) {
+                MD5_Update(&md5, data, len);
+            } else {
+                bytes += len;
+            }
+        });
+    size_t offset = 0;
+    for (size_t chunk : chunks) {
+        scanner.feed(contents.c_str() + offset, chunk);
+        offset += chunk;
+    }
+    scanner.finish();
+    if (!hash)
+        return std::to_string(bytes);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &md5);
+    return std::string(reinterpret_cast<const char *>(digest), sizeof(digest));
+}
+
+#ifdef __SSE2__
+// The number of bytes that aren't line markers, like scan() without hash
+static size_t sse2Scan(const std::string &contents)
+{
+    const char *data = contents.c_str();
+    const size_t len = contents.size();
+    size_t bytes = 0, start = 0;
+    bool inMarker = false;
+    auto candidate = [&](size_t i) {
+        if (data[i] == '\n') {
+            if (inMarker) {
+                // the newline itself is content
+                inMarker = false;
+                start = i;
+            }
+        } else if (!inMarker && i + 2 < len && data[i + 1] == ' ' && std::isdigit(static_cast<unsigned char>(data[i + 2]))) {
+            bytes += i - start;
+            inMarker = true;
+        }
+    };
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, hash), _mm_cmpeq_epi8(block, newline)));
+        while (mask) {
+            candidate(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; ++i) {
+        if (data[i] == '#' || data[i] == '\n')
+            candidate(i);
+    }
+    if (!inMarker)
+        bytes += len - start;
+    return bytes;
+}
+#endif
+
+template <typename Func>
+static void run(const char *name, size_t size, int iterations, Func &&func)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (int i=0; i<iterations; ++i)
+        func();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-16s %8.1f MB/s\n", name, (static_cast<double>(size) * iterations) / elapsed.count() / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <preprocessed file> [iterations]\n", argv[0]);
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+    std::stringstream stream;
+    stream << file.rdbuf();
+    const std::string contents = stream.str();
+    const int iterations = argc > 2 ? std::max(1, atoi(argv[2])) : 10;
+
+    std::mt19937 random(1);
+    std::uniform_int_distribution<size_t> distribution(1, 64 * 1024);
+    std::vector<size_t> chunks;
+    for (size_t offset = 0; offset < contents.size(); ) {
+        const size_t chunk = std::min(distribution(random), contents.size() - offset);
+        chunks.push_back(chunk);
+        offset += chunk;
+    }
+
+    if (scan(contents, chunks, true) != reference(contents)) {
+        fprintf(stderr, "Digest mismatch between LineMarkerScanner and the reference loop\n");
+        return 1;
+    }
+#ifdef __SSE2__
+    if (std::to_string(sse2Scan(contents)) != scan(contents, chunks, false)) {
+        fprintf(stderr, "Byte count mismatch between LineMarkerScanner and the sse2 scan\n");
+        return 1;
+    }
+#endif
+    printf("%s: %zu bytes, %zu chunks, %d iterations\n", argv[1], contents.size(), chunks.size(), iterations);
+    printf("scanner finds '#' and '\\n' with memchr(), sse2 checks for both in one pass\n");
+    run("reference + md5", contents.size(), iterations, [&contents]() { sSink = reference(contents).size(); });
+    run("scanner + md5", contents.size(), iterations, [&contents, &chunks]() { sSink = scan(contents, chunks, true).size(); });
+    run("scanner", contents.size(), iterations, [&contents, &chunks]() { sSink = scan(contents, chunks, false).size(); });
+#ifdef __SSE2__
+    run("sse2", contents.size(), iterations, [&contents]() { sSink = sse2Scan(contents); });
+#endif
+    return 0;
+}
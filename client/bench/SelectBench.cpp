@@ -0,0 +1,151 @@
+#include "../Select.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// How long it takes a Select::exec() with idle sockets registered to return
+// after another thread calls Select::wakeup(), the way the preprocess thread
+// wakes up the main one, next to a select(2) loop over the same fds with a
+// self-pipe like Select did before it used epoll.
+
+typedef std::chrono::steady_clock Clock;
+
+class IdleSocket : public Socket
+{
+public:
+    IdleSocket()
+    {
+        if (pipe(mPipe))
+            mPipe[0] = mPipe[1] = -1;
+    }
+    ~IdleSocket()
+    {
+        ::close(mPipe[0]);
+        ::close(mPipe[1]);
+    }
+    virtual int fd() const override { return mPipe[0]; }
+    virtual unsigned int mode() const override { return Read; }
+    virtual void onWrite() override {}
+    virtual void onRead() override {}
+    virtual void onTimeout() override {}
+    virtual int timeout() override { return -1; }
+private:
+    int mPipe[2];
+};
+
+// The waker waits a little so the main thread is asleep before it sends
+// the wakeup, the time it sent it in ns is in sent
+struct Waker
+{
+    std::atomic<long long> sent { 0 };
+    std::atomic<bool> armed { false };
+    std::atomic<bool> done { false };
+
+    template <typename Wakeup>
+    void run(Wakeup wakeup)
+    {
+        while (!done) {
+            if (!armed) {
+                std::this_thread::yield();
+                continue;
+            }
+            armed = false;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            sent = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+            wakeup();
+        }
+    }
+};
+
+static long long now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *name, size_t sockets, std::vector<long long> &latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-8s %5zu sockets  median %6.1f us  p99 %7.1f us\n", name, sockets,
+           latencies[latencies.size() / 2] / 1000.0,
+           latencies[latencies.size() * 99 / 100] / 1000.0);
+}
+
+static void runSelect(size_t count, size_t iterations)
+{
+    std::vector<IdleSocket> sockets(count);
+    Select select;
+    for (IdleSocket &socket : sockets)
+        select.add(&socket);
+
+    Waker waker;
+    std::thread thread([&waker, &select]() { waker.run([&select]() { select.wakeup(); }); });
+    std::vector<long long> latencies;
+    latencies.reserve(iterations);
+    for (size_t i=0; i<iterations; ++i) {
+        waker.armed = true;
+        select.exec();
+        latencies.push_back(now() - waker.sent);
+    }
+    waker.done = true;
+    thread.join();
+    for (IdleSocket &socket : sockets)
+        select.remove(&socket);
+    report("epoll", count, latencies);
+}
+
+static void runReference(size_t count, size_t iterations)
+{
+    std::vector<IdleSocket> sockets(count);
+    int wake[2];
+    if (pipe(wake)) {
+        perror("pipe");
+        return;
+    }
+
+    Waker waker;
+    std::thread thread([&waker, &wake]() { waker.run([&wake]() { if (::write(wake[1], "w", 1) != 1) abort(); }); });
+    std::vector<long long> latencies;
+    latencies.reserve(iterations);
+    for (size_t i=0; i<iterations; ++i) {
+        waker.armed = true;
+        fd_set r;
+        FD_ZERO(&r);
+        FD_SET(wake[0], &r);
+        int max = wake[0];
+        for (IdleSocket &socket : sockets) {
+            if (socket.mode() & Socket::Read) {
+                FD_SET(socket.fd(), &r);
+                max = std::max(max, socket.fd());
+            }
+        }
+        int ret;
+        EINTRWRAP(ret, ::select(max + 1, &r, nullptr, nullptr, nullptr));
+        char ch;
+        if (ret > 0 && FD_ISSET(wake[0], &r) && ::read(wake[0], &ch, 1) != 1)
+            abort();
+        latencies.push_back(now() - waker.sent);
+    }
+    waker.done = true;
+    thread.join();
+    ::close(wake[0]);
+    ::close(wake[1]);
+    report("select", count, latencies);
+}
+
+int main(int argc, char **argv)
+{
+    const size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000;
+    // two fds a socket, select(2) can't go past FD_SETSIZE
+    for (size_t count : { 4, 64, 400 }) {
+        runSelect(count, iterations);
+        runReference(count, iterations);
+    }
+    return 0;
+}
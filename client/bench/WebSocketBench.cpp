@@ -0,0 +1,279 @@
+#include "../Client.h"
+#include "../Select.h"
+#include "../WebSocket.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+// Uploads and downloads over loopback against a minimal websocket server
+// running on a thread, the way fiskc sends preprocessed output and gets
+// object files back, and reports throughput and how far the peak RSS got
+// above where it started.
+
+enum { ChunkSize = 256 * 1024 };
+
+class BenchWebSocket : public WebSocket
+{
+public:
+    bool connected { false };
+    size_t received { 0 };
+protected:
+    virtual void onConnected() override { connected = true; }
+    virtual void onMessage(MessageType, const void *, size_t len) override { received += len; }
+};
+
+static size_t status(const char *field)
+{
+    std::ifstream file("/proc/self/status");
+    std::string line;
+    const size_t len = strlen(field);
+    while (std::getline(file, line)) {
+        if (!strncmp(line.c_str(), field, len) && line[len] == ':')
+            return strtoull(line.c_str() + len + 1, nullptr, 10) * 1024;
+    }
+    return 0;
+}
+
+static void resetPeak()
+{
+    // makes VmHWM start over from the current RSS
+    std::ofstream file("/proc/self/clear_refs");
+    file << "5";
+}
+
+static bool readAll(int fd, void *data, size_t len)
+{
+    char *ptr = static_cast<char *>(data);
+    while (len) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(fd, ptr, len));
+        if (r <= 0)
+            return false;
+        ptr += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void *data, size_t len)
+{
+    const char *ptr = static_cast<const char *>(data);
+    while (len) {
+        ssize_t r;
+        EINTRWRAP(r, ::write(fd, ptr, len));
+        if (r <= 0)
+            return false;
+        ptr += r;
+        len -= r;
+    }
+    return true;
+}
+
+static int acceptUpgrade(int listener)
+{
+    int fd;
+    EINTRWRAP(fd, ::accept(listener, nullptr, nullptr));
+    if (fd == -1)
+        return -1;
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(fd, buf, sizeof(buf)));
+        if (r <= 0) {
+            ::close(fd);
+            return -1;
+        }
+        request.append(buf, r);
+    }
+    const size_t key = request.find("Sec-WebSocket-Key: ");
+    if (key == std::string::npos) {
+        ::close(fd);
+        return -1;
+    }
+    const size_t start = key + 19;
+    const std::string accept = Client::base64(Client::sha1(request.substr(start, request.find("\r\n", start) - start)
+                                                           + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    const std::string response = Client::format("HTTP/1.1 101 Switching Protocols\r\n"
+                                                "Upgrade: websocket\r\n"
+                                                "Connection: Upgrade\r\n"
+                                                "Sec-WebSocket-Accept: %s\r\n\r\n", accept.c_str());
+    if (!writeAll(fd, response.c_str(), response.size())) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads frames until bytes of payload have arrived, unmasking is left out
+// since it's the client's side we're measuring
+static void drain(int listener, size_t bytes)
+{
+    const int fd = acceptUpgrade(listener);
+    if (fd == -1)
+        return;
+    std::string payload(ChunkSize, '\0');
+    while (bytes) {
+        unsigned char header[14];
+        if (!readAll(fd, header, 2))
+            break;
+        uint64_t len = header[1] & 0x7f;
+        size_t extra = len == 126 ? 2 : len == 127 ? 8 : 0;
+        if (header[1] & 0x80)
+            extra += 4;
+        if (!readAll(fd, header + 2, extra))
+            break;
+        if (len == 126) {
+            len = (header[2] << 8) | header[3];
+        } else if (len == 127) {
+            len = 0;
+            for (int i=0; i<8; ++i)
+                len = (len << 8) | header[2 + i];
+        }
+        if ((header[0] & 0x0f) == 0x2)
+            bytes -= std::min<uint64_t>(len, bytes);
+        while (len) {
+            const size_t chunk = std::min<uint64_t>(len, payload.size());
+            if (!readAll(fd, &payload[0], chunk)) {
+                bytes = 0;
+                break;
+            }
+            len -= chunk;
+        }
+    }
+    ::close(fd);
+}
+
+static void feed(int listener, size_t bytes)
+{
+    const int fd = acceptUpgrade(listener);
+    if (fd == -1)
+        return;
+    const std::string payload(ChunkSize, 'x');
+    while (bytes) {
+        const uint64_t len = std::min<size_t>(bytes, payload.size());
+        unsigned char header[10];
+        header[0] = 0x82;
+        header[1] = 127;
+        for (int i=0; i<8; ++i)
+            header[2 + i] = len >> (56 - (i * 8));
+        if (!writeAll(fd, header, sizeof(header)) || !writeAll(fd, payload.c_str(), len))
+            break;
+        bytes -= len;
+    }
+    // the client closes when it has everything
+    char ch;
+    while (::read(fd, &ch, 1) > 0)
+        ;
+    ::close(fd);
+}
+
+enum Mode {
+    Download,
+    Upload,
+    UploadFile
+};
+
+static bool run(Mode mode, int listener, int port, size_t bytes, int file)
+{
+    std::thread server(mode == Download ? feed : drain, listener, bytes);
+    const size_t rss = status("VmRSS");
+    resetPeak();
+    const auto start = std::chrono::steady_clock::now();
+
+    bool ok;
+    {
+        Select select;
+        BenchWebSocket webSocket;
+        select.add(&webSocket);
+        ok = webSocket.connect(Client::format("ws://127.0.0.1:%d/bench", port), std::map<std::string, std::string>());
+        while (ok && !webSocket.connected) {
+            select.exec(1000);
+            ok = webSocket.state() >= WebSocket::None;
+        }
+        const std::string chunk(ChunkSize, 'x');
+        size_t sent = 0;
+        while (ok) {
+            if (mode == Download) {
+                if (webSocket.received == bytes)
+                    break;
+            } else if (!webSocket.hasPendingSendData()) {
+                if (sent == bytes)
+                    break;
+                // one chunk at a time as the socket drains, like main.cpp
+                const size_t len = std::min<size_t>(bytes - sent, ChunkSize);
+                if (mode == UploadFile) {
+                    ok = webSocket.send(file, sent, len);
+                } else {
+                    ok = webSocket.send(WebSocket::Binary, std::string(chunk, 0, len));
+                }
+                sent += len;
+                continue;
+            }
+            select.exec(1000);
+            ok = webSocket.state() == WebSocket::ConnectedWebSocket;
+        }
+    }
+    // the server sees the connection close once we're done
+    server.join();
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const size_t peak = status("VmHWM");
+    const char *names[] = { "download", "upload", "upload sendfile" };
+    if (!ok) {
+        fprintf(stderr, "%s failed\n", names[mode]);
+        return false;
+    }
+    printf("%-16s %8.1f MB/s  +%zu MB peak RSS\n", names[mode], bytes / elapsed.count() / (1024 * 1024),
+           (peak > rss ? peak - rss : 0) / (1024 * 1024));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    // in MB, what a big TU's preprocessed output and a big object file come to
+    const size_t upload = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 200) * 1024 * 1024;
+    const size_t download = (argc > 2 ? strtoull(argv[2], nullptr, 10) : 50) * 1024 * 1024;
+
+    const int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener == -1
+        || ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))
+        || ::listen(listener, 1)
+        || ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len)) {
+        fprintf(stderr, "Failed to listen on loopback %d %s\n", errno, strerror(errno));
+        return 1;
+    }
+    const int port = ntohs(addr.sin_port);
+
+    // what the upload reads from with sendfile, like the preprocessed memfd
+    FILE *file = tmpfile();
+    const std::string chunk(ChunkSize, 'x');
+    for (size_t written = 0; file && written < upload; written += chunk.size())
+        fwrite(chunk.c_str(), 1, std::min(chunk.size(), upload - written), file);
+    if (!file || fflush(file)) {
+        fprintf(stderr, "Failed to create the upload file\n");
+        return 1;
+    }
+
+    printf("%zu MB up, %zu MB down over 127.0.0.1:%d\n", upload / (1024 * 1024), download / (1024 * 1024), port);
+    const bool ok = (run(Download, listener, port, download, fileno(file))
+                     && run(Upload, listener, port, upload, fileno(file))
+                     && run(UploadFile, listener, port, upload, fileno(file)));
+    fclose(file);
+    ::close(listener);
+    return ok ? 0 : 1;
+}
@@ -1,11 +1,18 @@
 #include "Client.h"
+#include "Chunker.h"
 #include "CompilerArgs.h"
+#include "Compression.h"
 #include "Config.h"
+#include "DirectCache.h"
+#include "Hedge.h"
+#include "Breaker.h"
 #include "BuilderWebSocket.h"
 #include "SchedulerWebSocket.h"
 #include "Log.h"
 #include "Preprocessed.h"
+#include "Pump.h"
 #include "Select.h"
+#include "Timings.h"
 #include <execinfo.h>
 #include "Watchdog.h"
 #include "WebSocket.h"
@@ -13,18 +20,45 @@
 #include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <unistd.h>
 #include <csignal>
 #ifdef __linux__
 #include <sys/prctl.h>
 #endif
 #include "DaemonSocket.h"
+#include "LocalCompile.h"
 
 static unsigned long long preprocessedDuration = 0;
 static unsigned long long preprocessedSlotDuration = 0;
 extern "C" const char *npm_version;
 static std::string schedulerUrl();
 static int clientVerify();
+static json11::Json::object builderRequest(const std::map<std::string, std::string> &headers);
+static bool fetchFromSharedDirectCache(DirectCache &directCache, DaemonSocket &daemonSocket, Select &select,
+                                       std::map<std::string, std::string> headers);
+static std::string dictionaryPath(const std::string &environment);
+static void saveDictionary(const std::string &environment, const std::string &dictionary);
+// What main() has set up to ask the scheduler for a builder and run the job
+// there, buildRemotely() is called again for each builder we try
+struct Remote
+{
+    Select &select;
+    DaemonSocket &daemonSocket;
+    std::unique_ptr<LocalCompile> &localCompile;
+    std::map<std::string, std::string> &headers;
+    std::unique_ptr<Pump> &pump;
+    const std::string &url;
+    const bool releaseCppSlotOnCppFinished;
+    const std::function<void(const std::string &)> runLocal;
+    const std::function<void()> acquireCppSlot;
+    const std::function<void()> reportRemoteFinished;
+    const std::function<void(const BuilderWebSocket &, const std::string &)> storeInDirectCache;
+    size_t retries;
+};
+// buildRemotely() gave up on the builder, never an exit code
+static const int RetryBuilder = INT_MIN;
+static int buildRemotely(Remote &remote);
 int main(int argc, char **argv)
 {
     if (getenv("FISKC_INVOKED")) {
@@ -173,6 +207,54 @@ int main(int argc, char **argv)
               data.builderCompiler.c_str());
     }
 
+    // A direct cache hit doesn't need the daemon or anyone else
+    std::unique_ptr<DirectCache> directCache;
+    if (!Config::dumpSlots && !Config::disabled) {
+        if (Config::objectCache) {
+            const std::string cacheKeyHash = Config::cacheKeyHash;
+            Hasher::Algorithm algorithm;
+            if (!Hasher::algorithmFromString(cacheKeyHash, &algorithm)) {
+                FATAL("Invalid --cache-key-hash %s", cacheKeyHash.c_str());
+            } else {
+                data.hasher.init(algorithm);
+            }
+        }
+
+        {
+            std::vector<std::string> args(data.argc);
+            for (int i=0; i<data.argc; ++i) {
+                // printf("%zu: %s\n", i, argv[i]);
+                args[i] = data.argv[i];
+            }
+
+            if (!Config::color) {
+                for (std::string &arg : args) {
+                    if (arg == "-fcolor-diagnostics") {
+                        arg = "-fno-color-diagnostics";
+                    } else if (arg == "-fdiagnostics-color=always" || arg == "-fdiagnostics-color=auto") {
+                        arg = "-fdiagnostics-color=never";
+                    }
+                }
+            }
+
+            data.compilerArgs = CompilerArgs::create(args, &data.localReason);
+        }
+        if (data.compilerArgs) {
+            data.hash = Client::environmentHash(data.resolvedCompiler);
+            if (Config::objectCache && Config::directCache) {
+                directCache.reset(new DirectCache);
+                if (!directCache->isValid()) {
+                    directCache.reset();
+                } else if (directCache->replay()) {
+                    data.directCacheHit = true;
+                    data.watchdog->stop();
+                    Client::writeStatistics();
+                    return data.exitCode;
+                }
+            }
+        }
+    }
+
     DaemonSocket daemonSocket;
     if (!daemonSocket.connect()) {
         ERROR("Failed to connect to daemon");
@@ -217,58 +299,85 @@ int main(int argc, char **argv)
         return daemonSocket.state() == DaemonSocket::Closed ? 0 : 1;
     }
 
-    auto runLocal = [&daemonSocket, &data, &select](const std::string &reason) {
+    std::unique_ptr<LocalCompile> localCompile;
+    auto runLocal = [&daemonSocket, &data, &select, &localCompile](const std::string &reason) {
         data.watchdog->stop();
-        daemonSocket.send(DaemonSocket::AcquireCompileSlot);
-        daemonSocket.waitForCompileSlot(select);
+        if (localCompile && localCompile->running()) {
+            DEBUG("Using the local compile because of %s", reason.c_str());
+            localCompile->wait(select);
+        }
+        if (!daemonSocket.hasCompileSlot()) {
+            daemonSocket.send(DaemonSocket::AcquireCompileSlot);
+            daemonSocket.waitForCompileSlot(select);
+        }
         Client::runLocal(reason);
     };
 
-
-#if 0
-    if (!Config::noDesire) {
-        if (std::unique_ptr<Client::Slot> slot = Client::tryAcquireSlot(Client::Slot::DesiredCompile)) {
-            runLocal("nodesire");
-            return 0;
-        }
-    }
-#endif
-
     if (Config::disabled) {
         DEBUG("Have to run locally because we're disabled");
         runLocal("disabled");
         return 0; // unreachable
     }
 
-    {
-        std::vector<std::string> args(data.argc);
-        for (int i=0; i<data.argc; ++i) {
-            // printf("%zu: %s\n", i, argv[i]);
-            args[i] = data.argv[i];
-        }
-
-        if (!Config::color) {
-            for (std::string &arg : args) {
-                if (arg == "-fcolor-diagnostics") {
-                    arg = "-fno-color-diagnostics";
-                } else if (arg == "-fdiagnostics-color=always" || arg == "-fdiagnostics-color=auto") {
-                    arg = "-fdiagnostics-color=never";
-                }
-            }
-        }
-
-        data.compilerArgs = CompilerArgs::create(args, &data.localReason);
-    }
     if (!data.compilerArgs) {
         DEBUG("Have to run locally");
         runLocal(Client::format("compiler args parse failure: %s", CompilerArgs::localReasonToString(data.localReason)));
         return 0; // unreachable
     }
 
-    daemonSocket.send(DaemonSocket::AcquireCppSlot);
-    data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, select, daemonSocket);
-    assert(data.preprocessed);
-    data.hash = Client::environmentHash(data.resolvedCompiler);
+    // Local first, the daemon decides how many jobs that is from how long
+    // they take here and remotely
+    bool desired = false;
+    if (!Config::noDesire
+        && daemonSocket.waitForCapabilities(select)
+        && daemonSocket.capabilities() & DaemonSocket::DesiredSlotCapability) {
+        if (daemonSocket.tryAcquireDesiredSlot(select)) {
+            runLocal("desired");
+            return 0; // unreachable
+        }
+        desired = true;
+    }
+    auto reportRemoteFinished = [&daemonSocket, &select, desired]() {
+        if (!desired)
+            return;
+        daemonSocket.reportRemoteFinished();
+        while (daemonSocket.hasPendingSendData() && daemonSocket.state() == DaemonSocket::Connected)
+            select.exec();
+    };
+
+    // The local cores are idle so compile here too and use whichever is done
+    // first
+    if (Config::raceLocal
+        && LocalCompile::canRace()
+        && daemonSocket.waitForCapabilities(select)
+        && daemonSocket.capabilities() & DaemonSocket::TryAcquireCompileSlotCapability
+        && daemonSocket.tryAcquireCompileSlot(select)) {
+        localCompile.reset(new LocalCompile(daemonSocket));
+        if (localCompile->start()) {
+            select.add(localCompile.get());
+        } else {
+            localCompile.reset();
+            daemonSocket.send(DaemonSocket::ReleaseCompileSlot);
+        }
+    }
+
+    auto storeInDirectCache = [&directCache, &data, &daemonSocket, &select](const BuilderWebSocket &builder, const std::string &md5) {
+        if (!directCache || data.exitCode)
+            return;
+        directCache->store(data.preprocessed->includes, builder.outputs,
+                           data.preprocessed->stdErr, builder.stdOut, builder.stdErr);
+        // the scheduler's manifests have nowhere to keep the preprocessor's
+        // warnings
+        if (Config::sharedDirectCache
+            && directCache->hasManifest()
+            && data.preprocessed->stdErr.empty()
+            && daemonSocket.capabilities() & DaemonSocket::ManifestCapability) {
+            daemonSocket.send(directCache->manifest(md5).dump());
+            while (daemonSocket.hasPendingSendData() && daemonSocket.state() == DaemonSocket::Connected)
+                select.exec();
+        }
+    };
+
     std::map<std::string, std::string> headers;
     {
         char buf[1024];
@@ -301,6 +410,57 @@ int main(int argc, char **argv)
         if (!hostname.empty())
             headers["x-fisk-client-hostname"] = std::move(hostname);
     }
+    {
+        const std::string compression = Config::compression;
+        if (!strcasecmp("zstd", compression.c_str())) {
+            // builders without zstd fall back to deflate
+            headers["x-fisk-compression"] = "zstd, deflate";
+        } else if (!strcasecmp("deflate", compression.c_str())) {
+            headers["x-fisk-compression"] = "deflate";
+        } else if (strcasecmp("none", compression.c_str())) {
+            FATAL("Invalid --compression mode %s", compression.c_str());
+        }
+    }
+    if (Config::chunkUpload)
+        headers["x-fisk-chunks"] = "true";
+    if (Config::rawStream)
+        headers["x-fisk-raw-stream"] = "true";
+
+    if (directCache
+        && Config::sharedDirectCache
+        && daemonSocket.waitForCapabilities(select)
+        && daemonSocket.capabilities() & DaemonSocket::ManifestCapability
+        && fetchFromSharedDirectCache(*directCache, daemonSocket, select, headers)) {
+        data.sharedDirectCacheHit = true;
+        data.watchdog->stop();
+        Client::writeStatistics();
+        return data.exitCode;
+    }
+
+    // With pump the builder preprocesses from a copy of the files we would
+    // have read. The object cache needs our preprocessed output for its key
+    // so the two don't mix.
+    std::unique_ptr<Pump> pump;
+    if (Config::pump && !Config::objectCache) {
+        pump.reset(new Pump);
+        if (pump->scan()) {
+            headers["x-fisk-pump"] = "true";
+        } else {
+            DEBUG("Can't pump %s, preprocessing locally", data.compilerArgs->sourceFile().c_str());
+            pump.reset();
+        }
+    }
+    auto acquireCppSlot = [&daemonSocket, &data]() {
+        const size_t expected = Timings::cppSize(data.compilerArgs->sourceFile());
+        if (expected)
+            daemonSocket.expectCppSize(expected);
+        daemonSocket.send(DaemonSocket::AcquireCppSlot);
+    };
+    if (!pump) {
+        acquireCppSlot();
+        data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, select, daemonSocket);
+        assert(data.preprocessed);
+    }
     const std::string url = schedulerUrl();
 
     bool releaseCppSlotOnCppFinished = true;
@@ -340,51 +500,121 @@ int main(int argc, char **argv)
             return 0; // unreachable
         }
 
-        if (data.preprocessed->stdOut.empty()) {
+        if (!data.preprocessed->available()) {
             ERROR("Empty preprocessed output. Running locally");
             runLocal("preprocess error 3");
             return 0; // unreachable
         }
 
-        VERBOSE("Md5'ing compiler hash [%s]", data.hash.c_str());
-        MD5_Update(&Client::data().md5, data.hash.c_str(), data.hash.size());
+        VERBOSE("Hashing compiler hash [%s]", data.hash.c_str());
+        data.hasher.update(data.hash);
 
         const std::string tag = Config::objectCacheTag;
-        VERBOSE("Md5'ing object cache tag [%s]", tag.c_str());
-        MD5_Update(&Client::data().md5, tag.c_str(), tag.size());
+        VERBOSE("Hashing object cache tag [%s]", tag.c_str());
+        data.hasher.update(tag);
 
-        unsigned char md5Buf[MD5_DIGEST_LENGTH];
-        MD5_Final(md5Buf, &data.md5);
-        std::string md5 = Client::toHex(md5Buf, sizeof(md5Buf));
+        std::string cacheKey = data.hasher.finalize();
 
-        WARN("Got md5: %s", md5.c_str());
-        headers["x-fisk-md5"] = std::move(md5);
+        WARN("Got cache key: %s", cacheKey.c_str());
+        headers["x-fisk-md5"] = std::move(cacheKey);
     }
 
-    SchedulerWebSocket schedulerWebsocket;
-    if (!schedulerWebsocket.connect(url + "/compile", headers)) {
-        DEBUG("Have to run locally because no server");
-        runLocal("scheduler connect error");
+    if (!Breaker::allow(Breaker::Scheduler, url)) {
+        runLocal("scheduler circuit open");
         return 0; // unreachable
     }
+    {
+        std::string excluded;
+        for (const std::string &builder : Breaker::open(Breaker::Builder)) {
+            if (!excluded.empty())
+                excluded += ' ';
+            excluded += builder;
+        }
+        if (!excluded.empty())
+            headers["x-fisk-exclude-builders"] = std::move(excluded);
+    }
 
-    select.add(&schedulerWebsocket);
-    DEBUG("Starting schedulerWebsocket");
-    while (!schedulerWebsocket.done
-           && !data.watchdog->timedOut()
-           && schedulerWebsocket.state() >= SchedulerWebSocket::None
-           && schedulerWebsocket.state() <= SchedulerWebSocket::ConnectedWebSocket) {
-        select.exec();
+    // When a builder fails us before it has answered we ask the scheduler
+    // for another one, without the ones that failed, before going local
+    Remote remote { select, daemonSocket, localCompile, headers, pump, url, releaseCppSlotOnCppFinished,
+                    runLocal, acquireCppSlot, reportRemoteFinished, storeInDirectCache, 0 };
+    while (true) {
+        const int ret = buildRemotely(remote);
+        if (ret != RetryBuilder)
+            return ret;
+    }
+}
+
+static int buildRemotely(Remote &remote)
+{
+    Client::Data &data = Client::data();
+    Select &select = remote.select;
+    DaemonSocket &daemonSocket = remote.daemonSocket;
+    std::unique_ptr<LocalCompile> &localCompile = remote.localCompile;
+    std::map<std::string, std::string> &headers = remote.headers;
+    std::unique_ptr<Pump> &pump = remote.pump;
+    const std::string &url = remote.url;
+    const bool releaseCppSlotOnCppFinished = remote.releaseCppSlotOnCppFinished;
+    const std::function<void(const std::string &)> &runLocal = remote.runLocal;
+    const std::function<void()> &acquireCppSlot = remote.acquireCppSlot;
+    const std::function<void()> &reportRemoteFinished = remote.reportRemoteFinished;
+    const std::function<void(const BuilderWebSocket &, const std::string &)> &storeInDirectCache = remote.storeInDirectCache;
+
+    SchedulerWebSocket schedulerWebsocket;
+    if (Config::daemonScheduler
+        && daemonSocket.waitForCapabilities(select)
+        && daemonSocket.capabilities() & DaemonSocket::AcquireBuilderCapability) {
+        // fisk-daemon keeps a connection to the scheduler open and shares it
+        // between all the fiskcs on this machine. If it can't help us for
+        // whatever reason (environment needs uploading, scheduler is down
+        // etc) we ask the scheduler ourselves.
+        daemonSocket.acquireBuilder(builderRequest(headers));
+        DEBUG("Asking daemon for a builder");
+        while (!daemonSocket.hasBuilderResponse()
+               && !data.watchdog->timedOut()
+               && daemonSocket.state() == DaemonSocket::Connected) {
+            select.exec();
+        }
+        if (daemonSocket.hasBuilderResponse()) {
+            const json11::Json &response = daemonSocket.builderResponse();
+            const std::string type = response["type"].string_value();
+            if (type == "builder" || type == "version_mismatch") {
+                data.watchdog->transition(Watchdog::ConnectedToScheduler);
+                schedulerWebsocket.processMessage(response);
+            } else {
+                DEBUG("Daemon didn't get us a builder (%s), connecting to scheduler", response.dump().c_str());
+            }
+        }
+    }
+
+    if (!schedulerWebsocket.done && !data.watchdog->timedOut()) {
+        if (!schedulerWebsocket.connect(url + "/compile", headers)) {
+            DEBUG("Have to run locally because no server");
+            Breaker::failure(Breaker::Scheduler, url);
+            runLocal("scheduler connect error");
+            return 0; // unreachable
+        }
+
+        select.add(&schedulerWebsocket);
+        DEBUG("Starting schedulerWebsocket");
+        while (!schedulerWebsocket.done
+               && !data.watchdog->timedOut()
+               && schedulerWebsocket.state() >= SchedulerWebSocket::None
+               && schedulerWebsocket.state() <= SchedulerWebSocket::ConnectedWebSocket) {
+            select.exec();
+        }
     }
 
     if (data.watchdog->timedOut()) {
         DEBUG("Have to run locally because we timed out trying to connect ro the scheduler");
+        Breaker::failure(Breaker::Scheduler, url);
         runLocal("watchdog scheduler connect");
         return 0; // unreachable
     }
 
     if (!schedulerWebsocket.error.empty()) {
         DEBUG("Have to run locally because no server: %s", schedulerWebsocket.error.c_str());
+        Breaker::failure(Breaker::Scheduler, url);
         runLocal(schedulerWebsocket.error);
         return 0; // unreachable
     }
@@ -392,9 +622,11 @@ int main(int argc, char **argv)
     DEBUG("Finished schedulerWebsocket");
     if (!schedulerWebsocket.done) {
         DEBUG("Have to run locally because no server 2");
+        Breaker::failure(Breaker::Scheduler, url);
         runLocal("scheduler connect error 2");
         return 0; // unreachable
     }
+    Breaker::success(Breaker::Scheduler, url);
 
     if (schedulerWebsocket.needsEnvironment) {
         data.watchdog->stop();
@@ -419,41 +651,162 @@ int main(int argc, char **argv)
 
     // usleep(1000 * 1000 * 16);
     data.watchdog->transition(Watchdog::AcquiredBuilder);
-    BuilderWebSocket builderWebSocket;
-    select.add(&builderWebSocket);
     headers["x-fisk-job-id"] = std::to_string(schedulerWebsocket.jobId);
     headers["x-fisk-builder-ip"] = data.builderIp;
     if (!schedulerWebsocket.environment.empty()) {
         DEBUG("Changing our environment from %s to %s", data.hash.c_str(), schedulerWebsocket.environment.c_str());
         headers["x-fisk-environments"] = schedulerWebsocket.environment;
     }
-    if (!builderWebSocket.connect(Client::format("ws://%s:%d/compile",
-                                               data.builderHostname.empty() ? data.builderIp.c_str() : data.builderHostname.c_str(),
-                                               data.builderPort), headers)) {
-        DEBUG("Have to run locally because no builder connection");
-        runLocal("builder connection failure");
+    // The scheduler trains a zstd dictionary per environment and gives it to
+    // the builders, we get a copy the first time we use one
+    const std::string environment = headers["x-fisk-environments"];
+    std::string dictionary, dictionaryId;
+    const auto compression = headers.find("x-fisk-compression");
+    if (Config::compressionDictionary && compression != headers.end() && compression->second.find("zstd") != std::string::npos) {
+        const std::string path = dictionaryPath(environment);
+        bool opened = false;
+        std::string err;
+        if (!path.empty() && Client::readFile(path, dictionary, &opened, &err) && !dictionary.empty()) {
+            Hasher hasher;
+            hasher.init(Hasher::MD5);
+            hasher.update(dictionary);
+            dictionaryId = hasher.finalize();
+        } else if (opened) {
+            DEBUG("Failed to read dictionary %s: %s", path.c_str(), err.c_str());
+        }
+        headers["x-fisk-dictionary"] = dictionaryId.empty() ? "none" : dictionaryId;
+    }
+    const std::string builderUrl = Client::format("ws://%s:%d/compile",
+                                                  data.builderHostname.empty() ? data.builderIp.c_str() : data.builderHostname.c_str(),
+                                                  data.builderPort);
+    // fisk-daemon usually has a connection to the builder already so going
+    // through it saves us the tcp and websocket handshakes with the
+    // builder. If that doesn't work out we connect ourselves.
+    std::string builderSocket;
+    if (Config::builderPool && daemonSocket.capabilities() & DaemonSocket::BuilderPoolCapability)
+        builderSocket = daemonSocket.builderSocket();
+    std::unique_ptr<BuilderWebSocket> builderConnection;
+    std::unique_ptr<Hedge> hedge;
+    // Every builder failure goes through here, whether or not we get to
+    // try another one
+    // not a failure of the builder's
+    bool refused = false;
+    auto retryBuilder = [&](const char *reason) -> bool {
+        const std::string builder = Client::format("%s:%d", data.builderIp.c_str(), data.builderPort);
+        if (!refused && (!builderConnection || !builderConnection->responded))
+            Breaker::failure(Breaker::Builder, builder);
+        if (remote.retries >= Config::builderRetries
+            || (builderConnection && builderConnection->responded)
+            || (hedge && hedge->responded())
+            || (localCompile && localCompile->running())) {
+            return false;
+        }
+        if (!data.watchdog->retry(Watchdog::ConnectedToScheduler)) {
+            DEBUG("No time left to try another builder after %s", builder.c_str());
+            return false;
+        }
+        ++remote.retries;
+        WARN("Builder %s failed (%s), asking for another one (%zu/%zu)",
+             builder.c_str(), reason, remote.retries, static_cast<size_t>(Config::builderRetries));
+        std::string &excluded = headers["x-fisk-exclude-builders"];
+        if (!excluded.empty())
+            excluded += ' ';
+        excluded += builder;
+        if (select.contains(&schedulerWebsocket))
+            select.remove(&schedulerWebsocket);
+        if (builderConnection && select.contains(builderConnection.get()))
+            select.remove(builderConnection.get());
+        data.builderIp.clear();
+        data.builderHostname.clear();
+        data.builderPort = 0;
+        data.uploadSize = 0;
+        return true;
+    };
+    // one that has been failing is tried by one fiskc at a time once it has
+    // cooled down
+    if (!Breaker::allow(Breaker::Builder, Client::format("%s:%d", data.builderIp.c_str(), data.builderPort))) {
+        refused = true;
+        if (retryBuilder("builder circuit open"))
+            return RetryBuilder;
+        runLocal("builder circuit open");
         return 0; // unreachable
     }
+    while (true) {
+        builderConnection.reset(new BuilderWebSocket);
+        select.add(builderConnection.get());
+        if (!builderConnection->connect(std::string(builderUrl), headers, builderSocket)) {
+            if (!builderSocket.empty()) {
+                DEBUG("Failed to connect to daemon's builder socket %s", builderSocket.c_str());
+                select.remove(builderConnection.get());
+                builderSocket.clear();
+                continue;
+            }
+            DEBUG("Failed to connect to builder %s", builderUrl.c_str());
+            break;
+        }
 
-    while (!data.watchdog->timedOut()
-           && builderWebSocket.state() < SchedulerWebSocket::ConnectedWebSocket
-           && builderWebSocket.state() > WebSocket::None) {
-        select.exec();
+        while (!data.watchdog->timedOut()
+               && builderConnection->state() < SchedulerWebSocket::ConnectedWebSocket
+               && builderConnection->state() > WebSocket::None) {
+            select.exec();
+        }
+
+        if (builderConnection->state() == SchedulerWebSocket::ConnectedWebSocket
+            || builderSocket.empty()
+            || data.watchdog->timedOut()) {
+            break;
+        }
+        DEBUG("Daemon couldn't connect us to %s, connecting directly", builderUrl.c_str());
+        select.remove(builderConnection.get());
+        builderSocket.clear();
     }
+    BuilderWebSocket &builderWebSocket = *builderConnection;
+    if (localCompile)
+        builderWebSocket.responseCallback = [&localCompile]() { localCompile->cancel(); };
 
     if (data.watchdog->timedOut()) {
         DEBUG("Have to run locally because we timed out trying to connect to builder");
+        if (retryBuilder("watchdog builder connect"))
+            return RetryBuilder;
         runLocal("watchdog builder connect");
         return 0; // unreachable
     }
 
     if (builderWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
         DEBUG("Have to run locally because no builder connection 2");
+        if (retryBuilder("builder connection failure 2"))
+            return RetryBuilder;
         runLocal("builder connection failure 2");
         return 0;
     }
     data.watchdog->transition(Watchdog::ConnectedToBuilder);
-    if (!Config::objectCache) {
+    if (pump && builderWebSocket.handshakeResponseHeader("x-fisk-pump") != "true") {
+        DEBUG("Builder can't pump, preprocessing locally");
+        pump.reset();
+        acquireCppSlot();
+        data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, select, daemonSocket);
+        assert(data.preprocessed);
+    }
+    const bool chunked = !pump && Config::chunkUpload && builderWebSocket.handshakeResponseHeader("x-fisk-chunks") == "true";
+    const bool stream = !pump && !chunked && Config::streamPreprocessed && builderWebSocket.handshakeResponseHeader("x-fisk-stream") == "true";
+    std::unique_ptr<Compressor> compressor = Compressor::create(builderWebSocket.handshakeResponseHeader("x-fisk-compression"),
+                                                                Config::compressionLevel);
+    // RFC 6455 wants a random mask key so the zero keyed frames are only
+    // sent if the builder said it takes them
+    const bool rawStream = (Config::rawStream && !compressor
+                            && builderWebSocket.handshakeResponseHeader("x-fisk-raw-stream") == "true");
+    // the builder only offers its dictionary when it picked zstd
+    const std::string builderDictionary = (compressor && !strcmp(compressor->encoding(), "zstd")
+                                           ? builderWebSocket.handshakeResponseHeader("x-fisk-dictionary") : std::string());
+    bool useDictionary = false;
+    if (!builderDictionary.empty() && builderDictionary == dictionaryId) {
+        useDictionary = static_cast<ZstdCompressor *>(compressor.get())->setDictionary(dictionary);
+    } else if (!builderDictionary.empty()) {
+        DEBUG("Builder has dictionary %s, we have %s", builderDictionary.c_str(), dictionaryId.empty() ? "none" : dictionaryId.c_str());
+    }
+    if (pump) {
+        data.watchdog->transition(Watchdog::PreprocessFinished);
+    } else if (!Config::objectCache && !stream) {
         DEBUG("Waiting for preprocessed");
         while (!data.preprocessed->done()
                && daemonSocket.state() == DaemonSocket::Connected
@@ -479,7 +832,7 @@ int main(int argc, char **argv)
             return 0; // unreachable
         }
 
-        if (data.preprocessed->stdOut.empty()) {
+        if (!data.preprocessed->available()) {
             ERROR("Empty preprocessed output. Running locally");
             runLocal("preprocess error 5");
             return 0; // unreachable
@@ -501,9 +854,56 @@ int main(int argc, char **argv)
     json11::Json::object msg {
         { "commandLine", args },
         { "argv0", data.compiler },
-        { "wait", wait },
-        { "bytes", static_cast<int>(data.preprocessed->stdOut.size()) }
+        { "wait", wait }
     };
+    std::vector<std::string> frames;
+    std::vector<Chunker::Chunk> chunks;
+    if (pump) {
+        msg["pump"] = pump->toJson();
+    } else if (chunked) {
+        if (!Chunker::split(*data.preprocessed, chunks)) {
+            runLocal("preprocessed read error");
+            return 0; // unreachable
+        }
+        json11::Json::array hashes, sizes;
+        hashes.reserve(chunks.size());
+        sizes.reserve(chunks.size());
+        for (const Chunker::Chunk &chunk : chunks) {
+            hashes.push_back(chunk.hash);
+            sizes.push_back(static_cast<int>(chunk.size));
+        }
+        msg["chunks"] = std::move(hashes);
+        msg["chunkSizes"] = std::move(sizes);
+        msg["bytes"] = static_cast<int>(data.preprocessed->available());
+    } else if (stream) {
+        msg["stream"] = true;
+    } else if (compressor) {
+        const size_t size = data.preprocessed->available();
+        size_t bytes = 0;
+        std::string chunk;
+        for (size_t offset = 0; offset < size; offset += chunk.size()) {
+            if (!data.preprocessed->read(offset, Preprocessed::StreamChunkSize, chunk)) {
+                runLocal("preprocessed read error");
+                return 0; // unreachable
+            }
+            frames.emplace_back();
+            if (!compressor->compress(chunk.c_str(), chunk.size(), frames.back())) {
+                runLocal("compression error");
+                return 0; // unreachable
+            }
+            bytes += frames.back().size();
+        }
+        msg["bytes"] = static_cast<int>(bytes);
+    } else {
+        msg["bytes"] = static_cast<int>(data.preprocessed->available());
+    }
+    if (compressor)
+        msg["encoding"] = compressor->encoding();
+    if (useDictionary) {
+        msg["dictionary"] = dictionaryId;
+    } else if (!builderDictionary.empty()) {
+        msg["fetchDictionary"] = true;
+    }
 
     const std::string json = json11::Json(msg).dump();
     DEBUG("Sending to builder:\n%s\n", json.c_str());
@@ -517,13 +917,15 @@ int main(int argc, char **argv)
         }
         if (builderWebSocket.done) {
             if (builderWebSocket.error.empty()) {
-                if (!data.preprocessed->stdErr.empty()) {
+                if (data.preprocessed && !data.preprocessed->stdErr.empty()) {
                     fwrite(data.preprocessed->stdErr.c_str(), sizeof(char), data.preprocessed->stdErr.size(), stderr);
                 }
                 data.watchdog->transition(Watchdog::UploadedJob);
                 data.watchdog->transition(Watchdog::Finished);
                 data.watchdog->stop();
                 schedulerWebsocket.close("cachehit");
+                storeInDirectCache(builderWebSocket, headers["x-fisk-md5"]);
+                reportRemoteFinished();
 
                 Client::writeStatistics();
                 return data.exitCode;
@@ -532,27 +934,203 @@ int main(int argc, char **argv)
                       data.compilerArgs->sourceFile().c_str(),
                       builderWebSocket.error.c_str());
 
+                if (retryBuilder("error"))
+                    return RetryBuilder;
                 runLocal("error");
                 return 0; // unreachable
             }
         }
         if (data.watchdog->timedOut()) {
             DEBUG("Have to run locally because we timed out waiting for builder");
+            if (retryBuilder("watchdog"))
+                return RetryBuilder;
             runLocal("watchdog");
             return 0; // unreachable
         }
         if (builderWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
             DEBUG("Have to run locally because something went wrong with the builder");
+            if (retryBuilder("builder protocol error 6"))
+                return RetryBuilder;
             runLocal("builder protocol error 6");
             return 0; // unreachable
         }
     }
 
     assert(!builderWebSocket.wait);
-    builderWebSocket.send(WebSocket::Binary, data.preprocessed->stdOut.c_str(), data.preprocessed->stdOut.size());
-    data.preprocessed->stdOut.clear();
+    if (pump) {
+        // the builder tells us which files it doesn't have, sent in that
+        // order one message each
+        while (!builderWebSocket.done
+               && !builderWebSocket.needHeaders
+               && !data.watchdog->timedOut()
+               && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
+            select.exec();
+        }
+        if (!builderWebSocket.needHeaders) {
+            DEBUG("Have to run locally because the builder didn't ask for headers");
+            if (retryBuilder("builder pump error"))
+                return RetryBuilder;
+            runLocal("builder pump error");
+            return 0; // unreachable
+        }
+        std::string compressed;
+        for (const std::string &hash : builderWebSocket.neededHeaders) {
+            const std::string *path = pump->path(hash);
+            Client::MappedFile file;
+            std::string err;
+            if (!path || !file.open(*path, &err)) {
+                ERROR("Builder asked for %s which we can't send %s", hash.c_str(), err.c_str());
+                runLocal("pump error");
+                return 0; // unreachable
+            }
+            // the builder doesn't ask for empty files, see builder/headercache.js
+            if (!file.size())
+                continue;
+            if (compressor) {
+                if (!compressor->compress(file.data(), file.size(), compressed)) {
+                    runLocal("compression error");
+                    return 0; // unreachable
+                }
+                data.uploadSize += compressed.size();
+                builderWebSocket.send(WebSocket::Binary, std::move(compressed));
+            } else {
+                data.uploadSize += file.size();
+                builderWebSocket.send(WebSocket::Binary, file.data(), file.size());
+            }
+            // one file in memory at a time
+            while (!data.watchdog->timedOut()
+                   && builderWebSocket.hasPendingSendData()
+                   && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
+                select.exec();
+            }
+        }
+    } else if (chunked) {
+        // the builder has the rest, the ones it wants go in its order
+        // packed into frames
+        while (!builderWebSocket.done
+               && !builderWebSocket.needChunks
+               && !data.watchdog->timedOut()
+               && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
+            select.exec();
+        }
+        if (!builderWebSocket.needChunks) {
+            DEBUG("Have to run locally because the builder didn't ask for chunks");
+            if (retryBuilder("builder chunk error"))
+                return RetryBuilder;
+            runLocal("builder chunk error");
+            return 0; // unreachable
+        }
+        std::map<std::string, const Chunker::Chunk *> byHash;
+        for (const Chunker::Chunk &chunk : chunks)
+            byHash.emplace(chunk.hash, &chunk);
+        DEBUG("Builder has %zu/%zu chunks", chunks.size() - builderWebSocket.neededChunks.size(), chunks.size());
+        std::string frame, chunk, compressed;
+        for (size_t i=0; i<builderWebSocket.neededChunks.size(); ++i) {
+            auto it = byHash.find(builderWebSocket.neededChunks[i]);
+            if (it == byHash.end() || !data.preprocessed->read(it->second->offset, it->second->size, chunk)) {
+                ERROR("Builder asked for chunk %s which we can't send", builderWebSocket.neededChunks[i].c_str());
+                runLocal("chunk error");
+                return 0; // unreachable
+            }
+            frame += chunk;
+            if (frame.size() < Preprocessed::StreamChunkSize && i + 1 < builderWebSocket.neededChunks.size())
+                continue;
+            if (compressor) {
+                if (!compressor->compress(frame.c_str(), frame.size(), compressed)) {
+                    runLocal("compression error");
+                    return 0; // unreachable
+                }
+                data.uploadSize += compressed.size();
+                builderWebSocket.send(WebSocket::Binary, std::move(compressed));
+            } else {
+                data.uploadSize += frame.size();
+                builderWebSocket.send(WebSocket::Binary, std::move(frame));
+            }
+            frame.clear();
+        }
+    } else if (!stream && compressor) {
+        for (std::string &frame : frames) {
+            data.uploadSize += frame.size();
+            builderWebSocket.send(WebSocket::Binary, std::move(frame));
+        }
+        frames.clear();
+    } else {
+        // The preprocessed output is read from its file a chunk at a time
+        // (or not at all with sendfile) so we never hold more than a chunk
+        // or two of it no matter how big the TU is
+        bool preprocessFinished = !stream || Config::objectCache;
+        size_t sent = 0;
+        std::string chunk, compressed;
+        while (!data.watchdog->timedOut() && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
+            if (!preprocessFinished && data.preprocessed->done()) {
+                preprocessFinished = true;
+                if (releaseCppSlotOnCppFinished)
+                    daemonSocket.send(DaemonSocket::ReleaseCppSlot);
+                data.watchdog->transition(Watchdog::PreprocessFinished);
+                DEBUG("Preprocessed finished, %zu/%zu bytes already streamed", sent, data.preprocessed->cppSize);
+                preprocessedDuration = data.preprocessed->duration;
+                preprocessedSlotDuration = data.preprocessed->slotDuration;
+
+                if (data.preprocessed->exitStatus != 0) {
+                    ERROR("Failed to preprocess. Running locally");
+                    runLocal("preprocess error 4");
+                    return 0; // unreachable
+                }
 
-    while (data.watchdog->timedOut()
+                if (!data.preprocessed->available()) {
+                    ERROR("Empty preprocessed output. Running locally");
+                    runLocal("preprocess error 5");
+                    return 0; // unreachable
+                }
+            }
+            if (!builderWebSocket.hasPendingSendData()) {
+                const size_t available = data.preprocessed->available();
+                if (preprocessFinished && sent == available) {
+                    if (stream) {
+                        const std::string finished = json11::Json(json11::Json::object {
+                                { "type", "uploadFinished" },
+                                { "bytes", static_cast<int>(data.uploadSize) }
+                            }).dump();
+                        builderWebSocket.send(WebSocket::Text, finished.c_str(), finished.size());
+                    }
+                    break;
+                }
+                if (available - sent >= Preprocessed::StreamChunkSize || (preprocessFinished && available > sent)) {
+                    if (rawStream) {
+                        // straight from the file to the socket
+                        const size_t len = available - sent;
+                        if (!builderWebSocket.send(data.preprocessed->fd(), sent, len)) {
+                            runLocal("builder raw stream error");
+                            return 0; // unreachable
+                        }
+                        data.uploadSize += len;
+                        sent += len;
+                        continue;
+                    }
+                    if (!data.preprocessed->read(sent, Preprocessed::StreamChunkSize, chunk)) {
+                        runLocal("preprocessed read error");
+                        return 0; // unreachable
+                    }
+                    sent += chunk.size();
+                    if (compressor) {
+                        if (!compressor->compress(chunk.c_str(), chunk.size(), compressed)) {
+                            runLocal("compression error");
+                            return 0; // unreachable
+                        }
+                        data.uploadSize += compressed.size();
+                        builderWebSocket.send(WebSocket::Binary, std::move(compressed));
+                    } else {
+                        data.uploadSize += chunk.size();
+                        builderWebSocket.send(WebSocket::Binary, std::move(chunk));
+                    }
+                    continue;
+                }
+            }
+            select.exec();
+        }
+    }
+
+    while (!data.watchdog->timedOut()
            && builderWebSocket.hasPendingSendData()
            && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
         select.exec();
@@ -560,56 +1138,281 @@ int main(int argc, char **argv)
 
     if (data.watchdog->timedOut()) {
         DEBUG("Have to run locally because we timed out waiting for builder");
+        if (retryBuilder("watchdog upload"))
+            return RetryBuilder;
         runLocal("watchdog upload");
         return 0; // unreachable
     }
 
     if (builderWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
         DEBUG("Have to run locally because something went wrong with the builder");
+        if (retryBuilder("builder connect error 3"))
+            return RetryBuilder;
         runLocal("builder connect error 3");
         return 0; // unreachable
     }
 
     data.watchdog->transition(Watchdog::UploadedJob);
-    if (!releaseCppSlotOnCppFinished) {
+    if (!releaseCppSlotOnCppFinished && data.preprocessed) {
         daemonSocket.send(DaemonSocket::ReleaseCppSlot);
     }
 
-    while (!data.watchdog->timedOut()
-           && !builderWebSocket.done
-           && builderWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
-        select.exec();
+    // A job taking longer than most jobs of its size did gets a second
+    // builder, whichever answers first is used
+    unsigned long long hedgeTime = 0;
+    if (Config::hedge && data.preprocessed && !localCompile) {
+        const unsigned long long percentile = Timings::percentile(Watchdog::Finished, data.preprocessed->cppSize,
+                                                                  Config::hedgePercentile / 100.0);
+        if (percentile)
+            hedgeTime = Client::mono() + std::max<unsigned long long>(percentile, Config::hedgeMinimum);
+    }
+    BuilderWebSocket *builder = &builderWebSocket;
+    while (!data.watchdog->timedOut() && !builder->done) {
+        if (hedge && hedge->responded()) {
+            builder = &hedge->builder();
+            continue;
+        }
+        if (hedge && !hedge->process()) {
+            // a builder error stops the watchdog, we're still waiting
+            // for the first one
+            hedge.reset();
+            if (!builderWebSocket.responded)
+                data.watchdog->rewind(Watchdog::Finished);
+            continue;
+        }
+        if (!hedge && builderWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket)
+            break;
+        int timeout = -1;
+        if (hedgeTime && !hedge) {
+            const unsigned long long now = Client::mono();
+            if (now >= hedgeTime) {
+                hedgeTime = 0;
+                hedge.reset(new Hedge(select));
+                hedge->responseCallback = [&builderWebSocket, &data]() {
+                    builderWebSocket.cancelled = true;
+                    builderWebSocket.close("hedged");
+                    data.hedge = "hedge";
+                };
+                builderWebSocket.responseCallback = [&hedge, &data]() {
+                    hedge->cancel();
+                    data.hedge = "first";
+                };
+                if (!hedge->start(url, headers))
+                    hedge.reset();
+                continue;
+            }
+            timeout = static_cast<int>(hedgeTime - now);
+        }
+        select.exec(timeout);
     }
 
     if (data.watchdog->timedOut()) {
         DEBUG("Have to run locally because we timed out waiting for builder somehow");
+        if (retryBuilder("watchdog builder"))
+            return RetryBuilder;
         runLocal("watchdog builder");
         return 0; // unreachable
     }
 
-    if (!builderWebSocket.done) {
+    if (!builder->done) {
         DEBUG("Have to run locally because something went wrong with the builder, part deux");
+        if (retryBuilder("builder network error"))
+            return RetryBuilder;
         runLocal("builder network error");
         return 0; // unreachable
     }
 
-    if (!builderWebSocket.error.empty()) {
-        DEBUG("Have to run locally because something went wrong with the builder, part trois: %s", builderWebSocket.error.c_str());
+    if (!builder->error.empty()) {
+        DEBUG("Have to run locally because something went wrong with the builder, part trois: %s", builder->error.c_str());
+        if (retryBuilder("builder error"))
+            return RetryBuilder;
         runLocal("builder error");
         return 0; // unreachable
     }
 
-    if (!data.preprocessed->stdErr.empty()) {
+    if (data.preprocessed && !data.preprocessed->stdErr.empty()) {
         fwrite(data.preprocessed->stdErr.c_str(), sizeof(char), data.preprocessed->stdErr.size(), stderr);
     }
     data.watchdog->transition(Watchdog::Finished);
     data.watchdog->stop();
+    Timings::record(*data.watchdog, data.preprocessed ? data.preprocessed->cppSize : 0);
+    Breaker::success(Breaker::Builder, Client::format("%s:%d", data.builderIp.c_str(), data.builderPort));
     schedulerWebsocket.close("builderd");
+    storeInDirectCache(*builder, headers["x-fisk-md5"]);
+    if (!builder->dictionary.empty())
+        saveDictionary(environment, builder->dictionary);
+    reportRemoteFinished();
 
     Client::writeStatistics();
     return data.exitCode;
 }
 
+static std::string dictionaryPath(const std::string &environment)
+{
+    std::string dir = Config::cacheDir;
+    if (dir.empty() || environment.empty())
+        return std::string();
+    return dir + "dictionaries/" + environment;
+}
+
+static void saveDictionary(const std::string &environment, const std::string &dictionary)
+{
+    const std::string path = dictionaryPath(environment);
+    if (path.empty() || !Client::recursiveMkdir(path.substr(0, path.rfind('/') + 1)))
+        return;
+    // other fiskcs might be reading it
+    const std::string tmp = Client::format("%s.%d", path.c_str(), getpid());
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        DEBUG("Failed to open %s for writing (%d %s)", tmp.c_str(), errno, strerror(errno));
+        return;
+    }
+    const bool ok = fwrite(dictionary.c_str(), 1, dictionary.size(), f) == dictionary.size();
+    int ret;
+    EINTRWRAP(ret, fclose(f));
+    if (!ok || ret || rename(tmp.c_str(), path.c_str())) {
+        DEBUG("Failed to write %s (%d %s)", path.c_str(), errno, strerror(errno));
+        unlink(tmp.c_str());
+        return;
+    }
+    DEBUG("Saved %zu byte dictionary for %s", dictionary.size(), environment.c_str());
+}
+
+// The scheduler headers as the JSON fisk-daemon wants for AcquireBuilder
+static json11::Json::object builderRequest(const std::map<std::string, std::string> &headers)
+{
+    json11::Json::object request;
+    for (const auto &header : {
+            std::make_pair("x-fisk-environments", "environment"),
+            std::make_pair("x-fisk-sourcefile", "sourceFile"),
+            std::make_pair("x-fisk-md5", "md5"),
+            std::make_pair("x-fisk-npm-version", "npmVersion"),
+            std::make_pair("x-fisk-builder", "builder"),
+            std::make_pair("x-fisk-client-name", "name"),
+            std::make_pair("x-fisk-user", "user"),
+            std::make_pair("x-fisk-client-hostname", "hostname") }) {
+        auto it = headers.find(header.first);
+        if (it != headers.end())
+            request[header.second] = it->second;
+    }
+    auto it = headers.find("x-fisk-builder-labels");
+    if (it != headers.end()) {
+        json11::Json::array labels;
+        for (const std::string &label : Client::split(it->second, " ")) {
+            if (!label.empty())
+                labels.push_back(label);
+        }
+        request["labels"] = std::move(labels);
+    }
+    it = headers.find("x-fisk-exclude-builders");
+    if (it != headers.end()) {
+        json11::Json::array builders;
+        for (const std::string &builder : Client::split(it->second, " ")) {
+            if (!builder.empty())
+                builders.push_back(builder);
+        }
+        request["excludeBuilders"] = std::move(builders);
+    }
+    return request;
+}
+
+// Asks the scheduler, through fisk-daemon, for manifests of this source
+// compiled elsewhere. If one of them matches our headers a builder that has
+// the object in its cache sends it to us like any other cache hit. Anything
+// going wrong just means we preprocess as usual.
+static bool fetchFromSharedDirectCache(DirectCache &directCache, DaemonSocket &daemonSocket, Select &select,
+                                       std::map<std::string, std::string> headers)
+{
+    Client::Data &data = Client::data();
+    auto waitFor = [&select, &data](const std::function<bool()> &done) {
+        const unsigned long long timeout = Config::sharedDirectCacheTimeout;
+        const unsigned long long start = Client::mono();
+        while (!done() && !data.watchdog->timedOut()) {
+            const unsigned long long elapsed = Client::mono() - start;
+            if (elapsed >= timeout)
+                break;
+            select.exec(static_cast<int>(timeout - elapsed));
+        }
+        return done();
+    };
+    auto daemonDone = [&daemonSocket]() { return daemonSocket.state() != DaemonSocket::Connected; };
+
+    daemonSocket.lookupManifest(directCache.key());
+    if (!waitFor([&]() { return daemonSocket.hasManifestResponse() || daemonDone(); }) || !daemonSocket.hasManifestResponse()) {
+        DEBUG("No manifests from daemon");
+        return false;
+    }
+    const json11::Json entry = directCache.match(daemonSocket.manifestResponse()["entries"]);
+    if (entry.is_null()) {
+        DEBUG("No shared manifest for %s matches our files", directCache.key().c_str());
+        return false;
+    }
+
+    headers["x-fisk-md5"] = entry["md5"].string_value();
+    json11::Json::object request = builderRequest(headers);
+    request["cacheOnly"] = true;
+    daemonSocket.acquireBuilder(std::move(request));
+    if (!waitFor([&]() { return daemonSocket.hasBuilderResponse() || daemonDone(); })
+        || daemonSocket.builderResponse()["type"].string_value() != "builder") {
+        DEBUG("No builder has %s", headers["x-fisk-md5"].c_str());
+        return false;
+    }
+    SchedulerWebSocket assignment;
+    assignment.processMessage(daemonSocket.builderResponse());
+    if ((data.builderHostname.empty() && data.builderIp.empty()) || !data.builderPort) {
+        DEBUG("No builder has %s", headers["x-fisk-md5"].c_str());
+        return false;
+    }
+
+    headers["x-fisk-job-id"] = std::to_string(assignment.jobId);
+    headers["x-fisk-builder-ip"] = data.builderIp;
+    const std::string builderUrl = Client::format("ws://%s:%d/compile",
+                                                  data.builderHostname.empty() ? data.builderIp.c_str() : data.builderHostname.c_str(),
+                                                  data.builderPort);
+    std::string builderSocket;
+    if (Config::builderPool && daemonSocket.capabilities() & DaemonSocket::BuilderPoolCapability)
+        builderSocket = daemonSocket.builderSocket();
+
+    BuilderWebSocket builder;
+    select.add(&builder);
+    bool ok = builder.connect(std::string(builderUrl), headers, builderSocket);
+    ok = ok && waitFor([&builder]() {
+        return builder.state() >= SchedulerWebSocket::ConnectedWebSocket || builder.state() <= WebSocket::None;
+    }) && builder.state() == SchedulerWebSocket::ConnectedWebSocket;
+    // the builder only says so if it has the object, we have nothing to
+    // upload if it doesn't
+    ok = ok && builder.handshakeResponseHeader("x-fisk-cached") == "true";
+    if (ok) {
+        std::vector<std::string> args = data.compilerArgs->commandLine;
+        args[0] = data.builderCompiler;
+        const std::string json = json11::Json(json11::Json::object {
+                { "commandLine", args },
+                { "argv0", data.compiler },
+                { "wait", true },
+                { "bytes", 0 }
+            }).dump();
+        builder.wait = true;
+        builder.send(WebSocket::Text, json.c_str(), json.size());
+        // a resume means it lost the object after the handshake
+        ok = waitFor([&builder]() {
+            return builder.done || !builder.wait || builder.state() != SchedulerWebSocket::ConnectedWebSocket;
+        }) && builder.done && builder.error.empty() && !data.exitCode;
+    }
+    select.remove(&builder);
+    if (!ok) {
+        DEBUG("Failed to get %s from %s", headers["x-fisk-md5"].c_str(), builderUrl.c_str());
+        data.exitCode = 0;
+        return false;
+    }
+
+    DEBUG("Got %s from %s through shared manifest", headers["x-fisk-md5"].c_str(), builderUrl.c_str());
+    std::vector<std::string> includes;
+    for (const json11::Json &file : entry["files"].array_items())
+        includes.push_back(file["path"].string_value());
+    directCache.store(includes, builder.outputs, std::string(), builder.stdOut, builder.stdErr);
+    return true;
+}
+
 static std::string schedulerUrl()
 {
     std::string url = Config::scheduler;
@@ -0,0 +1,23 @@
+// Object cache keys are namespaced by the algorithm that produced them so
+// keys from different algorithms can never collide. Legacy md5 keys have no
+// prefix.
+const algorithms = {
+    md5: /^[0-9a-f]{32}$/,
+    xxh3: /^xxh3-[0-9a-f]{32}$/
+};
+
+function algorithm(key)
+{
+    if (typeof key !== "string")
+        return undefined;
+    for (let name in algorithms) {
+        if (algorithms[name].test(key))
+            return name;
+    }
+    return undefined;
+}
+
+module.exports = {
+    algorithm: algorithm,
+    isValid: key => algorithm(key) !== undefined
+};
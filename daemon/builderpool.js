@@ -0,0 +1,317 @@
+const EventEmitter = require('events');
+const WebSocket = require('ws');
+const http = require('http');
+const path = require('path');
+const Url = require('url');
+const fs = require('fs-extra');
+
+// Control messages on /jobs connections, see builder/server.js
+const End = '{"type":"end"}';
+const Ended = '{"type":"ended"}';
+const JobClosed = '{"type":"jobClosed"}';
+
+// How long to connect fiskcs straight to a builder that doesn't have /jobs
+// before trying again
+const UnsupportedRetry = 5 * 60000;
+
+// A websocket to a builder's /jobs that runs one job at a time
+class Connection extends EventEmitter
+{
+    constructor(key, configVersion, debug)
+    {
+        super();
+        this.key = key;
+        this.debug = debug;
+        this.state = 'connecting';
+        this.supported = false;
+        this.client = undefined;
+        this.idleTimer = undefined;
+        this.ws = new WebSocket(`ws://${key}/jobs`, { headers: { "x-fisk-config-version": configVersion },
+                                                     perMessageDeflate: false });
+        this.ws.on('upgrade', res => {
+            this.supported = res.headers["x-fisk-jobs"] === "true";
+        });
+        this.ws.on('open', () => {
+            if (!this.supported) {
+                this.emit('unsupported');
+                this.close();
+                return;
+            }
+            this.state = 'idle';
+            this.emit('open');
+        });
+        this.ws.on('message', this._onMessage.bind(this));
+        this.ws.on('close', () => {
+            const client = this.client;
+            const begun = this.begun;
+            this.state = 'closed';
+            this.client = undefined;
+            this.begun = undefined;
+            this.ws.removeAllListeners();
+            if (begun)
+                begun(new Error(`Connection to ${this.key} closed`));
+            if (client)
+                client.close();
+            this.emit('close');
+        });
+        this.ws.on('error', err => {
+            if (this.debug)
+                console.error('builder connection error', this.key, err);
+        });
+    }
+
+    // callback gets the headers the builder would have answered fiskc's
+    // handshake with
+    begin(headers, callback)
+    {
+        this.state = 'begin';
+        this.begun = callback;
+        this.ws.send(JSON.stringify({ type: 'begin', headers: headers }));
+    }
+
+    attach(client)
+    {
+        this.state = 'active';
+        this.client = client;
+        client.on('message', msg => {
+            if (this.client === client)
+                this.ws.send(msg);
+        });
+        client.on('close', () => {
+            if (this.client === client)
+                this.end();
+        });
+        client.on('error', err => {
+            if (this.debug)
+                console.error('fiskc connection error', this.key, err);
+        });
+    }
+
+    close()
+    {
+        clearTimeout(this.idleTimer);
+        this.ws.close();
+    }
+
+    // ends the current job, we're idle again once the builder has acked it
+    end()
+    {
+        this.client = undefined;
+        this.state = 'ending';
+        this.ws.send(End);
+    }
+
+    _onMessage(msg)
+    {
+        switch (this.state) {
+        case 'begin': {
+            if (msg === JobClosed) {
+                const begun = this.begun;
+                this.begun = undefined;
+                this.end();
+                begun(new Error(`Builder ${this.key} refused the job`));
+                return;
+            }
+            let json;
+            try {
+                json = JSON.parse(msg);
+            } catch (err) {
+            }
+            if (json && json.type === 'begun') {
+                const begun = this.begun;
+                this.begun = undefined;
+                begun(undefined, json.headers || {});
+            } else if (this.debug) {
+                console.log('builder refused job', this.key, msg);
+            }
+            break; }
+        case 'active':
+            if (msg === JobClosed) {
+                const client = this.client;
+                this.end();
+                client.close();
+            } else {
+                this.client.send(msg);
+            }
+            break;
+        case 'ending':
+            if (msg === Ended) {
+                this.state = 'idle';
+                this.emit('idle');
+            }
+            break;
+        default:
+            console.error('Unexpected message from builder', this.key, this.state, msg);
+            break;
+        }
+    }
+}
+
+// fiskc sends us the handshake it would have sent to the builder and we run
+// the job on a connection to the builder we already have open.
+class BuilderPool extends EventEmitter
+{
+    constructor(option, common, configVersion)
+    {
+        super();
+        this.debug = option("debug");
+        this.file = option("builder-socket", path.join(common.cacheDir(option), "builders"));
+        this.configVersion = configVersion;
+        this.size = option.int("builder-pool-size", 4); // idle connections per builder
+        this.idleTimeout = option.int("builder-pool-idle-timeout", 60000);
+        this.idle = new Map();
+        this.unsupported = new Map();
+        this.server = undefined;
+        this.listening = false;
+        this.wss = new WebSocket.Server({ noServer: true, perMessageDeflate: false });
+        this.wss.on('headers', (headers, req) => {
+            for (let name in req.builderHeaders)
+                headers.push(`${name}: ${req.builderHeaders[name]}`);
+        });
+    }
+
+    close()
+    {
+        if (this.server)
+            this.server.close();
+        try {
+            fs.unlinkSync(this.file);
+        } catch (err) {
+        }
+        this.idle.forEach(connections => connections.forEach(conn => conn.close()));
+        this.idle.clear();
+    }
+
+    listen()
+    {
+        try {
+            fs.unlinkSync(this.file);
+        } catch (err) {
+        }
+        this.server = http.createServer((req, res) => {
+            res.writeHead(404);
+            res.end();
+        });
+        this.server.on('upgrade', this._onUpgrade.bind(this));
+        this.server.on('error', err => {
+            console.error('builder pool server error', err);
+            this.listening = false;
+        });
+        this.server.listen(this.file, () => {
+            fs.chmodSync(this.file, '777');
+            this.listening = true;
+        });
+    }
+
+    _onUpgrade(req, socket, head)
+    {
+        const reject = status => {
+            socket.end(`HTTP/1.1 ${status}\r\nConnection: close\r\n\r\n`);
+        };
+        socket.on('error', err => {
+            if (this.debug)
+                console.error('fiskc socket error', err);
+        });
+        const key = req.headers.host;
+        if (!key || Url.parse(req.url).pathname != "/compile") {
+            reject('400 Bad Request');
+            return;
+        }
+        const unsupported = this.unsupported.get(key);
+        if (unsupported && Date.now() - unsupported < UnsupportedRetry) {
+            reject('503 Service Unavailable');
+            return;
+        }
+
+        const headers = {};
+        for (let name in req.headers) {
+            if (name.startsWith('x-fisk-'))
+                headers[name] = req.headers[name];
+        }
+        this._acquire(key, (err, conn) => {
+            if (err) {
+                reject('502 Bad Gateway');
+                return;
+            }
+            if (socket.destroyed) {
+                this._release(conn);
+                return;
+            }
+            conn.begin(headers, (err, builderHeaders) => {
+                if (err) {
+                    if (this.debug)
+                        console.log('builder pool job failed', key, err.message);
+                    reject('502 Bad Gateway');
+                    return;
+                }
+                if (socket.destroyed) {
+                    conn.end();
+                    return;
+                }
+                req.builderHeaders = builderHeaders;
+                this.wss.handleUpgrade(req, socket, head, ws => conn.attach(ws));
+            });
+        });
+    }
+
+    _acquire(key, callback)
+    {
+        const connections = this.idle.get(key);
+        while (connections && connections.length) {
+            const conn = connections.pop();
+            clearTimeout(conn.idleTimer);
+            if (conn.state == 'idle') {
+                callback(undefined, conn);
+                return;
+            }
+        }
+
+        const conn = new Connection(key, this.configVersion, this.debug);
+        conn.on('idle', () => this._release(conn));
+        conn.on('close', () => this._remove(conn));
+        conn.on('unsupported', () => {
+            console.log('Builder doesn\'t support pooled connections', key);
+            this.unsupported.set(key, Date.now());
+        });
+        let opened = false;
+        conn.once('open', () => {
+            opened = true;
+            callback(undefined, conn);
+        });
+        conn.once('close', () => {
+            if (!opened)
+                callback(new Error(`Failed to connect to ${key}`));
+        });
+    }
+
+    _release(conn)
+    {
+        if (conn.state != 'idle')
+            return;
+        let connections = this.idle.get(conn.key);
+        if (!connections) {
+            connections = [];
+            this.idle.set(conn.key, connections);
+        }
+        if (connections.length >= this.size) {
+            conn.close();
+            return;
+        }
+        connections.push(conn);
+        conn.idleTimer = setTimeout(() => conn.close(), this.idleTimeout);
+    }
+
+    _remove(conn)
+    {
+        const connections = this.idle.get(conn.key);
+        if (!connections)
+            return;
+        const idx = connections.indexOf(conn);
+        if (idx != -1)
+            connections.splice(idx, 1);
+        if (!connections.length)
+            this.idle.delete(conn.key);
+    }
+}
+
+module.exports = BuilderPool;
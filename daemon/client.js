@@ -21,6 +21,12 @@ class Client extends EventEmitter {
         } catch (err) {
         }
         console.log("this is our npm version", this.npmVersion);
+        this.nextId = 0;
+        this.pending = new Map();
+        this.requests = undefined;
+        this.releases = undefined;
+        this.lookups = undefined;
+        this.manifests = undefined;
         if (!this.name) {
             if (this.hostname) {
                 this.name = this.hostname;
@@ -35,13 +41,12 @@ class Client extends EventEmitter {
         console.log("connecting to", url);
 
         let headers = {
-            "x-fisk-port": this.serverPort,
             "x-fisk-config-version": this.configVersion,
             "x-fisk-daemon-name": this.name,
             "x-fisk-npm-version": this.npmVersion
         };
         if (this.hostname)
-            headers["x-fisk-builder-hostname"] = this.hostname;
+            headers["x-fisk-daemon-hostname"] = this.hostname;
 
         this.ws = new WebSocket(url, { headers: headers });
         this.ws.on("open", () => {
@@ -56,16 +61,133 @@ class Client extends EventEmitter {
                 this.ws.close();
                 this.emit("error", msg);
             };
-            console.log("Got message from scheduler", msg);
+            let json;
+            try {
+                json = JSON.parse(msg);
+            } catch (err) {
+            }
+            if (!json || (json.type !== "builders" && json.type !== "manifests") || !Array.isArray(json.responses)) {
+                console.error("Unexpected message from scheduler", msg);
+                return;
+            }
+            json.responses.forEach(response => {
+                const callback = this.pending.get(response.id);
+                if (callback) {
+                    this.pending.delete(response.id);
+                    callback(response.message);
+                }
+            });
         });
         this.ws.on("close", () => {
             this.emit("close");
             if (this.ws)
                 this.ws.removeAllListeners();
             this.ws = undefined;
+            this.requests = undefined;
+            this.releases = undefined;
+            this.lookups = undefined;
+            this.manifests = undefined;
+            const pending = this.pending;
+            this.pending = new Map();
+            pending.forEach(callback => callback({ type: "schedulerUnavailable" }));
         });
     }
 
+    get connected() {
+        return !!this.ws && this.ws.readyState === WebSocket.OPEN;
+    }
+
+    // Requests and releases from all the fiskcs that show up in the same
+    // tick go to the scheduler as one message each
+    acquireBuilder(request, callback) {
+        if (!this.connected) {
+            callback({ type: "schedulerUnavailable" });
+            return undefined;
+        }
+        const id = this._nextId();
+        request.id = id;
+        delete request.type;
+        this.pending.set(id, callback);
+        if (!this.requests) {
+            this.requests = [];
+            setImmediate(() => this._flush());
+        }
+        this.requests.push(request);
+        return id;
+    }
+
+    // callback gets { type: "manifest", entries: [...] }, entries is empty
+    // if the scheduler isn't there
+    lookupManifest(key, callback) {
+        const respond = message => callback({ type: "manifest", entries: (message && message.entries) || [] });
+        if (!this.connected || typeof key !== "string") {
+            respond();
+            return;
+        }
+        const id = this._nextId();
+        this.pending.set(id, respond);
+        if (!this.lookups) {
+            this.lookups = [];
+            setImmediate(() => this._flush());
+        }
+        this.lookups.push({ id: id, key: key });
+    }
+
+    storeManifest(manifest) {
+        if (!this.connected)
+            return;
+        delete manifest.type;
+        if (!this.manifests) {
+            this.manifests = [];
+            setImmediate(() => this._flush());
+        }
+        this.manifests.push(manifest);
+    }
+
+    releaseBuilder(id) {
+        this.pending.delete(id);
+        if (!this.connected)
+            return;
+        if (this.requests) {
+            const idx = this.requests.findIndex(request => request.id === id);
+            if (idx !== -1) {
+                this.requests.splice(idx, 1);
+                return;
+            }
+        }
+        if (!this.releases) {
+            this.releases = [];
+            setImmediate(() => this._flush());
+        }
+        this.releases.push(id);
+    }
+
+    _flush() {
+        if (this.requests) {
+            if (this.requests.length)
+                this.send("acquireBuilders", { requests: this.requests });
+            this.requests = undefined;
+        }
+        if (this.releases) {
+            this.send("releaseBuilders", { ids: this.releases });
+            this.releases = undefined;
+        }
+        if (this.lookups) {
+            this.send("lookupManifests", { lookups: this.lookups });
+            this.lookups = undefined;
+        }
+        if (this.manifests) {
+            this.send("storeManifests", { manifests: this.manifests });
+            this.manifests = undefined;
+        }
+    }
+
+    _nextId() {
+        if (++this.nextId == Math.pow(2, 31) - 1)
+            this.nextId = 1;
+        return this.nextId;
+    }
+
     sendBinary(blob) {
         try {
             this.ws.send(blob);
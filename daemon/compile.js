@@ -12,6 +12,7 @@ class Compile extends EventEmitter
         this.connection = conn;
         this.buffer = new ClientBuffer;
         this.messageLength =  0;
+        this.messageType = undefined;
         this.pid = undefined;
 
         this.connection.on('data', this._onData.bind(this));
@@ -94,6 +95,12 @@ class Compile extends EventEmitter
                 case Constants.AcquireCompileSlot:
                     emit('acquireCompileSlot');
                     continue;
+                case Constants.TryAcquireCompileSlot:
+                    emit('tryAcquireCompileSlot');
+                    continue;
+                case Constants.TryAcquireDesiredSlot:
+                    emit('tryAcquireDesiredSlot');
+                    continue;
                 case Constants.ReleaseCppSlot:
                     emit('releaseCppSlot');
                     continue;
@@ -101,9 +108,10 @@ class Compile extends EventEmitter
                     emit('releaseCompileSlot');
                     continue;
                 case Constants.JSON:
+                case Constants.AcquireBuilder:
                     if (available < 5)
                         break;
-                    this.buffer.read(1);
+                    this.messageType = this.buffer.read(1)[0];
                     this.messageLength = this.buffer.read(4).readUInt32BE();
                     available -= 5;
                     break;
@@ -127,7 +135,7 @@ class Compile extends EventEmitter
                 if (this.debug)
                     console.log("Got json message", msg);
                 // console.log("Got message", msg);
-                this.emit(msg.type, msg);
+                this.emit(this.messageType == Constants.AcquireBuilder ? "acquireBuilder" : msg.type, msg);
             } catch (err) {
                 console.error("Bad JSON received", err);
                 this.connection.destroy();
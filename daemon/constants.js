@@ -1,13 +1,21 @@
 module.exports = {
+    // written next to the socket, fiskc only waits for capabilities from
+    // daemons that have it
+    get Protocol() { return 1; },
+
     // client codes
     get AcquireCppSlot() {  return 1; },
     get AcquireCompileSlot() { return 2; },
     get ReleaseCppSlot() { return 3; },
     get ReleaseCompileSlot() { return 4; },
     get JSON() { return 5; },
+    get AcquireBuilder() { return 6; },
+    get TryAcquireCompileSlot() { return 7; },
+    get TryAcquireDesiredSlot() { return 8; },
 
     // daemon codes
     get CppSlotAcquired() { return 10; },
     get CompileSlotAcquired() { return 11; },
-    get JSONResponse() { return 12; }
+    get JSONResponse() { return 12; },
+    get CompileSlotBusy() { return 13; }
 };
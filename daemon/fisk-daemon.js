@@ -8,7 +8,10 @@ const os = require('os');
 const assert = require('assert');
 const common = require('../common')(option);
 const Server = require('./server');
+const Client = require('./client');
+const BuilderPool = require('./builderpool');
 const Slots = require('./slots');
+const SharedSlots = require('./sharedslots');
 const Constants = require('./constants');
 
 const debug = option('debug');
@@ -39,17 +42,114 @@ server.on('error', (err) => {
     console.error('server error', err);
 });
 
+const client = new Client(option, common.Version);
+let connectTimer;
+client.on('connect', () => {
+    console.log('connected to scheduler');
+});
+
+client.on('error', err => {
+    console.error('client error', err);
+});
+
+client.on('close', () => {
+    console.log('scheduler connection closed');
+    if (!connectTimer) {
+        connectTimer = setTimeout(() => {
+            connectTimer = undefined;
+            console.log('Reconnecting...');
+            client.connect();
+        }, 1000);
+    }
+});
+client.connect();
+
+const builderPool = new BuilderPool(option, common, common.Version);
+if (builderPool.size > 0)
+    builderPool.listen();
+
 const cppSlots = new Slots(option.int('cpp-slots', Math.max(os.cpus().length * 2, 1)), 'cpp', debug);
-const compileSlots = new Slots(option.int('slots', Math.max(os.cpus().length, 1)), 'compile', debug);
+// fiskc holds all of the preprocessed output in memory
+cppSlots.limitMemory(option.int('cpp-memory', Math.floor(os.totalmem() / 4 / (1024 * 1024))) * 1024 * 1024,
+                     option.int('cpp-memory-pressure', 10));
+// fiskcs that map this don't ask us for cpp and compile slots at all, they
+// still do for desired slots so that has to be off. The ones that can't
+// map it get theirs from the same file
+const sharedSlotsFile = server.file + ".slots";
+let sharedSlots;
+if (option('shared-slots')) {
+    sharedSlots = new SharedSlots(sharedSlotsFile, option.int('cpp-slots', Math.max(os.cpus().length * 2, 1)),
+                                  option.int('slots', Math.max(os.cpus().length, 1)), debug);
+    sharedSlots.create();
+} else {
+    SharedSlots.remove(sharedSlotsFile);
+}
+const compileSlots = new Slots(option.int('slots', Math.max(os.cpus().length, 1)), 'compile', debug,
+                               sharedSlots ? 0 : option.int('desired-slots', 0));
+if (sharedSlots) {
+    sharedSlots.limitMemory(cppSlots.budget, cppSlots.pressureLimit);
+    cppSlots.share(sharedSlots.pool(SharedSlots.Cpp));
+    compileSlots.share(sharedSlots.pool(SharedSlots.Compile));
+}
 
 server.on('compile', compile => {
     compile.on("dumpSlots", () => {
         let ret = { cpp: cppSlots.dump(), compile: compileSlots.dump() };
+        if (sharedSlots)
+            ret.shared = sharedSlots.dump();
         if (debug)
             console.log("sending dump", ret);
 
         compile.send(ret);
     });
+    compile.on('capabilities', () => {
+        compile.send({ type: 'capabilities',
+                       acquireBuilder: client.connected,
+                       manifests: client.connected,
+                       tryAcquireCompileSlot: true,
+                       desiredSlots: compileSlots.desired > 0,
+                       builderSocket: builderPool.listening ? builderPool.file : undefined });
+    });
+
+    let builderId;
+    compile.on('acquireBuilder', request => {
+        if (debug)
+            console.log('acquireBuilder', request);
+
+        // fiskc asks again if the builder it got for a cache only request
+        // didn't have the object
+        if (builderId !== undefined)
+            client.releaseBuilder(builderId);
+        // echoed so fiskc can tell a late answer from the one it's waiting for
+        const requestId = request.requestId;
+        delete request.requestId;
+        builderId = client.acquireBuilder(request, response => {
+            if (response.type === 'schedulerUnavailable')
+                builderId = undefined;
+            response.requestId = requestId;
+            compile.send(response);
+        });
+    });
+
+    compile.on('lookupManifest', msg => {
+        if (debug)
+            console.log('lookupManifest', msg.key);
+        client.lookupManifest(msg.key, response => compile.send(response));
+    });
+
+    compile.on('storeManifest', manifest => {
+        if (debug)
+            console.log('storeManifest', manifest.key, manifest.md5);
+        client.storeManifest(manifest);
+    });
+
+    let expectedCppSize;
+    compile.on('expectedCppSize', msg => {
+        if (debug)
+            console.log('expectedCppSize', msg.bytes);
+        expectedCppSize = msg.bytes;
+    });
+
     let requestedCppSlot = false;
     compile.on('acquireCppSlot', () => {
         if (debug)
@@ -57,7 +157,7 @@ server.on('compile', compile => {
 
         assert(!requestedCppSlot);
         requestedCppSlot = true;
-        cppSlots.acquire(compile.id, {pid: compile.pid}, () => {
+        cppSlots.acquire(compile.id, {pid: compile.pid, bytes: expectedCppSize}, () => {
             // compile.send({ type: 'cppSlotAcquired' });
             compile.send(Constants.CppSlotAcquired);
         });
@@ -87,6 +187,47 @@ server.on('compile', compile => {
         });
     });
 
+    // fiskc compiles locally as well as remotely if it gets one of these
+    compile.on('tryAcquireCompileSlot', () => {
+        if (debug)
+            console.log('tryAcquireCompileSlot');
+
+        assert(!requestedCompileSlot);
+        if (!requestedCompileSlot && compileSlots.tryAcquire(compile.id, {pid: compile.pid})) {
+            requestedCompileSlot = true;
+            compile.send(Constants.CompileSlotAcquired);
+        } else {
+            compile.send(Constants.CompileSlotBusy);
+        }
+    });
+
+    // When fiskc asked for a desired slot, for the local vs remote turnaround
+    let desiredStart;
+    let desiredLocal = false;
+    compile.on('tryAcquireDesiredSlot', () => {
+        if (debug)
+            console.log('tryAcquireDesiredSlot');
+
+        assert(!requestedCompileSlot);
+        desiredStart = Date.now();
+        if (!requestedCompileSlot && compileSlots.tryAcquireDesired(compile.id, {pid: compile.pid, desired: true})) {
+            requestedCompileSlot = true;
+            desiredLocal = true;
+            compile.send(Constants.CompileSlotAcquired);
+        } else {
+            compile.send(Constants.CompileSlotBusy);
+        }
+    });
+
+    compile.on('remoteFinished', () => {
+        if (debug)
+            console.log('remoteFinished');
+        if (desiredStart !== undefined && !desiredLocal) {
+            compileSlots.reportTurnaround(false, Date.now() - desiredStart);
+            desiredStart = undefined;
+        }
+    });
+
     compile.on('releaseCompileSlot', () => {
         if (debug)
             console.log('releaseCompileSlot');
@@ -109,11 +250,20 @@ server.on('compile', compile => {
             requestedCompileSlot = false;
             compileSlots.release(compile.id);
         }
+        if (builderId !== undefined) {
+            client.releaseBuilder(builderId);
+            builderId = undefined;
+        }
     });
 
     compile.on('end', () => {
         if (debug)
             console.log("got end from", compile.id, compile.pid);
+        if (desiredLocal) {
+            // fiskc waits for the compiler before it goes away
+            compileSlots.reportTurnaround(true, Date.now() - desiredStart);
+            desiredLocal = false;
+        }
         if (requestedCppSlot) {
             requestedCppSlot = false;
             cppSlots.release(compile.id);
@@ -122,45 +272,24 @@ server.on('compile', compile => {
             requestedCompileSlot = false;
             compileSlots.release(compile.id);
         }
+        if (builderId !== undefined) {
+            client.releaseBuilder(builderId);
+            builderId = undefined;
+        }
     });
 });
 
 process.on('exit', () => {
     server.close();
+    builderPool.close();
+    if (sharedSlots)
+        sharedSlots.close();
 });
 
 process.on('SIGINT', sig => {
     server.close();
+    builderPool.close();
+    if (sharedSlots)
+        sharedSlots.close();
     process.exit();
 });
-
-/*
-  const client = new Client(option, common.Version);
-
-let connectInterval;
-client.on('quit', message => {
-    process.exit(message.code);
-});
-
-client.on('connect', () => {
-    console.log('connected');
-    if (connectInterval) {
-        clearInterval(connectInterval);
-        connectInterval = undefined;
-    }
-});
-
-client.on('error', err => {
-    console.error('client error', err);
-});
-
-client.on('close', () => {
-    console.log('client closed');
-    if (!connectInterval) {
-        connectInterval = setInterval(() => {
-            console.log('Reconnecting...');
-            client.connect();
-        }, 1000);
-    }
-});
-*/
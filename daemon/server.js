@@ -4,6 +4,7 @@ const EventEmitter = require('events');
 const fs = require('fs-extra');
 const ClientBuffer = require('./clientbuffer');
 const Compile = require('./compile');
+const Constants = require('./constants');
 
 class Server extends EventEmitter
 {
@@ -28,6 +29,10 @@ class Server extends EventEmitter
             fs.unlinkSync(this.file);
         } catch (err) {
         }
+        try {
+            fs.unlinkSync(this.file + ".protocol");
+        } catch (err) {
+        }
     }
 
     listen()
@@ -42,6 +47,11 @@ class Server extends EventEmitter
             let connected = false;
             this.server = net.createServer(this._onConnection.bind(this)).listen(this.file, () => {
                 fs.chmodSync(this.file, '777');
+                try {
+                    fs.writeFileSync(this.file + ".protocol", `${Constants.Protocol}\n`, { mode: 0o644 });
+                } catch (err) {
+                    console.error("Failed to write protocol version", err.message);
+                }
                 connected = true;
                 resolve();
             });
@@ -0,0 +1,251 @@
+const fs = require('fs');
+const os = require('os');
+const Slots = require('./slots');
+
+// cpp and compile slots fiskc takes and gives back itself, without asking us.
+// We can't do atomics on a mapped file from node so fiskc's SharedSlots does
+// most of it. Native endian:
+//
+// uint32 magic, uint32 our pid, uint64 the inode of our pid namespace, uint32
+// cpp slots, uint32 compile slots, uint32 cpp generation, uint32 compile
+// generation, uint32 cpp reserved, uint32 compile reserved, uint32 memory
+// pressure, uint32 unused, uint64 cpp memory budget, uint64 cpp bytes,
+// uint64 our cpp bytes followed by a uint64 for each cpp slot, then each
+// compile slot: 0 for a free one, otherwise the pid of the fiskc holding it
+// in the low 22 bits and when it started, in clock ticks since boot, in the
+// rest. Then a uint64 for each cpp slot, the bytes of preprocessed output
+// its fiskc expects. A fiskc that finds a slot held by a process that's gone
+// takes it over. Only our user can open it, anyone else's fiskcs ask us over
+// the socket.
+//
+// Those get the last slots of a pool, reserved is how many of them we've
+// given out. Only we write it and fiskcs don't take reserved slots. We bump
+// it and then look at the slot, fiskc takes the slot and then looks at
+// reserved and gives it back if it has to, so we can't both have it.
+//
+// fiskcs add to cpp bytes and we write what our own clients expect, each of
+// us checks the sum against the budget after adding to it. Memory pressure
+// is set while it's over the limit, fiskcs look at it every now and then.
+class SharedSlots
+{
+    constructor(file, cpp, compile, debug)
+    {
+        this.file = file;
+        this.cpp = cpp;
+        this.compile = compile;
+        this.debug = debug;
+        this.fd = undefined;
+        this.reserved = [ 0, 0 ];
+        this.budget = 0;
+        this.cppBytes = 0;
+        this.pressureTimer = undefined;
+    }
+
+    create()
+    {
+        const buffer = Buffer.alloc(SharedSlots.HeaderSize + (((this.cpp * 2) + this.compile) * 8));
+        const write = (os.endianness() == "LE" ? buffer.writeUInt32LE : buffer.writeUInt32BE).bind(buffer);
+        write(SharedSlots.Magic, 0);
+        write(process.pid, 4);
+        const pidNamespace = SharedSlots.pidNamespace();
+        const high = Math.floor(pidNamespace / 0x100000000), low = pidNamespace % 0x100000000;
+        write(os.endianness() == "LE" ? low : high, 8);
+        write(os.endianness() == "LE" ? high : low, 12);
+        write(this.cpp, 16);
+        write(this.compile, 20);
+        // fiskcs that still have the last one mapped keep using it until
+        // they're done, they'll see that the daemon they had is gone
+        const tmp = `${this.file}.${process.pid}`;
+        fs.writeFileSync(tmp, buffer, { mode: 0o600 });
+        fs.chmodSync(tmp, 0o600);
+        fs.renameSync(tmp, this.file);
+        this.fd = fs.openSync(this.file, "r+");
+        if (this.debug)
+            console.log("Created shared slots", this.file, this.cpp, this.compile);
+    }
+
+    // Like Slots.limitMemory(), fiskcs go by these for cpp slots
+    limitMemory(budget, pressureLimit)
+    {
+        if (this.fd === undefined)
+            return;
+        this.budget = budget;
+        this._write64(SharedSlots.BudgetOffset, budget);
+        if (pressureLimit && !this.pressureTimer) {
+            this.pressureTimer = setInterval(() => {
+                this._write32(SharedSlots.PressureOffset, Slots.memoryPressure() >= pressureLimit ? 1 : 0);
+            }, Slots.PressureInterval);
+            this.pressureTimer.unref();
+        }
+    }
+
+    close()
+    {
+        if (this.pressureTimer) {
+            clearInterval(this.pressureTimer);
+            this.pressureTimer = undefined;
+        }
+        if (this.fd !== undefined) {
+            fs.closeSync(this.fd);
+            this.fd = undefined;
+        }
+        SharedSlots.remove(this.file);
+    }
+
+    // For Slots, takes the next slot of pool from the end for a fiskc that
+    // asked over the socket
+    pool(pool)
+    {
+        return { reserve: bytes => this._reserve(pool, bytes), release: bytes => this._release(pool, bytes) };
+    }
+
+    _reserve(pool, bytes)
+    {
+        const count = pool == SharedSlots.Cpp ? this.cpp : this.compile;
+        if (this.fd === undefined || this.reserved[pool] >= count)
+            return false;
+        this._writeReserved(pool, this.reserved[pool] + 1);
+        const index = (pool == SharedSlots.Cpp ? 0 : this.cpp) + count - this.reserved[pool];
+        const owner = Buffer.alloc(8);
+        fs.readSync(this.fd, owner, 0, 8, SharedSlots.HeaderSize + (index * 8));
+        const pid = (os.endianness() == "LE" ? owner.readUInt32LE(0) : owner.readUInt32BE(4)) & SharedSlots.PidMask;
+        // a fiskc has it, or had it and is gone in which case fiskcs leave
+        // it to us now
+        if (pid && SharedSlots.alive(pid)) {
+            this._writeReserved(pool, this.reserved[pool] - 1);
+            return false;
+        }
+        if (pool == SharedSlots.Cpp && !this._reserveBytes(bytes || 0)) {
+            this._writeReserved(pool, this.reserved[pool] - 1);
+            return false;
+        }
+        return true;
+    }
+
+    _release(pool, bytes)
+    {
+        if (this.fd === undefined || !this.reserved[pool])
+            return;
+        if (pool == SharedSlots.Cpp && bytes) {
+            this.cppBytes -= bytes;
+            this._write64(SharedSlots.DaemonBytesOffset, this.cppBytes);
+        }
+        this._writeReserved(pool, this.reserved[pool] - 1);
+    }
+
+    _reserveBytes(bytes)
+    {
+        this.cppBytes += bytes;
+        this._write64(SharedSlots.DaemonBytesOffset, this.cppBytes);
+        const others = this._read64(SharedSlots.CppBytesOffset) + this.cppBytes - bytes;
+        // with nothing else going it'll have to run sometime anyway
+        if (others && ((this.budget && others + bytes > this.budget) || this._read32(SharedSlots.PressureOffset))) {
+            this.cppBytes -= bytes;
+            this._write64(SharedSlots.DaemonBytesOffset, this.cppBytes);
+            return false;
+        }
+        return true;
+    }
+
+    _writeReserved(pool, reserved)
+    {
+        this.reserved[pool] = reserved;
+        this._write32(SharedSlots.ReservedOffset + (pool * 4), reserved);
+    }
+
+    _write32(offset, value)
+    {
+        const buffer = Buffer.alloc(4);
+        (os.endianness() == "LE" ? buffer.writeUInt32LE : buffer.writeUInt32BE).call(buffer, value, 0);
+        fs.writeSync(this.fd, buffer, 0, 4, offset);
+    }
+
+    _read32(offset)
+    {
+        const buffer = Buffer.alloc(4);
+        fs.readSync(this.fd, buffer, 0, 4, offset);
+        return os.endianness() == "LE" ? buffer.readUInt32LE(0) : buffer.readUInt32BE(0);
+    }
+
+    _write64(offset, value)
+    {
+        const buffer = Buffer.alloc(8);
+        (os.endianness() == "LE" ? buffer.writeBigUInt64LE : buffer.writeBigUInt64BE).call(buffer, BigInt(Math.max(value, 0)), 0);
+        fs.writeSync(this.fd, buffer, 0, 8, offset);
+    }
+
+    _read64(offset)
+    {
+        const buffer = Buffer.alloc(8);
+        fs.readSync(this.fd, buffer, 0, 8, offset);
+        return Number(os.endianness() == "LE" ? buffer.readBigUInt64LE(0) : buffer.readBigUInt64BE(0));
+    }
+
+    dump()
+    {
+        let buffer;
+        try {
+            buffer = fs.readFileSync(this.file);
+        } catch (err) {
+            return { error: err.message };
+        }
+        const read = (os.endianness() == "LE" ? buffer.readUInt32LE : buffer.readUInt32BE).bind(buffer);
+        const pool = (offset, count) => {
+            let used = {};
+            for (let i=0; i<count; ++i) {
+                // the low half has all of the pid
+                const at = SharedSlots.HeaderSize + ((offset + i) * 8);
+                const pid = read(os.endianness() == "LE" ? at : at + 4) & SharedSlots.PidMask;
+                if (pid)
+                    used[i] = { pid: pid };
+            }
+            return { used: used, capacity: count };
+        };
+        return { file: this.file, cpp: pool(0, this.cpp), compile: pool(this.cpp, this.compile),
+                 reserved: { cpp: this.reserved[SharedSlots.Cpp], compile: this.reserved[SharedSlots.Compile] },
+                 memory: { budget: this.budget, daemonBytes: this.cppBytes,
+                           bytes: this.fd !== undefined ? this._read64(SharedSlots.CppBytesOffset) : undefined } };
+    }
+
+    static pidNamespace()
+    {
+        try {
+            // pid:[4026531836]
+            const match = /\[([0-9]+)\]/.exec(fs.readlinkSync("/proc/self/ns/pid"));
+            return match ? parseInt(match[1]) : 0;
+        } catch (err) {
+            return 0;
+        }
+    }
+
+    static alive(pid)
+    {
+        try {
+            process.kill(pid, 0);
+            return true;
+        } catch (err) {
+            return err.code == "EPERM";
+        }
+    }
+
+    static remove(file)
+    {
+        try {
+            fs.unlinkSync(file);
+        } catch (err) {
+        }
+    }
+}
+
+SharedSlots.Magic = 0x66737334; // fss4
+SharedSlots.HeaderSize = 72;
+SharedSlots.ReservedOffset = 32;
+SharedSlots.PressureOffset = 40;
+SharedSlots.BudgetOffset = 48;
+SharedSlots.CppBytesOffset = 56;
+SharedSlots.DaemonBytesOffset = 64;
+SharedSlots.Cpp = 0;
+SharedSlots.Compile = 1;
+SharedSlots.PidMask = 0x3fffff;
+
+module.exports = SharedSlots;
@@ -1,24 +1,55 @@
 const EventEmitter = require('events');
 const assert = require('assert');
+const fs = require('fs');
 
 class Slots extends EventEmitter
 {
-    constructor(count, name, debug)
+    constructor(count, name, debug, desired)
     {
         super();
         this.count = count;
+        // Local first: up to this many jobs compile here, the rest go to
+        // builders. Adapts to which of the two turns jobs around faster
+        this.desired = Math.min(desired || 0, count);
+        this.desiredUsed = new Set();
+        this.turnaround = { local: undefined, remote: undefined, samples: 0 };
         this.name = name;
         this.used = new Map();
         this.debug = debug;
         this.pending = new Map();
+        this.budget = 0;
+        this.budgetUsed = 0;
+        this.pressureLimit = 0;
+        this.costs = new Map();
+        this.averageBytes = undefined;
+        this.admitTimer = undefined;
+        this.shared = undefined;
         if (this.debug)
             console.log("Slots created", this.toString());
     }
 
+    // Admit against the bytes jobs expect to produce, data.bytes, as well
+    // as the count, and not while the machine is under memory pressure:
+    // Linux PSI's share of the last 10 seconds some task stalled on memory,
+    // in percent. 0 turns either off
+    limitMemory(budget, pressureLimit)
+    {
+        this.budget = budget;
+        this.pressureLimit = pressureLimit;
+    }
+
+    // With --shared-slots fiskcs take slots straight from a file, ours come
+    // from the same one so there's just the one set. shared is from
+    // SharedSlots.pool()
+    share(shared)
+    {
+        this.shared = shared;
+    }
+
     acquire(id, data, cb)
     {
-        if (this.used.size < this.count) {
-            this.used.set(id, data);
+        if (!this.pending.size && this._fits(data)) {
+            this._take(id, data);
             if (this.debug)
                 console.log("acquired slot", id, data, this.toString());
             cb();
@@ -26,26 +57,154 @@ class Slots extends EventEmitter
             if (this.debug)
                 console.log("pending slot", id, this.toString());
             this.pending.set(id, {data: data, cb: cb});
+            this._scheduleAdmit();
+        }
+    }
+
+    // Only if there's a free slot and nobody is waiting for one
+    tryAcquire(id, data)
+    {
+        if (this.pending.size || !this._fits(data)) {
+            if (this.debug)
+                console.log("no free slot", id, this.toString());
+            return false;
+        }
+        this._take(id, data);
+        if (this.debug)
+            console.log("acquired slot", id, data, this.toString());
+        return true;
+    }
+
+    tryAcquireDesired(id, data)
+    {
+        if (this.desiredUsed.size >= this.desired || !this.tryAcquire(id, data))
+            return false;
+        this.desiredUsed.add(id);
+        return true;
+    }
+
+    // ms from asking for a desired slot to the job being done, either
+    // compiled here or, if there wasn't one, by a builder
+    reportTurnaround(local, ms)
+    {
+        if (!this.desired)
+            return;
+        const key = local ? "local" : "remote";
+        const average = this.turnaround[key];
+        this.turnaround[key] = average === undefined ? ms : average + ((ms - average) * Slots.TurnaroundWeight);
+        if (this.turnaround.local === undefined || this.turnaround.remote === undefined
+            || ++this.turnaround.samples < Slots.TurnaroundSamples) {
+            return;
+        }
+        this.turnaround.samples = 0;
+        // more local jobs make each of them slower so this settles. Never
+        // below one, we'd stop knowing how fast local is
+        const old = this.desired;
+        if (this.turnaround.local < this.turnaround.remote * 0.9 && this.desired < this.count) {
+            ++this.desired;
+        } else if (this.turnaround.local > this.turnaround.remote * 1.1 && this.desired > 1) {
+            --this.desired;
         }
+        if (this.debug && old != this.desired)
+            console.log("desired slots", old, "->", this.desired, this.turnaround);
     }
 
     release(id)
     {
         this.pending.delete(id);
+        this.desiredUsed.delete(id);
         if (this.used.has(id)) {
             let data = this.used.get(id);
             this.used.delete(id);
+            this.budgetUsed -= this.costs.get(id);
+            if (this.shared)
+                this.shared.release(this.costs.get(id));
+            this.costs.delete(id);
             assert(this.used.size < this.count);
-            assert(this.used.size + 1 == this.count || this.pending.size == 0);
+            assert(this.budget || this.pressureLimit || this.shared || this.used.size + 1 == this.count || this.pending.size == 0);
             if (this.debug)
                 console.log("released", id, data, this.toString());
-            for (let p of this.pending) {
-                this.used.set(p[0], p[1].data);
-                this.pending.delete(p[0]);
-                p[1].cb();
+            this._admit();
+       }
+    }
+
+    _cost(data)
+    {
+        if (!this.budget)
+            return 0;
+        // what jobs that didn't say tend to produce
+        return data && data.bytes > 0 ? data.bytes : (this.averageBytes || 0);
+    }
+
+    // Takes a shared slot if it does
+    _fits(data)
+    {
+        if (this.used.size >= this.count)
+            return false;
+        // with nothing running it'll have to run sometime anyway
+        if (this.used.size) {
+            if (this.budget && this.budgetUsed + this._cost(data) > this.budget)
+                return false;
+            if (this.pressureLimit && Slots.memoryPressure() >= this.pressureLimit)
+                return false;
+        }
+        return !this.shared || this.shared.reserve(this._cost(data));
+    }
+
+    _take(id, data)
+    {
+        if (this.budget && data && data.bytes > 0) {
+            this.averageBytes = this.averageBytes === undefined
+                ? data.bytes
+                : this.averageBytes + ((data.bytes - this.averageBytes) * Slots.TurnaroundWeight);
+        }
+        const cost = this._cost(data);
+        this.used.set(id, data);
+        this.costs.set(id, cost);
+        this.budgetUsed += cost;
+    }
+
+    // in order, the first one that doesn't fit waits for the next release
+    _admit()
+    {
+        for (let p of this.pending) {
+            if (!this._fits(p[1].data))
                 break;
+            this.pending.delete(p[0]);
+            this._take(p[0], p[1].data);
+            if (this.debug)
+                console.log("acquired slot", p[0], p[1].data, this.toString());
+            p[1].cb();
+        }
+        this._scheduleAdmit();
+    }
+
+    // pressure goes down, and fiskcs give back shared slots, without
+    // anything being released here
+    _scheduleAdmit()
+    {
+        if ((!this.pressureLimit && !this.shared) || !this.pending.size || this.admitTimer)
+            return;
+        this.admitTimer = setTimeout(() => {
+            this.admitTimer = undefined;
+            this._admit();
+        }, this.shared ? Slots.SharedInterval : Slots.PressureInterval);
+    }
+
+    static memoryPressure()
+    {
+        const now = Date.now();
+        if (Slots.pressure === undefined || now - Slots.pressureTime >= Slots.PressureInterval) {
+            Slots.pressureTime = now;
+            try {
+                const match = /^some avg10=([0-9.]+)/.exec(fs.readFileSync("/proc/pressure/memory", "utf8"));
+                Slots.pressure = match ? parseFloat(match[1]) : 0;
+            } catch (err) {
+                // not Linux, or no PSI
+                Slots.pressure = 0;
             }
-       }
+        }
+        return Slots.pressure;
     }
     toString()
     {
@@ -62,8 +221,19 @@ class Slots extends EventEmitter
         for (let p of this.used) {
             used[p[0]] = p[1];
         }
-        return { used: used, pending: pending, capacity: this.count, used: this.used.size };
+        return { used: used, pending: pending, capacity: this.count, usedCount: this.used.size,
+                 desired: this.desired, desiredUsed: this.desiredUsed.size,
+                 localTurnaround: this.turnaround.local, remoteTurnaround: this.turnaround.remote,
+                 memory: this.budget || this.pressureLimit ? {
+                     budget: this.budget, used: this.budgetUsed, averageBytes: this.averageBytes,
+                     pressure: Slots.memoryPressure(), pressureLimit: this.pressureLimit
+                 } : undefined };
     }
 }
 
+Slots.TurnaroundWeight = 0.2;
+Slots.TurnaroundSamples = 8;
+Slots.PressureInterval = 1000;
+Slots.SharedInterval = 50;
+
 module.exports = Slots;
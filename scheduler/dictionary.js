@@ -0,0 +1,49 @@
+const fs = require('fs-extra');
+const path = require('path');
+const child_process = require('child_process');
+const mktemp = require('mktemp');
+
+// Trains a zstd dictionary for an environment from samples of its
+// preprocessed uploads with zstd --train (ZDICT). What it picks up is the
+// system and library headers every TU for the compiler includes. fiskc
+// compresses with it and the builders decompress with it, both keep it as
+// is so it's identified by its md5.
+const MaxSize = 112640; // zstd's default, fiskc digests it once per job
+
+function train(samples, zstd)
+{
+    return mktemp.createDir("/tmp/fisk_dictionaryXXXX").then(tmpdir => {
+        const files = samples.map((sample, idx) => path.join(tmpdir, `sample${idx}`));
+        const output = path.join(tmpdir, "dictionary");
+        const remove = () => {
+            try {
+                fs.removeSync(tmpdir);
+            } catch (e) {
+                console.error("Got an error removing the temp dir", tmpdir);
+            }
+        };
+        return Promise.all(files.map((file, idx) => fs.writeFile(file, samples[idx]))).then(() => {
+            return new Promise((resolve, reject) => {
+                const args = [ "--train", "-q", `--maxdict=${MaxSize}`, "-o", output ].concat(files);
+                child_process.execFile(zstd || "zstd", args, (err, stdout, stderr) => {
+                    if (err) {
+                        reject(new Error(`zstd --train failed: ${stderr.trim() || err.message}`));
+                        return;
+                    }
+                    resolve(fs.readFile(output));
+                });
+            });
+        }).then(data => {
+            remove();
+            return data;
+        }, err => {
+            remove();
+            throw err;
+        });
+    });
+}
+
+module.exports = {
+    MaxSize: MaxSize,
+    train: train
+};
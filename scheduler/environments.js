@@ -2,6 +2,7 @@ const fs = require('fs-extra');
 const path = require('path');
 const child_process = require('child_process');
 const mktemp = require('mktemp');
+const crypto = require('crypto');
 
 function untarFile(archive, file, encoding)
 {
@@ -200,6 +201,7 @@ class Links {
 const environments = {
     _data: {}, // key: hash, value: class Environment
     _links: {}, // key: srcHash, value: class Links { targetHash, LinkProperties { arguments, blacklist } }
+    _dictionaries: {}, // key: hash, value: { id, data }, zstd dictionaries for uploads, next to the tarballs as <hash>.dict
     _path: undefined,
     _db: undefined,
 
@@ -238,6 +240,9 @@ const environments = {
                                     }).catch(err => {
                                         console.error("Failed to extract compiler_info", err);
                                     }));
+                                    promises.push(fs.readFile(path.join(p, `${hash}.dict`)).then(data => {
+                                        environments._addDictionary(hash, data);
+                                    }).catch(() => {}));
                                 }
                             });
                             Promise.all(promises).then(() => {
@@ -357,6 +362,24 @@ const environments = {
         return environments._data[hash];
     },
 
+    dictionary(hash) {
+        return environments._dictionaries[hash];
+    },
+
+    setDictionary(hash, data) {
+        if (!(hash in environments._data))
+            return Promise.reject(new Error(`No environment ${hash}`));
+        return fs.writeFile(path.join(environments._path, `${hash}.dict`), data).then(() => {
+            return environments._addDictionary(hash, data);
+        });
+    },
+
+    _addDictionary(hash, data) {
+        const dictionary = { id: crypto.createHash("md5").update(data).digest("hex"), data: data };
+        environments._dictionaries[hash] = dictionary;
+        return dictionary;
+    },
+
     linksInfo() {
         let obj = {};
         for (let srcHash in this._links) {
@@ -372,6 +395,10 @@ const environments = {
     remove(hash) { // ### this should be promisified
         try {
             fs.removeSync(environments._data[hash].path);
+            if (hash in environments._dictionaries) {
+                fs.removeSync(path.join(environments._path, `${hash}.dict`));
+                delete environments._dictionaries[hash];
+            }
             delete environments._data[hash];
             this.unlink(hash);
             this.unlink(undefined, hash);
@@ -16,6 +16,7 @@ const crypto = require("crypto");
 const Database = require("./database");
 const Peak = require("./peak");
 const ObjectCacheManager = require("./objectcachemanager");
+const Dictionary = require("./dictionary");
 const compareVersions = require("compare-versions");
 const humanizeDuration = require("humanize-duration");
 const wol = require("wake_on_lan");
@@ -236,6 +237,8 @@ function jobFinished(builder, job)
             cppSize: job.cppSize,
             compileDuration: job.compileDuration,
             uploadDuration: job.uploadDuration,
+            uploadBytes: job.uploadBytes,
+            compressionRatio: job.compressionRatio,
             jobs: jobs,
             jobsStarted: jobsStarted,
             jobsFailed: jobsFailed,
@@ -424,8 +427,33 @@ function syncEnvironments(builder)
     if (needs.length) {
         builder.send({ type: "getEnvironments", environments: needs });
     }
+    syncDictionaries(builder);
 }
 
+// Builders need the dictionaries of their environments to decompress uploads
+// compressed with them and hand them to fiskcs that don't have them yet
+function syncDictionaries(builder)
+{
+    if (!builder) {
+        forEachBuilder(syncDictionaries);
+        return;
+    }
+    if (!builder.dictionaries)
+        builder.dictionaries = {};
+    for (let env in builder.environments) {
+        const dictionary = Environments.dictionary(env);
+        if (dictionary && builder.dictionaries[env] !== dictionary.id) {
+            builder.dictionaries[env] = dictionary.id;
+            builder.send({ type: "dictionary", environment: env, id: dictionary.id, data: dictionary.data.toString("base64") });
+        }
+    }
+}
+
+// environment -> samples of uploads from builders, until there are enough to
+// train a dictionary from
+const dictionarySamples = {};
+const dictionarySampleCount = option.int("dictionary-samples", 32);
+
 function environmentsInfo()
 {
     let ret = Object.assign({}, Environments.environments);
@@ -662,6 +690,30 @@ server.on("builder", builder => {
         syncEnvironments(builder);
     });
 
+    builder.on("dictionarySample", msg => {
+        const env = msg.environment;
+        if (!dictionarySampleCount || !Environments.hasEnvironment(env) || Environments.dictionary(env) || typeof msg.data !== "string")
+            return;
+        let samples = dictionarySamples[env];
+        if (!samples)
+            samples = dictionarySamples[env] = [];
+        if (samples.length >= dictionarySampleCount) // training
+            return;
+        samples.push(Buffer.from(msg.data, "base64"));
+        if (samples.length < dictionarySampleCount)
+            return;
+        Dictionary.train(samples, option("zstd", "zstd")).then(dictionary => {
+            return Environments.setDictionary(env, dictionary).then(() => {
+                console.log(`Trained a ${dictionary.length} byte dictionary for ${env} from ${samples.length} samples`);
+                delete dictionarySamples[env];
+                syncDictionaries();
+            });
+        }).catch(err => {
+            console.error("Failed to train a dictionary for", env, err.message);
+            delete dictionarySamples[env];
+        });
+    });
+
     builder.on("log", event => {
         addLogFile({ source: "builder", ip: builder.ip, contents: event.message });
     });
@@ -720,6 +772,12 @@ function requestEnvironment(compile)
 {
     if (compile.environment in pendingEnvironments)
         return false;
+    if (compile.canUploadEnvironment === false) {
+        // came in through a daemon, fiskc has to connect to us directly to
+        // upload it
+        compile.send({ type: "needsEnvironment" });
+        return true;
+    }
     pendingEnvironments[compile.environment] = true;
 
     console.log(`Asking ${compile.name} ${compile.ip} to upload ${compile.environment}`);
@@ -801,6 +859,26 @@ server.on("clientVerify", clientVerify => {
     }
 });
 
+server.on("daemon", daemon => {
+    console.log("Got daemon", daemon.ip, daemon.name);
+    daemon.on("close", () => {
+        console.log("Daemon disconnected", daemon.ip, daemon.name);
+    });
+    daemon.on("error", err => {
+        console.error(`daemon error '${err}' from ${daemon.ip}`);
+    });
+    daemon.on("lookupManifests", lookups => {
+        daemon.send({
+            type: "manifests",
+            responses: lookups.map(lookup => ({ id: lookup.id, message: { entries: objectCache ? objectCache.manifest(lookup.key) : [] } }))
+        });
+    });
+    daemon.on("storeManifests", manifests => {
+        if (objectCache)
+            manifests.forEach(manifest => objectCache.insertManifest(manifest));
+    });
+});
+
 server.on("compile", compile => {
     sendWols();
     compile.on("log", event => {
@@ -847,6 +925,9 @@ server.on("compile", compile => {
         if (compile.builder && compile.builder != s.ip && compile.builder != s.name)
             return false;
 
+        if (compile.excludeBuilders && compile.excludeBuilders.indexOf(`${s.ip}:${s.port}`) !== -1)
+            return false;
+
         if (compile.labels) {
             for (let i=0; i<compile.labels.length; ++i) {
                 if (!s.labels || s.labels.indexOf(compile.labels[i]) === -1) {
@@ -872,6 +953,11 @@ server.on("compile", compile => {
             });
         }
     }
+    if (!builder && compile.cacheOnly) {
+        // fiskc found the md5 in a manifest and only wants the object
+        compile.send("builder", {});
+        return;
+    }
     if (!builder) {
         forEachBuilder(s => {
             if (!filterBuilder(s)) {
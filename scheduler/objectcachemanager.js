@@ -1,4 +1,10 @@
 const EventEmitter = require("events");
+const bytes = require("bytes");
+const cacheKey = require("../common/cachekey");
+
+// Different sets of headers a source file has been compiled with that we
+// remember
+const MaxManifestEntries = 4;
 
 function prettysize(bytes)
 {
@@ -68,6 +74,11 @@ class ObjectCacheManager extends EventEmitter
             this.redundancy = 1;
         this.distributeOnInsertion = option("distribute-object-cache-on-insertion") || false;
         this.distributeOnCacheHit = option("distribute-object-cache-on-cache-hit") || false;
+        // fiskc's direct cache key -> [{ files: [{ path, size, hash }], md5 }]
+        // in least recently used order
+        this.manifests = new Map();
+        this.manifestsSize = 0;
+        this.maxManifestsSize = bytes.parse(option("object-cache-manifests-size", "128mb"));
     }
 
     clear()
@@ -90,10 +101,59 @@ class ObjectCacheManager extends EventEmitter
         return this.byMd5.get(md5);
     }
 
+    // The manifests for key whose objects still are in the cache
+    manifest(key)
+    {
+        const entries = this.manifests.get(key);
+        if (!entries)
+            return [];
+        this.manifests.delete(key);
+        this.manifests.set(key, entries);
+        return entries.filter(entry => this.byMd5.has(entry.md5)).map(entry => ({ files: entry.files, md5: entry.md5 }));
+    }
+
+    insertManifest(msg)
+    {
+        if (typeof msg.key !== "string" || !Array.isArray(msg.files) || !cacheKey.isValid(msg.md5)) {
+            console.error("insertManifest: Bad manifest", msg.key, msg.md5);
+            return;
+        }
+        let entries = this.manifests.get(msg.key);
+        if (entries) {
+            this.manifests.delete(msg.key);
+            entries = entries.filter(entry => {
+                if (entry.md5 != msg.md5 && this.byMd5.has(entry.md5))
+                    return true;
+                this.manifestsSize -= entry.size;
+                return false;
+            });
+        } else {
+            entries = [];
+        }
+        const entry = { files: msg.files, md5: msg.md5, size: msg.key.length };
+        msg.files.forEach(file => { entry.size += (file.path ? file.path.length : 0) + (file.hash ? file.hash.length : 0) + 32; });
+        entries.unshift(entry);
+        this.manifestsSize += entry.size;
+        while (entries.length > MaxManifestEntries)
+            this.manifestsSize -= entries.pop().size;
+        this.manifests.set(msg.key, entries);
+
+        for (let [key, old] of this.manifests) {
+            if (this.manifestsSize <= this.maxManifestsSize || key == msg.key)
+                break;
+            old.forEach(entry => { this.manifestsSize -= entry.size; });
+            this.manifests.delete(key);
+        }
+    }
+
     insert(msg, node)
     {
         let nodeData = this.byNode.get(node);
         console.log("adding", msg.sourceFile, msg.md5, "for", node.ip + ":" + node.port, nodeData ? nodeData.md5s.length : -1);
+        if (!cacheKey.isValid(msg.md5)) {
+            console.error("insert: Bad cache key", msg.md5, "from", node.ip + ":" + node.port);
+            return;
+        }
         if (nodeData) {
             nodeData.md5s.push(msg.md5);
             nodeData.size = msg.cacheSize;
@@ -136,9 +196,12 @@ class ObjectCacheManager extends EventEmitter
             console.log("We already have", node.ip + ":" + node.port);
             return;
         }
-        let md5s = data.md5s.map(item => item.md5);
+        const items = data.md5s.filter(item => cacheKey.isValid(item.md5));
+        if (items.length != data.md5s.length)
+            console.error("Ignoring", data.md5s.length - items.length, "bad cache keys from", node.ip + ":" + node.port);
+        let md5s = items.map(item => item.md5);
         this.byNode.set(node, new NodeData(data.cacheSize, data.maxSize, md5s));
-        data.md5s.forEach(item => {
+        items.forEach(item => {
             addToMd5Map(this.byMd5, item.md5, item.fileSize, node);
         });
     }
@@ -162,6 +225,8 @@ class ObjectCacheManager extends EventEmitter
         }
         let ret = {
             hits: this.hits,
+            manifests: this.manifests.size,
+            manifestsSize: prettysize(this.manifestsSize)
         };
 
         if ("nodes" in query) {
@@ -5,6 +5,7 @@ const http = require("http");
 const express = require("express");
 const path = require("path");
 const crypto = require("crypto");
+const cacheKey = require("../common/cachekey");
 
 class Client extends EventEmitter {
     constructor(object) {
@@ -79,7 +80,49 @@ Client.Type = {
     Compile: 1,
     UploadEnvironment: 2,
     Monitor: 3,
-    ClientVerify: 4
+    ClientVerify: 4,
+    Daemon: 5
+};
+
+// A builder request from a fiskc that came in over a daemon connection. It
+// looks like a compile client to fisk-scheduler.js but its responses are
+// batched on the daemon's websocket and it's closed when the daemon releases
+// it or goes away.
+class DaemonJob extends EventEmitter {
+    constructor(daemon, id, object) {
+        super();
+        this.daemon = daemon;
+        this.id = id;
+        this.created = new Date();
+        this.canUploadEnvironment = false;
+        for (let key in object) {
+            this[key] = object[key];
+        }
+    }
+
+    send(type, msg) {
+        let tosend;
+        if (msg === undefined) {
+            tosend = type;
+        } else if (typeof msg === "object") {
+            tosend = msg;
+            tosend.type = type;
+        } else {
+            tosend = { type: type, message: msg };
+        }
+        this.daemon.queueResponse(this.id, tosend);
+    }
+
+    error(message) {
+        this.send({ error: message });
+        if (this.listenerCount("error"))
+            this.emit("error", message);
+        this.close();
+    }
+
+    close() {
+        this.daemon.releaseJob(this.id);
+    }
 };
 
 class Server extends EventEmitter {
@@ -164,8 +207,8 @@ class Server extends EventEmitter {
             md5: req.headers["x-fisk-md5"]
         };
 
-        if (data.md5 && data.md5.length != 32) {
-            client.error(`Bad md5 sum: ${data.md5}`);
+        if (data.md5 && !cacheKey.isValid(data.md5)) {
+            client.error(`Bad cache key: ${data.md5}`);
             return;
         }
         const npmVersion = req.headers["x-fisk-npm-version"];
@@ -178,6 +221,11 @@ class Server extends EventEmitter {
         if (labels) {
             data.labels = labels.split(/ +/).filter(x => x);
         }
+        // ip:port of builders that already failed this job
+        const excludeBuilders = req.headers["x-fisk-exclude-builders"];
+        if (excludeBuilders) {
+            data.excludeBuilders = excludeBuilders.split(/ +/).filter(x => x);
+        }
         const clientName = req.headers["x-fisk-client-name"];
         if (clientName)
             data.name = clientName;
@@ -360,6 +408,112 @@ class Server extends EventEmitter {
         this.emit("builder", client);
     }
 
+    _handleDaemon(req, client) {
+        const configVersion = req.headers["x-fisk-config-version"];
+        if (configVersion != this.configVersion) {
+            client.error(`Bad config version, expected ${this.configVersion}, got ${configVersion}`);
+            return;
+        }
+
+        client.assign({ name: req.headers["x-fisk-daemon-name"],
+                        hostname: req.headers["x-fisk-daemon-hostname"],
+                        npmVersion: req.headers["x-fisk-npm-version"] });
+        const jobs = new Map();
+        let responses;
+        client.queueResponse = (id, message) => {
+            if (!responses) {
+                responses = [];
+                setImmediate(() => {
+                    client.send({ type: "builders", responses: responses });
+                    responses = undefined;
+                });
+            }
+            responses.push({ id: id, message: message });
+        };
+        client.releaseJob = id => {
+            const job = jobs.get(id);
+            if (job) {
+                jobs.delete(id);
+                job.emit("close", { code: 1000, reason: "released" });
+                job.removeAllListeners();
+            }
+        };
+
+        client.ws.on("message", msg => {
+            let json;
+            try {
+                json = JSON.parse(msg);
+            } catch (e) {
+            }
+            if (!json || typeof json !== "object") {
+                client.error("Unable to parse string message as JSON");
+                return;
+            }
+            switch (json.type) {
+            case "acquireBuilders":
+                if (!Array.isArray(json.requests)) {
+                    client.error("Need a requests array");
+                    return;
+                }
+                json.requests.forEach(request => {
+                    if (typeof request.id !== "number" || jobs.has(request.id)) {
+                        console.error("Bad builder request from daemon", client.ip, request.id);
+                        return;
+                    }
+                    const job = new DaemonJob(client, request.id, {
+                        type: Client.Type.Compile,
+                        ip: client.ip,
+                        environment: request.environment,
+                        sourceFile: request.sourceFile,
+                        md5: request.md5,
+                        cacheOnly: request.cacheOnly === true,
+                        npmVersion: request.npmVersion,
+                        builder: request.builder,
+                        labels: request.labels,
+                        excludeBuilders: Array.isArray(request.excludeBuilders) ? request.excludeBuilders : undefined,
+                        name: request.name,
+                        user: request.user,
+                        hostname: request.hostname
+                    });
+                    jobs.set(request.id, job);
+                    if (!job.environment) {
+                        job.error("No environment");
+                        return;
+                    }
+                    if (job.md5 && !cacheKey.isValid(job.md5)) {
+                        job.error(`Bad cache key: ${job.md5}`);
+                        return;
+                    }
+                    this.emit("compile", job);
+                });
+                break;
+            case "releaseBuilders":
+                if (Array.isArray(json.ids))
+                    json.ids.forEach(client.releaseJob);
+                break;
+            case "lookupManifests":
+                if (Array.isArray(json.lookups))
+                    client.emit("lookupManifests", json.lookups);
+                break;
+            case "storeManifests":
+                if (Array.isArray(json.manifests))
+                    client.emit("storeManifests", json.manifests);
+                break;
+            default:
+                console.error("Unknown message from daemon", client.ip, json.type);
+                break;
+            }
+        });
+        client.ws.on("close", (code, reason) => {
+            client.ws.removeAllListeners();
+            for (let id of Array.from(jobs.keys()))
+                client.releaseJob(id);
+            client.emit("close", { code: code, reason: reason });
+        });
+        client.ws.on("error", err => client.emit("error", err));
+        this.emit("daemon", client);
+    }
+
     _handleMonitor(req, client) {
         client.nonce = req.nonce;
         // console.log("Got nonce", req.nonce);
@@ -408,6 +562,10 @@ class Server extends EventEmitter {
             client = new Client({ type: Client.Builder, ws: ws, ip: ip, option: this.option });
             this._handleBuilder(req, client);
             break;
+        case "/daemon":
+            client = new Client({ type: Client.Type.Daemon, ws: ws, ip: ip });
+            this._handleDaemon(req, client);
+            break;
         case "/monitor":
             client = new Client({ type: Client.Type.Monitor, ws: ws, ip: ip });
             this._handleMonitor(req, client);